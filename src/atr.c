@@ -23,19 +23,7 @@
 #include "atr.h"
 #include <string.h>
 
-#ifdef HAVE_DEBUGLOG_H
-#include <debuglog.h>
-#else
-
-#define LogXxd(priority, fmt, data1, data2) do { } while(0)
-#define Log0(priority) do { } while(0)
-#define Log1(priority, fmt) do { } while(0)
-#define Log2(priority, fmt, data) do { } while(0)
-#define Log3(priority, fmt, data1, data2) do { } while(0)
-#define Log4(priority, fmt, data1, data2, data3) do { } while(0)
-#define Log5(priority, fmt, data1, data2, data3, data4) do { } while(0)
-#define Log9(priority, fmt, data1, data2, data3, data4, data5, data6, data7, data8) do { } while(0)
-#endif
+#include "log.h"
 
 int get_atr(enum atr_modulation modulation,
             const unsigned char *in, size_t inlen,
@@ -94,6 +82,24 @@ int get_atr(enum atr_modulation modulation,
       hb[7] = 0;
       hb_len = 8;
       break;
+    case ATR_ISO14443A_STORAGE:
+      if (inlen < 3)
+        return 0;
+      /* PC/SC part 3: category indicator, application identifier presence
+       * indicator, length, RID of the PC/SC workgroup, standard, card name
+       * and RFU */
+      hb[0] = 0x80;
+      hb[1] = 0x4f;
+      hb[2] = 0x0c;
+      hb[3] = 0xa0;
+      hb[4] = 0x00;
+      hb[5] = 0x00;
+      hb[6] = 0x03;
+      hb[7] = 0x06;
+      memcpy(&hb[8], in, 3);
+      memset(&hb[11], 0, 4);
+      hb_len = 15;
+      break;
     case ATR_DEFAULT:
       hb_len = 0;
       break;
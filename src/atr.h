@@ -24,6 +24,7 @@
 enum atr_modulation {
   ATR_ISO14443A_106,
   ATR_ISO14443B_106,
+  ATR_ISO14443A_STORAGE,
   ATR_DEFAULT,
 };
 
@@ -31,7 +32,8 @@ enum atr_modulation {
  * @brief
  *
  * @param [in]     modulation
- * @param [in]     in      ATS without TL/CRC1/CRC2 for \c ATR_ISO14443A_106 and ATQB for \c ATR_ISO14443B_106
+ * @param [in]     in      ATS without TL/CRC1/CRC2 for \c ATR_ISO14443A_106, ATQB for \c ATR_ISO14443B_106
+ *                         and standard and 2 bytes card name (PC/SC part 3) for \c ATR_ISO14443A_STORAGE
  * @param [in]     inlen   Length of \a in
  * @param [in,out] atr     where to store the ATR. Sould be big enough.
  * @param [in,out] atr_len Length of \a atr
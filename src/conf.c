@@ -0,0 +1,473 @@
+/*
+ * Copyright (C) 2010 Frank Morgner
+ *
+ * This file is part of ifdnfc.
+ *
+ * ifdnfc is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * ifdnfc is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * ifdnfc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "conf.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "log.h"
+
+static const struct {
+  const char *name;
+  nfc_modulation_type nmt;
+  nfc_baud_rate nbr;    // used when no bit rate is given
+} modulation_names[] = {
+  { "iso14443a",   NMT_ISO14443A,    NBR_106 },
+  { "iso14443b",   NMT_ISO14443B,    NBR_106 },
+  { "iso14443bi",  NMT_ISO14443BI,   NBR_106 },
+  { "iso14443b2sr", NMT_ISO14443B2SR, NBR_106 },
+  { "iso14443b2ct", NMT_ISO14443B2CT, NBR_106 },
+  { "felica",      NMT_FELICA,       NBR_212 },
+  { "jewel",       NMT_JEWEL,        NBR_106 },
+};
+
+static bool parse_bitrate(const char *s, nfc_baud_rate *nbr)
+{
+  switch (atoi(s)) {
+    case 106:
+      *nbr = NBR_106;
+      return true;
+    case 212:
+      *nbr = NBR_212;
+      return true;
+    case 424:
+      *nbr = NBR_424;
+      return true;
+    case 847:
+      *nbr = NBR_847;
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool parse_bool(const char *s, bool *b)
+{
+  if (!strcasecmp(s, "yes") || !strcasecmp(s, "true") || !strcmp(s, "1")) {
+    *b = true;
+    return true;
+  }
+  if (!strcasecmp(s, "no") || !strcasecmp(s, "false") || !strcmp(s, "0")) {
+    *b = false;
+    return true;
+  }
+  return false;
+}
+
+static bool parse_uint(const char *s, unsigned int *u)
+{
+  char *end;
+  unsigned long l;
+
+  // strtoul() takes "-1" as ULONG_MAX
+  if (strchr(s, '-'))
+    return false;
+  errno = 0;
+  l = strtoul(s, &end, 0);
+  if (end == s || *end != '\0' || errno == ERANGE || l > UINT_MAX)
+    return false;
+  *u = l;
+  return true;
+}
+
+// e.g. "iso14443a felica:212, felica:424"
+static bool parse_modulations(char *s, struct ifdnfc_profile *profile)
+{
+  char *tok, *saveptr;
+  profile->modulations_len = 0;
+
+  for (tok = strtok_r(s, " \t,", &saveptr); tok; tok = strtok_r(NULL, " \t,", &saveptr)) {
+    char *rate = strchr(tok, ':');
+    size_t i;
+
+    if (rate)
+      *rate++ = '\0';
+    for (i = 0; i < sizeof(modulation_names) / sizeof(*modulation_names); i++)
+      if (!strcasecmp(tok, modulation_names[i].name))
+        break;
+    if (i == sizeof(modulation_names) / sizeof(*modulation_names))
+      return false;
+    if (profile->modulations_len == IFDNFC_CONF_MAX_MODULATIONS)
+      return false;
+
+    nfc_modulation *nm = &profile->modulations[profile->modulations_len];
+    nm->nmt = modulation_names[i].nmt;
+    nm->nbr = modulation_names[i].nbr;
+    if (rate && !parse_bitrate(rate, &nm->nbr))
+      return false;
+    profile->modulations_len++;
+  }
+
+  return profile->modulations_len > 0;
+}
+
+// e.g. "a4 b0 ca", hexadecimal INS bytes
+static bool parse_ins_list(char *s, uint8_t *list, size_t max, size_t *len)
+{
+  char *tok, *saveptr, *end;
+  unsigned long ins;
+
+  *len = 0;
+  for (tok = strtok_r(s, " \t,", &saveptr); tok; tok = strtok_r(NULL, " \t,", &saveptr)) {
+    ins = strtoul(tok, &end, 16);
+    if (*end != '\0' || ins > 0xff)
+      return false;
+    if (*len == max)
+      return false;
+    list[(*len)++] = ins;
+  }
+
+  return true;
+}
+
+// Hexadecimal bytes, at least one
+static bool parse_hex(const char *s, uint8_t *buf, size_t size, size_t *len)
+{
+  unsigned int b;
+
+  *len = 0;
+  if (!*s || strlen(s) % 2)
+    return false;
+  for (; *s; s += 2) {
+    if (*len == size || !isxdigit((unsigned char) s[0]) || !isxdigit((unsigned char) s[1])
+        || sscanf(s, "%2x", &b) != 1)
+      return false;
+    buf[(*len)++] = b;
+  }
+
+  return true;
+}
+
+// "value" or "value/mask" of a fixed length
+static bool parse_masked(char *s, uint8_t *value, uint8_t *mask, size_t size)
+{
+  char *slash = strchr(s, '/');
+  size_t len;
+
+  memset(mask, 0xff, size);
+  if (slash) {
+    *slash = '\0';
+    if (!parse_hex(slash + 1, mask, size, &len) || len != size)
+      return false;
+  }
+  return parse_hex(s, value, size, &len) && len == size;
+}
+
+/*
+ * e.g. "sak=20,hb=8031 uid=04a2", filters separated by spaces, each with its
+ * criteria separated by commas
+ */
+static bool parse_filters(char *s, struct ifdnfc_target_filter *filters, size_t *len)
+{
+  char *rule, *crit, *saveptr, *saveptr2, *value;
+  struct ifdnfc_target_filter *f;
+
+  *len = 0;
+  for (rule = strtok_r(s, " \t", &saveptr); rule; rule = strtok_r(NULL, " \t", &saveptr)) {
+    if (*len == IFDNFC_CONF_MAX_FILTERS)
+      return false;
+    f = &filters[(*len)++];
+    memset(f, 0, sizeof *f);
+    for (crit = strtok_r(rule, ",", &saveptr2); crit; crit = strtok_r(NULL, ",", &saveptr2)) {
+      value = strchr(crit, '=');
+      if (!value)
+        return false;
+      *value++ = '\0';
+      if (!strcmp(crit, "atqa")) {
+        if (!parse_masked(value, f->atqa, f->atqa_mask, sizeof f->atqa))
+          return false;
+        f->has_atqa = true;
+      } else if (!strcmp(crit, "sak")) {
+        if (!parse_masked(value, &f->sak, &f->sak_mask, 1))
+          return false;
+        f->has_sak = true;
+      } else if (!strcmp(crit, "uid")) {
+        if (!parse_hex(value, f->uid, sizeof f->uid, &f->uid_len))
+          return false;
+      } else if (!strcmp(crit, "hb")) {
+        if (!parse_hex(value, f->hb, sizeof f->hb, &f->hb_len))
+          return false;
+      } else {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+static bool parse_profile_option(struct ifdnfc_profile *profile,
+                                 const char *key, char *value)
+{
+  unsigned int u;
+
+  if (!strcmp(key, "match")) {
+    if (strlen(value) >= sizeof(profile->match))
+      return false;
+    strcpy(profile->match, value);
+  } else if (!strcmp(key, "transceive_timeout")) {
+    if (!parse_uint(value, &u))
+      return false;
+    profile->transceive_timeout = u;
+  } else if (!strcmp(key, "infinite_select")) {
+    return parse_bool(value, &profile->infinite_select);
+  } else if (!strcmp(key, "halt_on_power_down")) {
+    return parse_bool(value, &profile->halt_on_power_down);
+  } else if (!strcmp(key, "modulations")) {
+    return parse_modulations(value, profile);
+  } else if (!strcmp(key, "max_bitrate")) {
+    return parse_bitrate(value, &profile->max_bitrate);
+  } else if (!strcmp(key, "presence_interval")) {
+    return parse_uint(value, &profile->presence_interval);
+  } else if (!strcmp(key, "removal_probes")) {
+    return parse_uint(value, &profile->removal_probes);
+  } else if (!strcmp(key, "removal_window")) {
+    return parse_uint(value, &profile->removal_window);
+  } else if (!strcmp(key, "calibrate")) {
+    return parse_bool(value, &profile->calibrate);
+  } else if (!strcmp(key, "secure_element")) {
+    return parse_bool(value, &profile->secure_element);
+  } else if (!strcmp(key, "uart_baud_rate")) {
+    return parse_uint(value, &profile->uart_baud_rate);
+  } else if (!strcmp(key, "secure_element_slot")) {
+    return parse_bool(value, &profile->secure_element_slot);
+  } else if (!strcmp(key, "uid_only")) {
+    return parse_bool(value, &profile->uid_only);
+  } else if (!strcmp(key, "soft_iso_dep")) {
+    return parse_bool(value, &profile->soft_iso_dep);
+  } else if (!strcmp(key, "iso_dep_fsd")) {
+    return parse_uint(value, &profile->iso_dep_fsd);
+  } else if (!strcmp(key, "iso_dep_retries")) {
+    return parse_uint(value, &profile->iso_dep_retries);
+  } else if (!strcmp(key, "desfire_chaining")) {
+    return parse_bool(value, &profile->desfire_chaining);
+  } else if (!strcmp(key, "rf_retries")) {
+    return parse_uint(value, &profile->rf_retries);
+  } else if (!strcmp(key, "retry_apdus")) {
+    return parse_ins_list(value, profile->retry_ins, IFDNFC_CONF_MAX_RETRY_INS,
+                          &profile->retry_ins_len);
+  } else if (!strcmp(key, "response_cache")) {
+    return parse_uint(value, &profile->response_cache);
+  } else if (!strcmp(key, "cache_apdus")) {
+    return parse_ins_list(value, profile->cache_ins, IFDNFC_CONF_MAX_CACHE_INS,
+                          &profile->cache_ins_len);
+  } else if (!strcmp(key, "watchdog_failures")) {
+    return parse_uint(value, &profile->watchdog_failures);
+  } else if (!strcmp(key, "watchdog_drift")) {
+    return parse_uint(value, &profile->watchdog_drift);
+  } else if (!strcmp(key, "allow_targets")) {
+    return parse_filters(value, profile->allow, &profile->allow_len);
+  } else if (!strcmp(key, "deny_targets")) {
+    return parse_filters(value, profile->deny, &profile->deny_len);
+  } else if (!strcmp(key, "mute_failures")) {
+    return parse_uint(value, &profile->mute_failures);
+  } else if (!strcmp(key, "mute_time")) {
+    return parse_uint(value, &profile->mute_time);
+  } else if (!strcmp(key, "rf_off_delay")) {
+    return parse_uint(value, &profile->rf.field_off_delay_ms);
+  } else if (!strcmp(key, "poll_idle_grace")) {
+    return parse_uint(value, &profile->rf.idle_grace_ms);
+  } else if (!strcmp(key, "poll_interval_min")) {
+    return parse_uint(value, &profile->rf.poll_interval_min_ms);
+  } else if (!strcmp(key, "poll_interval_max")) {
+    return parse_uint(value, &profile->rf.poll_interval_max_ms);
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+static char *strip(char *s)
+{
+  char *end;
+
+  while (isspace((unsigned char) *s))
+    s++;
+  end = s + strlen(s);
+  while (end > s && isspace((unsigned char) end[-1]))
+    end--;
+  *end = '\0';
+
+  return s;
+}
+
+void ifdnfc_conf_init(struct ifdnfc_conf *conf)
+{
+  struct ifdnfc_profile *defaults = &conf->defaults;
+
+  memset(conf, 0, sizeof *conf);
+  conf->max_devices = IFDNFC_DEFAULT_MAX_DEVICES;
+  strcpy(conf->state_file, IFDNFC_STATE_FILE);
+  conf->trace_threshold = IFDNFC_DEFAULT_TRACE_THRESHOLD;
+
+  strcpy(defaults->name, "default");
+  defaults->transceive_timeout = IFDNFC_DEFAULT_TRANSCEIVE_TIMEOUT;
+  defaults->infinite_select = false;
+  defaults->halt_on_power_down = true;
+  defaults->modulations[0].nmt = NMT_ISO14443A;
+  defaults->modulations[0].nbr = NBR_106;
+  defaults->modulations_len = 1;
+  defaults->max_bitrate = NBR_847;
+  defaults->presence_interval = 0;
+  defaults->removal_probes = 3;
+  defaults->removal_window = 300;
+  defaults->calibrate = true;
+  defaults->secure_element = false;
+  defaults->secure_element_slot = false;
+  defaults->uart_baud_rate = IFDNFC_DEFAULT_UART_BAUD_RATE;
+  defaults->uid_only = false;
+  defaults->soft_iso_dep = false;
+  defaults->iso_dep_fsd = 256;
+  defaults->iso_dep_retries = 2;
+  defaults->desfire_chaining = false;
+  defaults->rf_retries = 1;
+  // SELECT, READ BINARY, GET DATA
+  defaults->retry_ins[0] = 0xA4;
+  defaults->retry_ins[1] = 0xB0;
+  defaults->retry_ins[2] = 0xCA;
+  defaults->retry_ins_len = 3;
+  defaults->response_cache = 0;
+  // SELECT, READ BINARY, READ RECORD
+  defaults->cache_ins[0] = 0xA4;
+  defaults->cache_ins[1] = 0xB0;
+  defaults->cache_ins[2] = 0xB1;
+  defaults->cache_ins[3] = 0xB2;
+  defaults->cache_ins[4] = 0xB3;
+  defaults->cache_ins_len = 5;
+  defaults->watchdog_failures = 5;
+  defaults->watchdog_drift = 10;
+  defaults->allow_len = 0;
+  defaults->deny_len = 0;
+  defaults->mute_failures = 0;
+  defaults->mute_time = 30000;
+  defaults->rf.field_off_delay_ms = IFDNFC_RF_OFF_DELAY_MS;
+  defaults->rf.idle_grace_ms = IFDNFC_POLL_IDLE_GRACE_MS;
+  defaults->rf.poll_interval_min_ms = IFDNFC_POLL_INTERVAL_MIN_MS;
+  defaults->rf.poll_interval_max_ms = IFDNFC_POLL_INTERVAL_MAX_MS;
+}
+
+bool ifdnfc_conf_load(struct ifdnfc_conf *conf, const char *path)
+{
+  char buf[512];
+  struct ifdnfc_profile *profile = NULL;
+  unsigned int lineno = 0;
+  bool ok = true;
+  FILE *f;
+
+  f = fopen(path, "r");
+  if (!f) {
+    Log2(PCSC_LOG_DEBUG, "No configuration file %s, using defaults.", path);
+    return true;
+  }
+
+  while (fgets(buf, sizeof buf, f)) {
+    char *line, *value, *comment;
+
+    lineno++;
+    comment = strchr(buf, '#');
+    if (comment)
+      *comment = '\0';
+    line = strip(buf);
+    if (*line == '\0')
+      continue;
+
+    if (*line == '[') {
+      char name[sizeof profile->name];
+      if (sscanf(line, "[profile %31[^]]]", name) != 1) {
+        Log3(PCSC_LOG_ERROR, "%s:%u: invalid section.", path, lineno);
+        ok = false;
+        profile = NULL;
+        continue;
+      }
+      if (conf->profiles_len == IFDNFC_CONF_MAX_PROFILES) {
+        Log3(PCSC_LOG_ERROR, "%s:%u: too many profiles.", path, lineno);
+        ok = false;
+        break;
+      }
+      profile = &conf->profiles[conf->profiles_len++];
+      *profile = conf->defaults;
+      strcpy(profile->name, strip(name));
+      strcpy(profile->match, "*");
+      continue;
+    }
+
+    value = strchr(line, '=');
+    if (!value) {
+      Log3(PCSC_LOG_ERROR, "%s:%u: expected key = value.", path, lineno);
+      ok = false;
+      continue;
+    }
+    *value++ = '\0';
+    line = strip(line);
+    value = strip(value);
+
+    if (!profile && !strcmp(line, "max_devices")) {
+      if (parse_uint(value, &conf->max_devices))
+        continue;
+    } else if (!profile && !strcmp(line, "trace_file")) {
+      if (strlen(value) < sizeof conf->trace_file) {
+        strcpy(conf->trace_file, value);
+        continue;
+      }
+    } else if (!profile && !strcmp(line, "state_file")) {
+      if (strlen(value) < sizeof conf->state_file) {
+        strcpy(conf->state_file, value);
+        continue;
+      }
+    } else if (!profile && !strcmp(line, "trace_threshold")) {
+      if (parse_uint(value, &conf->trace_threshold))
+        continue;
+    } else if (parse_profile_option(profile ? profile : &conf->defaults, line, value)) {
+      continue;
+    }
+    Log4(PCSC_LOG_ERROR, "%s:%u: invalid option %s.", path, lineno, line);
+    ok = false;
+  }
+
+  fclose(f);
+  return ok;
+}
+
+static bool profile_matches(const struct ifdnfc_profile *profile, const char *connstring)
+{
+  return connstring && fnmatch(profile->match, connstring, 0) == 0;
+}
+
+const struct ifdnfc_profile *ifdnfc_conf_match(const struct ifdnfc_conf *conf,
+    const char *connstring, const char *driver_connstring)
+{
+  size_t i;
+
+  for (i = 0; i < conf->profiles_len; i++)
+    if (profile_matches(&conf->profiles[i], driver_connstring)
+        || profile_matches(&conf->profiles[i], connstring))
+      return &conf->profiles[i];
+
+  return &conf->defaults;
+}
@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2010 Frank Morgner
+ *
+ * This file is part of ifdnfc.
+ *
+ * ifdnfc is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * ifdnfc is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * ifdnfc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _CONF_H_
+#define _CONF_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <nfc/nfc.h>
+
+#define IFDNFC_DEFAULT_MAX_DEVICES        10
+#define IFDNFC_DEFAULT_TRANSCEIVE_TIMEOUT 5000 // ms, cf FWTmax in ISO14443-4
+#define IFDNFC_DEFAULT_UART_BAUD_RATE     921600
+
+/*
+ * RF power policy defaults. The field is kept on for IFDNFC_RF_OFF_DELAY_MS
+ * after the card was powered down or the last card left. Discovery polls at
+ * full rate for IFDNFC_POLL_IDLE_GRACE_MS after the last card was seen, then
+ * backs off exponentially up to IFDNFC_POLL_INTERVAL_MAX_MS.
+ */
+#ifndef IFDNFC_RF_OFF_DELAY_MS
+#define IFDNFC_RF_OFF_DELAY_MS        2000
+#endif
+#ifndef IFDNFC_POLL_IDLE_GRACE_MS
+#define IFDNFC_POLL_IDLE_GRACE_MS     10000
+#endif
+#ifndef IFDNFC_POLL_INTERVAL_MIN_MS
+#define IFDNFC_POLL_INTERVAL_MIN_MS   250
+#endif
+#ifndef IFDNFC_POLL_INTERVAL_MAX_MS
+#define IFDNFC_POLL_INTERVAL_MAX_MS   2000
+#endif
+
+#define IFDNFC_CONF_MAX_PROFILES    16
+#define IFDNFC_CONF_MAX_MODULATIONS 8
+#define IFDNFC_CONF_MAX_RETRY_INS   16
+#define IFDNFC_CONF_MAX_CACHE_INS   16
+#define IFDNFC_CONF_MAX_FILTERS     8
+
+struct ifdnfc_rf_policy {
+  unsigned int field_off_delay_ms;    // 0 keeps the field on forever
+  unsigned int idle_grace_ms;
+  unsigned int poll_interval_min_ms;
+  unsigned int poll_interval_max_ms;  // 0 disables the discovery backoff
+};
+
+/**
+ * @brief Criteria on an ISO14443-A target, all the given ones have to match
+ */
+struct ifdnfc_target_filter {
+  bool has_atqa;
+  uint8_t atqa[2];
+  uint8_t atqa_mask[2];
+  bool has_sak;
+  uint8_t sak;
+  uint8_t sak_mask;
+  uint8_t uid[10];                    // prefix of the UID, 0 bytes match all
+  size_t uid_len;
+  uint8_t hb[15];                     // prefix of the historical bytes of the ATS
+  size_t hb_len;
+};
+
+/**
+ * @brief Tuning parameters applied to a device whose connstring matches
+ */
+struct ifdnfc_profile {
+  char name[32];
+  char match[128];                    // fnmatch(3) pattern on the connstring
+  int transceive_timeout;             // ms
+  bool infinite_select;               // selections of a known card wait for it
+  bool halt_on_power_down;            // halt type A cards, wake them by UID on power up
+  nfc_modulation modulations[IFDNFC_CONF_MAX_MODULATIONS];
+  size_t modulations_len;
+  nfc_baud_rate max_bitrate;
+  unsigned int presence_interval;     // ms, 0 checks the card on every poll
+  unsigned int removal_probes;        // failed presence checks that confirm a removal
+  unsigned int removal_window;        // ms, the card is removed once it elapsed
+  bool calibrate;                     // fit probe timeout and presence interval to the link
+  bool secure_element;                // use the SE as card on hotplug
+  bool secure_element_slot;           // SE on a second slot, next to the RF one
+  unsigned int uart_baud_rate;        // highest rate negotiated with a pn532_uart chip
+  bool uid_only;                      // stop after anticollision, RATS on demand
+  bool soft_iso_dep;                  // ISO14443-4 of type A cards in the driver
+  unsigned int iso_dep_fsd;           // largest frame received, up to 256
+  unsigned int iso_dep_retries;       // retransmissions of a block
+  bool desfire_chaining;              // collect DESFire 91 AF frames in the driver
+  unsigned int rf_retries;            // recovery attempts after a transient RF error
+  uint8_t retry_ins[IFDNFC_CONF_MAX_RETRY_INS]; // INS of the APDUs safe to repeat
+  size_t retry_ins_len;
+  unsigned int response_cache;        // bytes of memoised responses, 0 disables
+  uint8_t cache_ins[IFDNFC_CONF_MAX_CACHE_INS]; // INS of the side-effect free APDUs
+  size_t cache_ins_len;
+  unsigned int watchdog_failures;     // device errors in a row before a reopen, 0 disables
+  unsigned int watchdog_drift;        // slowdown factor before a reopen, 0 disables
+  struct ifdnfc_target_filter allow[IFDNFC_CONF_MAX_FILTERS]; // one has to match, if any
+  size_t allow_len;
+  struct ifdnfc_target_filter deny[IFDNFC_CONF_MAX_FILTERS];  // none may match
+  size_t deny_len;
+  unsigned int mute_failures;         // failed activations before a card is ignored, 0 disables
+  unsigned int mute_time;             // ms a card is ignored
+  struct ifdnfc_rf_policy rf;
+};
+
+#define IFDNFC_DEFAULT_TRACE_THRESHOLD    200  // ms
+
+#ifndef IFDNFC_STATE_FILE
+#define IFDNFC_STATE_FILE "/var/lib/ifdnfc/state"
+#endif
+
+struct ifdnfc_conf {
+  unsigned int max_devices;
+  char trace_file[256];               // empty disables tracing
+  unsigned int trace_threshold;       // ms
+  char state_file[256];               // activations to restore, empty disables
+  struct ifdnfc_profile defaults;
+  struct ifdnfc_profile profiles[IFDNFC_CONF_MAX_PROFILES];
+  size_t profiles_len;
+};
+
+/**
+ * @brief Initialize \a conf with the built-in defaults
+ */
+void ifdnfc_conf_init(struct ifdnfc_conf *conf);
+
+/**
+ * @brief Read the configuration file
+ *
+ * Settings before the first section are defaults for all profiles. Each
+ * <tt>[profile name]</tt> section starts from these defaults. A missing file
+ * leaves \a conf untouched.
+ *
+ * @param [in,out] conf
+ * @param [in]     path
+ *
+ * @return false if the file exists but could not be parsed completely
+ */
+bool ifdnfc_conf_load(struct ifdnfc_conf *conf, const char *path);
+
+/**
+ * @brief Find the profile for a device
+ *
+ * @param [in] conf
+ * @param [in] connstring  connstring used to open the device
+ * @param [in] driver_connstring  connstring reported by libnfc, may be \c NULL
+ *
+ * @return the first matching profile or the defaults
+ */
+const struct ifdnfc_profile *ifdnfc_conf_match(const struct ifdnfc_conf *conf,
+    const char *connstring, const char *driver_connstring);
+
+#endif
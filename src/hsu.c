@@ -0,0 +1,317 @@
+/*
+ * Copyright (C) 2010 Frank Morgner
+ *
+ * This file is part of ifdnfc.
+ *
+ * ifdnfc is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * ifdnfc is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * ifdnfc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "hsu.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define HSU_PREFIX     "pn532_uart:"
+#define HSU_TIMEOUT_MS 100
+
+#define PN532_GET_FIRMWARE_VERSION 0x02
+#define PN532_SET_SERIAL_BAUD_RATE 0x10
+#define PN532_SAM_CONFIGURATION    0x14
+
+/*
+ * Rates of SetSerialBaudRate (PN532 user manual, 7.2.13) in ascending order.
+ * 1288000 baud is left out, termios has no constant for it.
+ */
+static const struct {
+  uint32_t rate;
+  speed_t speed;
+  uint8_t br;
+} hsu_rates[] = {
+  { 9600, B9600, 0x00 },
+  { 19200, B19200, 0x01 },
+  { 38400, B38400, 0x02 },
+  { 57600, B57600, 0x03 },
+  { 115200, B115200, 0x04 },
+#ifdef B230400
+  { 230400, B230400, 0x05 },
+#endif
+#ifdef B460800
+  { 460800, B460800, 0x06 },
+#endif
+#ifdef B921600
+  { 921600, B921600, 0x07 },
+#endif
+};
+
+#define HSU_RATES (sizeof hsu_rates / sizeof *hsu_rates)
+
+static int hsu_rate_index(uint32_t rate)
+{
+  size_t i;
+
+  for (i = 0; i < HSU_RATES; i++)
+    if (hsu_rates[i].rate == rate)
+      return i;
+  return -1;
+}
+
+bool ifdnfc_hsu_parse(const char *connstring, char *port, size_t port_len,
+                      uint32_t *rate)
+{
+  const char *p, *end;
+  char *rate_end;
+  size_t len;
+
+  if (strncmp(connstring, HSU_PREFIX, strlen(HSU_PREFIX)))
+    return false;
+  p = connstring + strlen(HSU_PREFIX);
+  end = strchr(p, ':');
+  len = end ? (size_t) (end - p) : strlen(p);
+  if (!len || len >= port_len)
+    return false;
+  memcpy(port, p, len);
+  port[len] = '\0';
+
+  *rate = IFDNFC_HSU_DEFAULT_RATE;
+  if (end) {
+    *rate = strtoul(end + 1, &rate_end, 10);
+    if (*rate_end != '\0' || !*rate)
+      return false;
+  }
+
+  return true;
+}
+
+static bool hsu_set_speed(int fd, speed_t speed)
+{
+  struct termios tio;
+
+  if (tcgetattr(fd, &tio) < 0)
+    return false;
+  cfmakeraw(&tio);
+  tio.c_cflag |= CLOCAL | CREAD;
+  // Dropping DTR on close resets some adapters
+  tio.c_cflag &= ~HUPCL;
+  tio.c_cc[VMIN] = 0;
+  tio.c_cc[VTIME] = 0;
+  if (cfsetispeed(&tio, speed) < 0 || cfsetospeed(&tio, speed) < 0)
+    return false;
+  if (tcsetattr(fd, TCSANOW, &tio) < 0)
+    return false;
+  return tcflush(fd, TCIOFLUSH) == 0;
+}
+
+static bool hsu_write(int fd, const uint8_t *buf, size_t len)
+{
+  ssize_t res;
+
+  while (len) {
+    res = write(fd, buf, len);
+    if (res < 0)
+      return false;
+    buf += res;
+    len -= res;
+  }
+  return tcdrain(fd) == 0;
+}
+
+static bool hsu_read(int fd, uint8_t *buf, size_t len)
+{
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  ssize_t res;
+
+  while (len) {
+    if (poll(&pfd, 1, HSU_TIMEOUT_MS) != 1)
+      return false;
+    res = read(fd, buf, len);
+    if (res <= 0)
+      return false;
+    buf += res;
+    len -= res;
+  }
+  return true;
+}
+
+// Normal information frame from the host
+static bool hsu_send(int fd, const uint8_t *data, size_t len)
+{
+  uint8_t frame[16];
+  uint8_t dcs = 0;
+  size_t i;
+
+  frame[0] = 0x00;
+  frame[1] = 0x00;
+  frame[2] = 0xFF;
+  frame[3] = len;
+  frame[4] = -len;
+  for (i = 0; i < len; i++) {
+    frame[5 + i] = data[i];
+    dcs -= data[i];
+  }
+  frame[5 + len] = dcs;
+  frame[6 + len] = 0x00;
+
+  return hsu_write(fd, frame, len + 7);
+}
+
+// Next frame from the chip: its payload length, 0 for an ACK, -1 on error
+static int hsu_receive(int fd, uint8_t *data, size_t size)
+{
+  uint8_t b, prev = 0xFF, len[2], tail[2];
+  uint8_t sum;
+  size_t i;
+
+  // Start code, after the preamble or garbage
+  for (;;) {
+    if (!hsu_read(fd, &b, 1))
+      return -1;
+    if (prev == 0x00 && b == 0xFF)
+      break;
+    prev = b;
+  }
+
+  if (!hsu_read(fd, len, sizeof len))
+    return -1;
+  if (len[0] == 0x00 && len[1] == 0xFF)
+    return hsu_read(fd, &b, 1) ? 0 : -1;
+  if ((uint8_t) (len[0] + len[1]) != 0 || len[0] > size)
+    return -1;
+  if (!hsu_read(fd, data, len[0]) || !hsu_read(fd, tail, sizeof tail))
+    return -1;
+  for (sum = tail[0], i = 0; i < len[0]; i++)
+    sum += data[i];
+
+  return sum ? -1 : len[0];
+}
+
+static bool hsu_command(int fd, const uint8_t *cmd, size_t len)
+{
+  uint8_t resp[8];
+  int res;
+
+  if (!hsu_send(fd, cmd, len) || hsu_receive(fd, resp, sizeof resp) != 0)
+    return false;
+  res = hsu_receive(fd, resp, sizeof resp);
+
+  return res >= 2 && resp[0] == 0xD5 && resp[1] == cmd[1] + 1;
+}
+
+// Switch the chip from one rate to another and check it answers at the new one
+static bool hsu_switch(const char *port, int from, int to)
+{
+  // Wakes the chip up from power down, SAMConfiguration has to follow
+  const uint8_t wakeup[16] = { 0x55, 0x55 };
+  const uint8_t sam[] = { 0xD4, PN532_SAM_CONFIGURATION, 0x01 };
+  const uint8_t version[] = { 0xD4, PN532_GET_FIRMWARE_VERSION };
+  const uint8_t ack[] = { 0x00, 0x00, 0xFF, 0x00, 0xFF, 0x00 };
+  uint8_t set[] = { 0xD4, PN532_SET_SERIAL_BAUD_RATE, hsu_rates[to].br };
+  const struct timespec settle = { 0, 10000000 };
+  bool ok;
+  int fd;
+
+  fd = open(port, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0) {
+    Log2(PCSC_LOG_ERROR, "Could not open %s.", port);
+    return false;
+  }
+  // The chip changes its rate once it got the ACK for its response
+  ok = hsu_set_speed(fd, hsu_rates[from].speed)
+       && hsu_write(fd, wakeup, sizeof wakeup)
+       && hsu_command(fd, sam, sizeof sam)
+       && hsu_command(fd, set, sizeof set)
+       && hsu_write(fd, ack, sizeof ack);
+  if (ok) {
+    nanosleep(&settle, NULL);
+    ok = hsu_set_speed(fd, hsu_rates[to].speed)
+         && hsu_command(fd, version, sizeof version);
+  }
+  close(fd);
+
+  Log4(PCSC_LOG_DEBUG, "%s: %lu baud %s.", port, (unsigned long) hsu_rates[to].rate,
+       ok ? "works" : "does not work");
+  return ok;
+}
+
+// Whether the chip answers at a rate
+static bool hsu_ping(const char *port, int at)
+{
+  const uint8_t wakeup[16] = { 0x55, 0x55 };
+  const uint8_t sam[] = { 0xD4, PN532_SAM_CONFIGURATION, 0x01 };
+  const uint8_t version[] = { 0xD4, PN532_GET_FIRMWARE_VERSION };
+  bool ok;
+  int fd;
+
+  fd = open(port, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0) {
+    Log2(PCSC_LOG_ERROR, "Could not open %s.", port);
+    return false;
+  }
+  ok = hsu_set_speed(fd, hsu_rates[at].speed)
+       && hsu_write(fd, wakeup, sizeof wakeup)
+       && hsu_command(fd, sam, sizeof sam)
+       && hsu_command(fd, version, sizeof version);
+  close(fd);
+
+  return ok;
+}
+
+uint32_t ifdnfc_hsu_probe(const char *port)
+{
+  size_t i;
+
+  for (i = HSU_RATES; i > 0; i--)
+    if (hsu_ping(port, i - 1)) {
+      Log3(PCSC_LOG_DEBUG, "%s answers at %lu baud.", port, (unsigned long) hsu_rates[i - 1].rate);
+      return hsu_rates[i - 1].rate;
+    }
+
+  return 0;
+}
+
+uint32_t ifdnfc_hsu_negotiate(const char *port, uint32_t rate, uint32_t max)
+{
+  int from = hsu_rate_index(rate);
+  size_t i;
+
+  if (from < 0)
+    return rate;
+  for (i = from + 1; i < HSU_RATES && hsu_rates[i].rate <= max; i++) {
+    if (!hsu_switch(port, from, i)) {
+      // The chip may be at the new rate with a link that does not work
+      hsu_switch(port, i, from);
+      break;
+    }
+    from = i;
+  }
+
+  return hsu_rates[from].rate;
+}
+
+bool ifdnfc_hsu_restore(const char *port, uint32_t rate, uint32_t target)
+{
+  int from = hsu_rate_index(rate), to = hsu_rate_index(target);
+
+  if (from < 0 || to < 0)
+    return false;
+  return hsu_switch(port, from, to);
+}
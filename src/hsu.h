@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2010 Frank Morgner
+ *
+ * This file is part of ifdnfc.
+ *
+ * ifdnfc is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * ifdnfc is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * ifdnfc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _HSU_H_
+#define _HSU_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define IFDNFC_HSU_DEFAULT_RATE 115200
+
+/**
+ * @brief Split a pn532_uart connstring into serial port and baud rate
+ *
+ * @param [in]  connstring  e.g. "pn532_uart:/dev/ttyUSB0:115200"
+ * @param [out] port
+ * @param [in]  port_len
+ * @param [out] rate        rate of the connstring, 115200 if it has none
+ *
+ * @return false for other devices
+ */
+bool ifdnfc_hsu_parse(const char *connstring, char *port, size_t port_len,
+                      uint32_t *rate);
+
+/**
+ * @brief Raise the baud rate of the PN532 on \a port step by step
+ *
+ * Each step sends SetSerialBaudRate at the current rate and checks that the
+ * chip answers at the new one. The port must not be open elsewhere.
+ *
+ * @param [in] port
+ * @param [in] rate  rate the chip runs at
+ * @param [in] max   highest rate to try
+ *
+ * @return rate the chip runs at afterwards, \a rate if no step worked
+ */
+uint32_t ifdnfc_hsu_negotiate(const char *port, uint32_t rate, uint32_t max);
+
+/**
+ * @brief Find the rate the PN532 on \a port runs at
+ *
+ * A chip left at a negotiated rate, e.g. by pcscd before a restart, does not
+ * answer at the rate of its connstring. The rates are tried from the highest
+ * to the lowest. The port must not be open elsewhere.
+ *
+ * @param [in] port
+ *
+ * @return rate the chip answered at, 0 if none
+ */
+uint32_t ifdnfc_hsu_probe(const char *port);
+
+/**
+ * @brief Switch the PN532 on \a port from \a rate back to \a target
+ *
+ * @return whether the chip answered at \a target
+ */
+bool ifdnfc_hsu_restore(const char *port, uint32_t rate, uint32_t target);
+
+#endif
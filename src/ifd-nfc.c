@@ -22,22 +22,18 @@
 
 #include "ifd-nfc.h"
 #include "atr.h"
+#include "conf.h"
+#include "trace.h"
+#include "t2t.h"
+#include "hsu.h"
+#include "memo.h"
+#include "isodep.h"
+#include "state.h"
+#include "worker.h"
 
-#ifdef HAVE_DEBUGLOG_H
-#include <debuglog.h>
-#else
-
-#define LogXxd(priority, fmt, data1, data2) do { } while(0)
-
-enum {
-	PCSC_LOG_DEBUG = 0,
-	PCSC_LOG_INFO,
-	PCSC_LOG_ERROR,
-	PCSC_LOG_CRITICAL
-};
-
-#ifdef HAVE_SYSLOG_H
+#include "log.h"
 
+#if !defined(HAVE_DEBUGLOG_H) && defined(HAVE_SYSLOG_H)
 #include <stdarg.h>
 #include <stdio.h>
 #include <syslog.h>
@@ -68,25 +64,6 @@ void log_msg(const int priority, const char *fmt, ...)
 
 	syslog(syslog_level, "%s", debug_buffer);
 }
-#define Log0(priority) log_msg(priority, "%s:%d:%s()", __FILE__, __LINE__, __FUNCTION__)
-#define Log1(priority, fmt) log_msg(priority, "%s:%d:%s() " fmt, __FILE__, __LINE__, __FUNCTION__)
-#define Log2(priority, fmt, data) log_msg(priority, "%s:%d:%s() " fmt, __FILE__, __LINE__, __FUNCTION__, data)
-#define Log3(priority, fmt, data1, data2) log_msg(priority, "%s:%d:%s() " fmt, __FILE__, __LINE__, __FUNCTION__, data1, data2)
-#define Log4(priority, fmt, data1, data2, data3) log_msg(priority, "%s:%d:%s() " fmt, __FILE__, __LINE__, __FUNCTION__, data1, data2, data3)
-#define Log5(priority, fmt, data1, data2, data3, data4) log_msg(priority, "%s:%d:%s() " fmt, __FILE__, __LINE__, __FUNCTION__, data1, data2, data3, data4)
-#define Log9(priority, fmt, data1, data2, data3, data4, data5, data6, data7, data8) log_msg(priority, "%s:%d:%s() " fmt, __FILE__, __LINE__, __FUNCTION__, data1, data2, data3, data4, data5, data6, data7, data8)
-
-#else
-
-#define Log0(priority) do { } while(0)
-#define Log1(priority, fmt) do { } while(0)
-#define Log2(priority, fmt, data) do { } while(0)
-#define Log3(priority, fmt, data1, data2) do { } while(0)
-#define Log4(priority, fmt, data1, data2, data3) do { } while(0)
-#define Log5(priority, fmt, data1, data2, data3, data4) do { } while(0)
-#define Log9(priority, fmt, data1, data2, data3, data4, data5, data6, data7, data8) do { } while(0)
-
-#endif
 #endif
 
 #ifdef HAVE_IFDHANDLER_H
@@ -100,6 +77,10 @@ void log_msg(const int priority, const char *fmt, ...)
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
 
 /*
  * This implementation was written based on information provided by the
@@ -114,546 +95,3697 @@ void log_msg(const int priority, const char *fmt, ...)
  *   http://www.pcscworkgroup.com/specifications/files/pcsc3_v2.01.09.pdf
  */
 
+/*
+ * RF state of the slot. Each IFDH call moves it along one transition and
+ * only sends the RF commands this transition needs:
+ *
+ *   FIELD_OFF --init--> IDLE --discovery--> SELECTED <--power--> ACTIVE
+ *   SELECTED --field off--> HALTED --init + select--> SELECTED
+ *   ACTIVE --power down--> ASLEEP --select by UID--> SELECTED
+ *   ASLEEP --field off--> HALTED
+ *   SELECTED, ACTIVE, HALTED, ASLEEP --card lost--> REMOVED --discovery--> SELECTED
+ */
+enum ifd_slot_state {
+  IFDNFC_SLOT_FIELD_OFF,    // field off, no card known
+  IFDNFC_SLOT_IDLE,         // field on, no card
+  IFDNFC_SLOT_SELECTED,     // card selected, ISO-DEP activated when supported
+  IFDNFC_SLOT_ACTIVE,       // card powered up by pcscd
+  IFDNFC_SLOT_HALTED,       // card known but field off, needs to be selected again
+  IFDNFC_SLOT_REMOVED,      // card lost, field on
+  IFDNFC_SLOT_ASLEEP,       // ISO14443-A card halted by a power down, field on
+};
+
+static const char *slot_state_names[] = {
+  "field off", "idle", "selected", "active", "halted", "removed",
+  "asleep",
+};
+
+/*
+ * Cheapest way to tell whether a selected card is still there without
+ * disturbing the session an application has with it
+ */
+enum ifd_presence_probe {
+  IFDNFC_PROBE_GENERIC,     // nfc_initiator_target_is_present()
+  IFDNFC_PROBE_ISO_DEP,     // same, the reader sends a presence check block
+  IFDNFC_PROBE_T2T,         // READ of page 0
+  IFDNFC_PROBE_MIFARE,      // READ of the authenticated block, generic before
+  IFDNFC_PROBE_RESELECT,    // deselect and select by UID, before RATS
+  IFDNFC_PROBE_SOFT_ISO_DEP,  // R(NAK) of the driver's ISO-DEP layer
+};
+
+static const char *presence_probe_names[] = {
+  "generic", "ISO-DEP", "Type 2 READ", "MIFARE Classic READ", "reselect",
+  "driver ISO-DEP",
+};
+
+#define IFDNFC_PROBE_TIMEOUT_MS 100   // without calibration
+
+// SELECTs kept for the response cache, each after its length byte
+#define IFDNFC_MEMO_MAX_PATH 256
+
 struct ifd_slot {
-  bool present;
-  bool initiated;
+  enum ifd_slot_state state;
+  enum ifd_presence_probe probe;
+  bool mifare_authenticated;  // an application authenticated mifare_block
+  uint8_t mifare_block;
+  bool iso_dep_pending;     // UID-only mode skipped RATS of an ISO14443-4 card
+  bool soft_iso_dep;        // the driver activated ISO14443-4, see isodep.h
+  struct t2t_tag t2t;       // READ BINARY backend of Type 2 tags
+  uint8_t memo_path[IFDNFC_MEMO_MAX_PATH];  // SELECTs since the last absolute one
+  size_t memo_path_len;
+  size_t memo_path_sent;    // part of memo_path the card got
+  bool memo_off;            // an APDU outside of cache_apdus reached the card
+  bool reset;               // lost its session, reported absent once, see slot_report_reset()
+  uint64_t last_seen;       // last time the card answered
   nfc_target target;
   unsigned char atr[MAX_ATR_SIZE];
   size_t atr_len;
 };
 
+/*
+ * Cards that keep failing activation, ignored by discovery for a while
+ * (mute_failures of the profile)
+ */
+#define IFDNFC_MUTE_CARDS 8
+
+struct ifdnfc_mute_card {
+  uint8_t uid[10];
+  size_t uid_len;
+  unsigned int failures;    // failed activations in a row
+  uint64_t until;           // ignored until then once failures reached the limit
+  uint64_t last_failure;
+};
+
+#define IFDNFC_EVENTS 16
+
+struct ifdnfc_event {
+  uint8_t type;
+  uint8_t atqa[2];
+  uint8_t sak;
+  uint8_t uid_len;
+  uint8_t uid[10];
+  uint8_t atr_len;
+  uint8_t atr[MAX_ATR_SIZE];
+};
+
 struct ifd_device {
   nfc_device *device;
+  nfc_connstring connstring;
   struct ifd_slot slot;
   bool connected;
   bool secure_element_as_card;
   int Lun;
+  char device_name[256];    // DEVICENAME, key of the saved activation
+  struct ifd_device *host;  // SE slot: entry of slot 0, which owns the reader
+  struct ifd_device *se;    // slot 0: entry of the SE slot, if any
+  struct ifd_device *chip_owner;  // slot 0: slot the chip is set up for
+  uint32_t uart_rate;       // baud rate of pn532_uart readers, 0 for others
+  uint32_t link_rtt;        // us, measured at open, 0 if unknown. Guarded by rf_lock
+  unsigned int probe_timeout;     // ms, presence checks sent as READ
+  unsigned int presence_interval; // ms, at least the one of the profile
+  unsigned int poll_interval_min; // ms, of discovery, at least the one of the profile
+  unsigned int worker_margin;     // ms, waited for the worker on top of transceive_timeout
+  unsigned int request_timeout;   // ms, the sum of both for pcscd. Guarded by rf_lock
+  uint8_t slots;            // TAG_IFD_SLOTS_NUMBER of the profile, guarded by rf_lock
+  struct ifdnfc_profile profile;
+  struct ifdnfc_memo memo;  // responses of the cards seen, used by the worker
+  struct isodep iso_dep;    // session of the soft_iso_dep layer, used by the worker
+  int com_timeout;          // ms, NP_TIMEOUT_COM set last, -1 for the one of libnfc
+  struct ifdnfc_trace trace;
+  uint64_t last_activity;   // last time a card was seen or powered down
+  uint64_t last_miss;       // us, end of the last presence check without a card
+  uint64_t card_entered;    // us, see IFDNFC_ATTR_CARD_ENTERED
+  uint64_t next_poll;       // discovery is skipped until then
+  uint64_t deadline;        // the caller of the request being executed gives up then
+  struct ifdnfc_mute_card mute[IFDNFC_MUTE_CARDS];
+  unsigned int poll_interval;
+  struct ifdnfc_worker worker;    // executes all I/O with the device
+  pthread_mutex_t rf_lock;  // guards the fields below, used from any thread
+  pthread_cond_t rf_event;
+  bool rf_busy;             // a libnfc command is in flight
+  bool rf_aborted;          // the request being executed was cancelled
+  bool poll_stop;           // the reader goes away, blocking waits return
+  bool present;             // ifdnfc_slot_present() for the threads of pcscd
+  bool reported;            // what IFDHICCPresence() returned last
+  uint32_t rf_commands;     // RF commands sent, guarded by rf_lock
+  uint32_t polls;           // presence checks, guarded by rf_lock
+  uint32_t poll_rf_commands;  // RF commands sent by presence checks
+  uint32_t last_poll_rf_commands;
+  uint32_t restarts;        // reopened by the watchdog, guarded by rf_lock
+  bool reopen_due;          // guarded by rf_lock
+  unsigned int rf_failures; // consecutive device errors, see rf_end()
+  uint64_t rf_started;      // start of the libnfc command in flight
+  uint32_t rtt_fast;        // response time averages of chip commands, ms * 16
+  uint32_t rtt_slow;
+  unsigned int rtt_samples;
+  uint64_t next_reopen;     // earliest retry after a failed reopen
+  struct ifdnfc_event events[IFDNFC_EVENTS];  // guarded by rf_lock
+  size_t events_head;
+  size_t events_len;
+  unsigned int events_dropped;
 };
 
 nfc_context *context = NULL;
 
-#define IFDNFC_MAX_DEVICES 10
+#define IFDNFC_MAX_DEVICES 32
 static struct ifd_device ifd_devices[IFDNFC_MAX_DEVICES];
 static bool ifdnfc_initialized = false;
+// protects the allocation of ifd_devices
+static pthread_mutex_t ifd_devices_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static nfc_connstring ifd_connstring;
+#ifndef IFDNFC_CONF_FILE
+#define IFDNFC_CONF_FILE "/etc/ifdnfc.conf"
+#endif
+static struct ifdnfc_conf ifdnfc_conf;
 
-static const nfc_modulation supported_modulations[] = {
-  { NMT_ISO14443A, NBR_106 },
-};
+/*
+ * Time the submitter of a request waits for the worker on top of the
+ * transceive timeout, before it gives up on a stalled device. Calibration
+ * lowers it for fast host links, see ifdnfc_timing_update().
+ */
+#define IFDNFC_WORKER_MARGIN_MS   1000
+#define IFDNFC_CONTROL_TIMEOUT_MS 10000
+
+static int ifdnfc_max_devices(void)
+{
+  if (ifdnfc_conf.max_devices && ifdnfc_conf.max_devices < IFDNFC_MAX_DEVICES)
+    return ifdnfc_conf.max_devices;
+  return IFDNFC_MAX_DEVICES;
+}
 
 static int lun2device_index(DWORD Lun)
 {
   size_t i;
   // Find slot containing Lun
-  for (i = 0; i < sizeof(ifd_devices); i++)
-    if (ifd_devices[i].Lun == Lun) {
+  for (i = 0; i < IFDNFC_MAX_DEVICES; i++)
+    if (ifd_devices[i].Lun == (int) Lun) {
       return i;
     }
   // Slot not found
   return -1;
 }
 
-static void ifdnfc_disconnect(struct ifd_device *ifdnfc)
+static uint64_t ifdnfc_now_ms(void)
 {
-  if (ifdnfc->connected) {
-    if (ifdnfc->slot.present) {
-      if (nfc_initiator_deselect_target(ifdnfc->device) < 0) {
-        Log3(PCSC_LOG_ERROR, "Could not disconnect from %s (%s).", str_nfc_modulation_type(ifdnfc->slot.target.nm.nmt), nfc_strerror(ifdnfc->device));
-      } else {
-        ifdnfc->slot.present = false;
-      }
-    }
-    nfc_close(ifdnfc->device);
-    ifdnfc->connected = false;
-    ifdnfc->device = NULL;
-    ifdnfc->Lun = -1;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t ifdnfc_now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool ifdnfc_slot_present(const struct ifd_slot *slot)
+{
+  return slot->state == IFDNFC_SLOT_SELECTED
+         || slot->state == IFDNFC_SLOT_ACTIVE
+         || slot->state == IFDNFC_SLOT_HALTED
+         || slot->state == IFDNFC_SLOT_ASLEEP;
+}
+
+// Presence as the worker left it, for the threads of pcscd
+static bool ifdnfc_present(struct ifd_device *ifdnfc)
+{
+  bool present;
+
+  pthread_mutex_lock(&ifdnfc->rf_lock);
+  present = ifdnfc->present;
+  pthread_mutex_unlock(&ifdnfc->rf_lock);
+
+  return present;
+}
+
+/*
+ * Card events for IFDNFC_CTRL_GET_EVENT, queued by the detection path. When
+ * nobody picks them up the oldest ones are dropped.
+ */
+static void ifdnfc_event_push(struct ifd_device *ifdnfc, uint8_t type)
+{
+  struct ifdnfc_event *event;
+  const nfc_target *nt = &ifdnfc->slot.target;
+
+  pthread_mutex_lock(&ifdnfc->rf_lock);
+  if (ifdnfc->events_len == IFDNFC_EVENTS) {
+    ifdnfc->events_head = (ifdnfc->events_head + 1) % IFDNFC_EVENTS;
+    ifdnfc->events_len--;
+    ifdnfc->events_dropped++;
+  }
+  event = &ifdnfc->events[(ifdnfc->events_head + ifdnfc->events_len) % IFDNFC_EVENTS];
+  memset(event, 0, sizeof *event);
+  event->type = type;
+  if (nt->nm.nmt == NMT_ISO14443A) {
+    memcpy(event->atqa, nt->nti.nai.abtAtqa, sizeof event->atqa);
+    event->sak = nt->nti.nai.btSak;
+    event->uid_len = nt->nti.nai.szUidLen;
+    memcpy(event->uid, nt->nti.nai.abtUid, event->uid_len);
   }
+  event->atr_len = ifdnfc->slot.atr_len;
+  memcpy(event->atr, ifdnfc->slot.atr, event->atr_len);
+  ifdnfc->events_len++;
+  pthread_cond_broadcast(&ifdnfc->rf_event);
+  pthread_mutex_unlock(&ifdnfc->rf_lock);
 }
 
-static bool ifdnfc_target_to_atr(struct ifd_device *ifdnfc)
+static void ifdnfc_slot_set(struct ifd_device *ifdnfc, enum ifd_slot_state state)
 {
-  unsigned char atqb[12];
-  ifdnfc->slot.atr_len = sizeof(ifdnfc->slot.atr);
+  bool was_present = ifdnfc_slot_present(&ifdnfc->slot);
 
-  switch (ifdnfc->slot.target.nm.nmt) {
-    case NMT_ISO14443A:
-      /* libnfc already strips TL and CRC1/CRC2 */
-      if (!get_atr(ATR_ISO14443A_106,
-                   ifdnfc->slot.target.nti.nai.abtAts, ifdnfc->slot.target.nti.nai.szAtsLen,
-                   (unsigned char *) ifdnfc->slot.atr, &(ifdnfc->slot.atr_len))) {
-        Log1(PCSC_LOG_DEBUG, "get_atr: FAIL");
-        ifdnfc->slot.atr_len = 0;
-        return false;
-      }
-      Log1(PCSC_LOG_DEBUG, "get_atr: OK");
-      break;
-    case NMT_ISO14443B:
-      // First ATQB byte always equal to 0x50
-      atqb[0] = 0x50;
+  if (ifdnfc->slot.state == state)
+    return;
+  Log3(PCSC_LOG_DEBUG, "Slot %s -> %s.", slot_state_names[ifdnfc->slot.state], slot_state_names[state]);
+  ifdnfc->slot.state = state;
+  pthread_mutex_lock(&ifdnfc->rf_lock);
+  ifdnfc->present = ifdnfc_slot_present(&ifdnfc->slot);
+  pthread_mutex_unlock(&ifdnfc->rf_lock);
+  if (state != IFDNFC_SLOT_SELECTED && state != IFDNFC_SLOT_ACTIVE)
+    // The field was lost or the card is gone, so is its ISO-DEP session
+    ifdnfc->slot.soft_iso_dep = false;
+  if (!ifdnfc_slot_present(&ifdnfc->slot))
+    // The removal itself is reported
+    ifdnfc->slot.reset = false;
 
-      // Store the PUPI (Pseudo-Unique PICC Identifier)
-      memcpy(&atqb[1], ifdnfc->slot.target.nti.nbi.abtPupi, 4);
+  if (!was_present && ifdnfc_slot_present(&ifdnfc->slot)) {
+    uint64_t now = ifdnfc_now_us();
+    ifdnfc->card_entered = ifdnfc->last_miss ? ifdnfc->last_miss + (now - ifdnfc->last_miss) / 2 : now;
+    ifdnfc_event_push(ifdnfc, IFDNFC_EVENT_INSERTED);
+  } else if (was_present && !ifdnfc_slot_present(&ifdnfc->slot))
+    ifdnfc_event_push(ifdnfc, IFDNFC_EVENT_REMOVED);
+}
 
-      // Store the Application Data
-      memcpy(&atqb[5], ifdnfc->slot.target.nti.nbi.abtApplicationData, 4);
+/*
+ * The powered card lost its session without pcscd knowing, e.g. it was
+ * selected again. The next presence check of pcscd reports it absent once
+ * and its APDUs are refused until then, so that the application gets a
+ * removed card instead of talking to a reset one.
+ */
+static void slot_report_reset(struct ifd_device *ifdnfc)
+{
+  if (!ifdnfc_slot_present(&ifdnfc->slot) || ifdnfc->slot.reset)
+    return;
+  Log1(PCSC_LOG_INFO, "Card was reset, reporting it removed.");
+  ifdnfc->slot.reset = true;
+  ifdnfc->slot.memo_path_len = 0;
+  ifdnfc->slot.memo_path_sent = 0;
+  ifdnfc_event_push(ifdnfc, IFDNFC_EVENT_REMOVED);
+  ifdnfc_event_push(ifdnfc, IFDNFC_EVENT_INSERTED);
+}
 
-      // Store the Protocol Info
-      memcpy(&atqb[9], ifdnfc->slot.target.nti.nbi.abtProtocolInfo, 3);
-      if (!get_atr(ATR_ISO14443B_106, atqb, sizeof(atqb),
-                   (unsigned char *) ifdnfc->slot.atr, &(ifdnfc->slot.atr_len)))
-        ifdnfc->slot.atr_len = 0;
-      return false;
-      break;
-    case NMT_ISO14443BI:
-    case NMT_ISO14443B2CT:
-    case NMT_ISO14443B2SR:
-    case NMT_JEWEL:
-    case NMT_FELICA:
-    case NMT_DEP:
-      /* for all other types: Empty ATR */
-      Log1(PCSC_LOG_INFO, "Returning empty ATR for card without APDU support.");
-      ifdnfc->slot.atr_len = 0;
-      return true;
+static void ifdnfc_rf_init(struct ifd_device *ifdnfc)
+{
+  ifdnfc->last_activity = ifdnfc_now_ms();
+  ifdnfc->last_miss = 0;
+  ifdnfc->next_poll = 0;
+  ifdnfc->poll_interval = 0;
+  ifdnfc->com_timeout = -1;
+}
+
+// Fast wake: go back to full-rate polling as soon as a card shows up
+static void ifdnfc_rf_wake(struct ifd_device *ifdnfc, uint64_t now)
+{
+  ifdnfc->last_activity = now;
+  ifdnfc->next_poll = 0;
+  ifdnfc->poll_interval = 0;
+}
+
+static bool ifdnfc_rf_poll_due(const struct ifd_device *ifdnfc, uint64_t now)
+{
+  return now >= ifdnfc->next_poll;
+}
+
+static int rf_idle(struct ifd_device *ifdnfc);
+
+static void ifdnfc_rf_field_off(struct ifd_device *ifdnfc)
+{
+  if (ifdnfc->slot.state == IFDNFC_SLOT_FIELD_OFF
+      || ifdnfc->slot.state == IFDNFC_SLOT_HALTED)
+    return;
+  if (rf_idle(ifdnfc) < 0) {
+    Log2(PCSC_LOG_ERROR, "Could not idle NFC device (%s).", nfc_strerror(ifdnfc->device));
+    return;
   }
+  Log1(PCSC_LOG_DEBUG, "RF field switched off.");
+  ifdnfc_slot_set(ifdnfc, ifdnfc_slot_present(&ifdnfc->slot) ? IFDNFC_SLOT_HALTED : IFDNFC_SLOT_FIELD_OFF);
+}
 
-  return true;
+static bool ifdnfc_rf_field_off_due(const struct ifd_device *ifdnfc, uint64_t now)
+{
+  return ifdnfc->profile.rf.field_off_delay_ms
+         && now - ifdnfc->last_activity >= ifdnfc->profile.rf.field_off_delay_ms;
 }
 
-static bool ifdnfc_reselect_target(struct ifd_device *ifdnfc, bool warm)
+// Called after a discovery poll found no card
+static void ifdnfc_rf_backoff(struct ifd_device *ifdnfc, uint64_t now)
 {
-  switch (ifdnfc->slot.target.nm.nmt) {
-    case NMT_ISO14443A:
-      if (nfc_device_set_property_bool(ifdnfc->device, NP_INFINITE_SELECT, false) < 0) {
-        Log2(PCSC_LOG_ERROR, "Could not set infinite-select property (%s)", nfc_strerror(ifdnfc->device));
-        ifdnfc->slot.present = false;
-        return false;
-      }
-      nfc_target nt;
-      // the UID might change when the field was lost. We don't reuse it for a cold reselection
-      if (nfc_initiator_select_passive_target(ifdnfc->device, ifdnfc->slot.target.nm, warm ? ifdnfc->slot.target.nti.nai.abtUid : NULL, warm ? ifdnfc->slot.target.nti.nai.szUidLen : 0, &nt) < 1) {
-        Log3(PCSC_LOG_DEBUG, "Could not select target %s. (%s)", str_nfc_modulation_type(ifdnfc->slot.target.nm.nmt), nfc_strerror(ifdnfc->device));
-        ifdnfc->slot.present = false;
-        return false;
+  if (ifdnfc_rf_field_off_due(ifdnfc, now))
+    ifdnfc_rf_field_off(ifdnfc);
+
+  if (!ifdnfc->profile.rf.poll_interval_max_ms
+      || now - ifdnfc->last_activity < ifdnfc->profile.rf.idle_grace_ms)
+    return;
+
+  if (ifdnfc->poll_interval < ifdnfc->poll_interval_min)
+    ifdnfc->poll_interval = ifdnfc->poll_interval_min;
+  else
+    ifdnfc->poll_interval *= 2;
+  if (ifdnfc->poll_interval > ifdnfc->profile.rf.poll_interval_max_ms)
+    ifdnfc->poll_interval = ifdnfc->profile.rf.poll_interval_max_ms;
+  ifdnfc->next_poll = now + ifdnfc->poll_interval;
+}
+
+/*
+ * Cancellation of in-flight commands. nfc_abort_command() is only sent while
+ * a command is running, since some drivers would otherwise abort the next
+ * one. Once aborted, the remaining commands of the request fail immediately.
+ */
+static bool rf_begin(struct ifd_device *ifdnfc)
+{
+  bool aborted;
+
+  pthread_mutex_lock(&ifdnfc->rf_lock);
+  aborted = ifdnfc->rf_aborted;
+  ifdnfc->rf_busy = !aborted;
+  if (!aborted)
+    ifdnfc->rf_commands++;
+  pthread_mutex_unlock(&ifdnfc->rf_lock);
+  ifdnfc->rf_started = ifdnfc_now_ms();
+
+  return !aborted;
+}
+
+/*
+ * Watchdog of hung readers. Errors of the device itself (as opposed to a
+ * card that does not answer) are counted until a command succeeds, and the
+ * time of the commands handled by the chip alone is averaged over the last
+ * few and the last many. The device is reopened by the worker before the
+ * next request after watchdog_failures errors in a row, or once the recent
+ * average is watchdog_drift times the long one.
+ */
+#define IFDNFC_WATCHDOG_DRIFT_MIN_MS 200
+#define IFDNFC_WATCHDOG_SAMPLES      64
+#define IFDNFC_WATCHDOG_RETRY_MS     1000
+
+// Not NFC_ETIMEOUT: a card that does not answer in time gets the same error
+static bool rf_error_is_device(int res)
+{
+  return res == NFC_EIO || res == NFC_ECHIP || res == NFC_ESOFT;
+}
+
+static void rf_watch(struct ifd_device *ifdnfc, int res, uint32_t elapsed, bool timed)
+{
+  const struct ifdnfc_profile *profile = &ifdnfc->profile;
+  bool due = false;
+
+  if (rf_error_is_device(res)) {
+    ifdnfc->rf_failures++;
+    due = profile->watchdog_failures && ifdnfc->rf_failures >= profile->watchdog_failures;
+  } else if (res >= 0) {
+    ifdnfc->rf_failures = 0;
+    if (timed) {
+      if (!ifdnfc->rtt_samples++) {
+        ifdnfc->rtt_fast = ifdnfc->rtt_slow = elapsed;
       } else {
-        if (!warm) {
-          // for a warm reset compare the ATS
-          if (ifdnfc->slot.target.nti.nai.szAtsLen == nt.nti.nai.szAtsLen
-              && 0 == memcmp(ifdnfc->slot.target.nti.nai.abtAts, nt.nti.nai.abtAts, nt.nti.nai.szAtsLen)) {
-            return true;
-          } else {
-            return false;
-          }
-        }
-        return true;
+        ifdnfc->rtt_fast = ifdnfc->rtt_fast - ifdnfc->rtt_fast / 4 + elapsed / 4;
+        ifdnfc->rtt_slow = ifdnfc->rtt_slow - ifdnfc->rtt_slow / IFDNFC_WATCHDOG_SAMPLES
+                           + elapsed / IFDNFC_WATCHDOG_SAMPLES;
       }
-      break;
-    case NMT_DEP:
-    case NMT_FELICA:
-    case NMT_ISO14443B2CT:
-    case NMT_ISO14443B2SR:
-    case NMT_ISO14443B:
-    case NMT_ISO14443BI:
-    case NMT_JEWEL:
-    default:
-      // TODO Implement me :)
-      break;
+      due = profile->watchdog_drift && ifdnfc->rtt_samples > IFDNFC_WATCHDOG_SAMPLES
+            && ifdnfc->rtt_fast > IFDNFC_WATCHDOG_DRIFT_MIN_MS * 16
+            && ifdnfc->rtt_fast > ifdnfc->rtt_slow * profile->watchdog_drift;
+    }
+  }
+  if (due) {
+    Log4(PCSC_LOG_ERROR, "%s looks hung (%u errors, %u ms per command).", ifdnfc->connstring,
+         ifdnfc->rf_failures, (unsigned int) ifdnfc->rtt_fast / 16);
+    pthread_mutex_lock(&ifdnfc->rf_lock);
+    ifdnfc->reopen_due = true;
+    pthread_mutex_unlock(&ifdnfc->rf_lock);
   }
-  return false;
 }
 
-static bool ifdnfc_se_is_available(struct ifd_device *ifdnfc)
+static void rf_end(struct ifd_device *ifdnfc, int res, bool timed)
 {
-  if (!ifdnfc->connected)
-    return false;
+  uint32_t elapsed = (ifdnfc_now_ms() - ifdnfc->rf_started) * 16;
 
-  if (ifdnfc->slot.present && ifdnfc->slot.initiated)
-    return true; // SE is considered as wired, so it is always available once detected as present
+  pthread_mutex_lock(&ifdnfc->rf_lock);
+  ifdnfc->rf_busy = false;
+  pthread_mutex_unlock(&ifdnfc->rf_lock);
+  // The SE slot works with the device of slot 0
+  rf_watch(ifdnfc->host ? ifdnfc->host : ifdnfc, res, elapsed, timed);
+}
 
-  if (nfc_initiator_init_secure_element(ifdnfc->device) < 0) {
-    Log2(PCSC_LOG_ERROR, "Could not initialize secure element mode. (%s)", nfc_strerror(ifdnfc->device));
-    ifdnfc->slot.present = false;
-    return false;
-  }
-  // Let the reader only try once to find a tag
-  if (nfc_device_set_property_bool(ifdnfc->device, NP_INFINITE_SELECT, false) < 0) {
-    ifdnfc->slot.present = false;
-    return false;
-  }
-  // Read the SAM's info
-  const nfc_modulation nmSAM = {
-    .nmt = NMT_ISO14443A,
-    .nbr = NBR_106,
-  };
+// A request was abandoned: the device did not even answer within the timeout
+static void ifdnfc_watchdog_trip(struct ifd_device *ifdnfc)
+{
+  struct ifd_device *owner = ifdnfc->host ? ifdnfc->host : ifdnfc;
 
-  int res;
-  if ((res = nfc_initiator_select_passive_target(ifdnfc->device, nmSAM, NULL, 0, &(ifdnfc->slot.target))) < 0) {
-    Log2(PCSC_LOG_ERROR, "Could not select secure element. (%s)", nfc_strerror(ifdnfc->device));
-    ifdnfc->slot.present = false;
-    return false;
-  } else if (res == 0) {
-    Log2(PCSC_LOG_ERROR, "No secure element available. (%s)", nfc_strerror(ifdnfc->device));
-    ifdnfc->slot.present = false;
-    return false;
-  } // else
-  Log1(PCSC_LOG_DEBUG, "Secure element selected.");
-  ifdnfc_target_to_atr(ifdnfc);
-  ifdnfc->slot.present = true;
+  pthread_mutex_lock(&owner->rf_lock);
+  owner->reopen_due = owner->profile.watchdog_failures > 0;
+  pthread_mutex_unlock(&owner->rf_lock);
+}
 
-  return true;
+static bool ifdnfc_watchdog_due(struct ifd_device *ifdnfc)
+{
+  bool due;
+
+  pthread_mutex_lock(&ifdnfc->rf_lock);
+  due = ifdnfc->reopen_due;
+  pthread_mutex_unlock(&ifdnfc->rf_lock);
+
+  return due && ifdnfc_now_ms() >= ifdnfc->next_reopen;
 }
 
-static bool ifdnfc_target_is_available(struct ifd_device *ifdnfc)
+static void ifdnfc_watchdog_reset(struct ifd_device *ifdnfc)
 {
-  if (!ifdnfc->connected)
-    return false;
+  pthread_mutex_lock(&ifdnfc->rf_lock);
+  ifdnfc->reopen_due = false;
+  pthread_mutex_unlock(&ifdnfc->rf_lock);
+  ifdnfc->rf_failures = 0;
+  ifdnfc->rtt_samples = 0;
+  ifdnfc->next_reopen = 0;
+}
 
-  if (ifdnfc->slot.present) {
-    if (ifdnfc->slot.initiated) {
-      // Target is active and just need a ping-like command (handled by libnfc)
-      if (nfc_initiator_target_is_present(ifdnfc->device, &ifdnfc->slot.target) < 0) {
-        Log3(PCSC_LOG_INFO, "Connection lost with %s. (%s)", str_nfc_modulation_type(ifdnfc->slot.target.nm.nmt), nfc_strerror(ifdnfc->device));
-        ifdnfc->slot.present = false;
-        return false;
-      }
-      return true;
-    } else {
-      // Target is not initiated and need to be wakeup
-      if (nfc_initiator_init(ifdnfc->device) < 0) {
-        Log2(PCSC_LOG_ERROR, "Could not initialize initiator mode. (%s)", nfc_strerror(ifdnfc->device));
-        ifdnfc->slot.present = false;
-        return false;
-      }
-      // To prevent from multiple init
-      ifdnfc->slot.initiated = true;
-      if (!ifdnfc_reselect_target(ifdnfc, false)) {
-        Log3(PCSC_LOG_INFO, "Connection lost with %s. (%s)", str_nfc_modulation_type(ifdnfc->slot.target.nm.nmt), nfc_strerror(ifdnfc->device));
-        ifdnfc->slot.present = false;
-        return false;
-      }
-      if (nfc_initiator_deselect_target(ifdnfc->device) < 0) {
-        Log2(PCSC_LOG_ERROR, "Could not deselect target. (%s)", nfc_strerror(ifdnfc->device));
-      }
-      return true;
-    }
-  } // else
+static void ifdnfc_cancel_init(struct ifd_device *ifdnfc)
+{
+  pthread_condattr_t attr;
 
-  // ifdnfc->slot not initialised means the field is not active, so when no target
-  // is available ifdnfc needs to generated a field
-  if (!ifdnfc->slot.initiated) {
-    if (nfc_initiator_init(ifdnfc->device) < 0) {
-      Log2(PCSC_LOG_ERROR, "Could not init NFC device in initiator mode (%s).", nfc_strerror(ifdnfc->device));
-      return false;
-    }
-    // To prevent from multiple init
-    ifdnfc->slot.initiated = true;
-  }
+  pthread_mutex_init(&ifdnfc->rf_lock, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&ifdnfc->rf_event, &attr);
+  pthread_condattr_destroy(&attr);
+  ifdnfc->rf_busy = false;
+  ifdnfc->rf_aborted = false;
+  ifdnfc->poll_stop = false;
+  ifdnfc->present = false;
+  ifdnfc->reported = false;
+  ifdnfc->rf_commands = 0;
+  ifdnfc->polls = 0;
+  ifdnfc->poll_rf_commands = 0;
+  ifdnfc->last_poll_rf_commands = 0;
+  ifdnfc->restarts = 0;
+  ifdnfc->reopen_due = false;
+  ifdnfc->rf_failures = 0;
+  ifdnfc->rtt_samples = 0;
+  ifdnfc->next_reopen = 0;
+  ifdnfc->link_rtt = 0;
+  ifdnfc->probe_timeout = IFDNFC_PROBE_TIMEOUT_MS;
+  memset(&ifdnfc->iso_dep, 0, sizeof ifdnfc->iso_dep);
+  ifdnfc->presence_interval = 0;
+  ifdnfc->poll_interval_min = ifdnfc->profile.rf.poll_interval_min_ms;
+  ifdnfc->worker_margin = IFDNFC_WORKER_MARGIN_MS;
+  ifdnfc->request_timeout = ifdnfc->profile.transceive_timeout + IFDNFC_WORKER_MARGIN_MS;
+  ifdnfc->events_head = 0;
+  ifdnfc->events_len = 0;
+  ifdnfc->events_dropped = 0;
+}
 
-  // find new connection
-  size_t i;
-  for (i = 0; i < (sizeof(supported_modulations) / sizeof(nfc_modulation)); i++) {
-    if (nfc_initiator_list_passive_targets(ifdnfc->device, supported_modulations[i], &(ifdnfc->slot.target), 1) == 1) {
-      ifdnfc_target_to_atr(ifdnfc);
-      ifdnfc->slot.present = true;
-      // XXX Should it be on or off after target selection ?
-      ifdnfc->slot.initiated = true;
-      Log2(PCSC_LOG_INFO, "Connected to %s.", str_nfc_modulation_type(ifdnfc->slot.target.nm.nmt));
-      return true;
-    }
+static void ifdnfc_cancel_destroy(struct ifd_device *ifdnfc)
+{
+  // Release the polling thread
+  pthread_mutex_lock(&ifdnfc->rf_lock);
+  ifdnfc->poll_stop = true;
+  pthread_cond_broadcast(&ifdnfc->rf_event);
+  pthread_mutex_unlock(&ifdnfc->rf_lock);
+
+  pthread_cond_destroy(&ifdnfc->rf_event);
+  pthread_mutex_destroy(&ifdnfc->rf_lock);
+}
+
+static void ifdnfc_rf_rearm(struct ifd_device *ifdnfc)
+{
+  pthread_mutex_lock(&ifdnfc->rf_lock);
+  ifdnfc->rf_aborted = false;
+  pthread_mutex_unlock(&ifdnfc->rf_lock);
+}
+
+static void ifdnfc_abort(struct ifd_device *ifdnfc)
+{
+  pthread_mutex_lock(&ifdnfc->rf_lock);
+  ifdnfc->rf_aborted = true;
+  if (ifdnfc->rf_busy) {
+    Log2(PCSC_LOG_DEBUG, "Aborting command on %s.", ifdnfc->connstring);
+    if (nfc_abort_command(ifdnfc->device) < 0)
+      Log2(PCSC_LOG_ERROR, "Could not abort command (%s).", nfc_strerror(ifdnfc->device));
   }
-  Log1(PCSC_LOG_DEBUG, "Could not find any NFC targets.");
-  return false;
+  pthread_mutex_unlock(&ifdnfc->rf_lock);
 }
 
 /*
- * List of Defined Functions Available to IFD_Handler 3.0
+ * libnfc commands sent to the chip, each one counted for the presence check
+ * statistics, traced as a span of the current activation timeline and
+ * cancellable by ifdnfc_abort()
  */
-RESPONSECODE
-IFDHCreateChannelByName(DWORD Lun, LPSTR DeviceName)
+static int rf_initiator_init(struct ifd_device *ifdnfc)
 {
-  (void) Lun;
-  int device_index, i;
+  if (!rf_begin(ifdnfc))
+    return NFC_EOPABORTED;
+  size_t span = ifdnfc_trace_begin(&ifdnfc->trace, "nfc_initiator_init");
+  int res = nfc_initiator_init(ifdnfc->device);
+  ifdnfc_trace_end(&ifdnfc->trace, span);
+  rf_end(ifdnfc, res, true);
+  return res;
+}
+
+static int rf_initiator_init_secure_element(struct ifd_device *ifdnfc)
+{
+  if (!rf_begin(ifdnfc))
+    return NFC_EOPABORTED;
+  size_t span = ifdnfc_trace_begin(&ifdnfc->trace, "nfc_initiator_init_secure_element");
+  int res = nfc_initiator_init_secure_element(ifdnfc->device);
+  ifdnfc_trace_end(&ifdnfc->trace, span);
+  rf_end(ifdnfc, res, true);
+  return res;
+}
+
+static int rf_list_passive_targets(struct ifd_device *ifdnfc, const nfc_modulation nm,
+                                   nfc_target ant[], const size_t szTargets)
+{
+  // includes RATS when libnfc activates ISO14443-4 automatically
+  if (!rf_begin(ifdnfc))
+    return NFC_EOPABORTED;
+  size_t span = ifdnfc_trace_begin(&ifdnfc->trace, "nfc_initiator_list_passive_targets");
+  int res = nfc_initiator_list_passive_targets(ifdnfc->device, nm, ant, szTargets);
+  ifdnfc_trace_end(&ifdnfc->trace, span);
+  rf_end(ifdnfc, res, true);
+  return res;
+}
+
+static int rf_select_passive_target(struct ifd_device *ifdnfc, const nfc_modulation nm,
+                                    const uint8_t *pbtInitData, const size_t szInitData,
+                                    nfc_target *pnt)
+{
+  if (!rf_begin(ifdnfc))
+    return NFC_EOPABORTED;
+  size_t span = ifdnfc_trace_begin(&ifdnfc->trace, "nfc_initiator_select_passive_target");
+  int res = nfc_initiator_select_passive_target(ifdnfc->device, nm, pbtInitData, szInitData, pnt);
+  ifdnfc_trace_end(&ifdnfc->trace, span);
+  rf_end(ifdnfc, res, true);
+  return res;
+}
+
+static int rf_deselect_target(struct ifd_device *ifdnfc)
+{
+  if (!rf_begin(ifdnfc))
+    return NFC_EOPABORTED;
+  size_t span = ifdnfc_trace_begin(&ifdnfc->trace, "nfc_initiator_deselect_target");
+  int res = nfc_initiator_deselect_target(ifdnfc->device);
+  ifdnfc_trace_end(&ifdnfc->trace, span);
+  rf_end(ifdnfc, res, true);
+  return res;
+}
+
+static int rf_target_is_present(struct ifd_device *ifdnfc)
+{
+  if (!rf_begin(ifdnfc))
+    return NFC_EOPABORTED;
+  size_t span = ifdnfc_trace_begin(&ifdnfc->trace, "nfc_initiator_target_is_present");
+  int res = nfc_initiator_target_is_present(ifdnfc->device, &ifdnfc->slot.target);
+  ifdnfc_trace_end(&ifdnfc->trace, span);
+  rf_end(ifdnfc, res, true);
+  return res;
+}
+
+static int rf_transceive_bytes(struct ifd_device *ifdnfc, const uint8_t *pbtTx,
+                               const size_t szTx, uint8_t *pbtRx, const size_t szRx,
+                               int timeout)
+{
+  if (!rf_begin(ifdnfc))
+    return NFC_EOPABORTED;
+  size_t span = ifdnfc_trace_begin(&ifdnfc->trace, "nfc_initiator_transceive_bytes");
+  int res = nfc_initiator_transceive_bytes(ifdnfc->device, pbtTx, szTx, pbtRx, szRx, timeout);
+  ifdnfc_trace_end(&ifdnfc->trace, span);
+  // The time of an APDU depends on the card
+  rf_end(ifdnfc, res, false);
+  return res;
+}
+
+static int rf_transceive_bits(struct ifd_device *ifdnfc, const uint8_t *pbtTx,
+                              const size_t szTxBits, uint8_t *pbtRx, const size_t szRx)
+{
+  if (!rf_begin(ifdnfc))
+    return NFC_EOPABORTED;
+  size_t span = ifdnfc_trace_begin(&ifdnfc->trace, "nfc_initiator_transceive_bits");
+  int res = nfc_initiator_transceive_bits(ifdnfc->device, pbtTx, szTxBits, NULL, pbtRx, szRx, NULL);
+  ifdnfc_trace_end(&ifdnfc->trace, span);
+  rf_end(ifdnfc, res, false);
+  return res;
+}
+
+static int rf_set_property_bool(struct ifd_device *ifdnfc, const nfc_property property,
+                                const bool bEnable)
+{
+  if (!rf_begin(ifdnfc))
+    return NFC_EOPABORTED;
+  size_t span = ifdnfc_trace_begin(&ifdnfc->trace, "nfc_device_set_property_bool");
+  int res = nfc_device_set_property_bool(ifdnfc->device, property, bEnable);
+  ifdnfc_trace_end(&ifdnfc->trace, span);
+  rf_end(ifdnfc, res, true);
+  return res;
+}
+
+static int rf_set_property_int(struct ifd_device *ifdnfc, const nfc_property property,
+                               const int value)
+{
+  if (!rf_begin(ifdnfc))
+    return NFC_EOPABORTED;
+  size_t span = ifdnfc_trace_begin(&ifdnfc->trace, "nfc_device_set_property_int");
+  int res = nfc_device_set_property_int(ifdnfc->device, property, value);
+  ifdnfc_trace_end(&ifdnfc->trace, span);
+  rf_end(ifdnfc, res, true);
+  return res;
+}
+
+static int rf_idle(struct ifd_device *ifdnfc)
+{
+  if (!rf_begin(ifdnfc))
+    return NFC_EOPABORTED;
+  size_t span = ifdnfc_trace_begin(&ifdnfc->trace, "nfc_idle");
+  int res = nfc_idle(ifdnfc->device);
+  ifdnfc_trace_end(&ifdnfc->trace, span);
+  rf_end(ifdnfc, res, true);
+  return res;
+}
+
+/*
+ * Raw frames are sent with easy framing off. It is switched off once for a
+ * whole exchange (an APDU, RATS, a presence check), not for each frame.
+ */
+static bool slot_raw_begin(struct ifd_device *ifdnfc)
+{
+  if (rf_set_property_bool(ifdnfc, NP_EASY_FRAMING, false) < 0) {
+    Log2(PCSC_LOG_ERROR, "Could not set easy-framing property (%s)", nfc_strerror(ifdnfc->device));
+    return false;
+  }
+  return true;
+}
+
+static void slot_raw_end(struct ifd_device *ifdnfc)
+{
+  if (rf_set_property_bool(ifdnfc, NP_EASY_FRAMING, true) < 0)
+    Log2(PCSC_LOG_ERROR, "Could not set easy-framing property (%s)", nfc_strerror(ifdnfc->device));
+}
+
+// Longest timeout of the chip, beyond it the chip waits for the host
+#define IFDNFC_TIMEOUT_COM_MAX_MS 3280
+
+// The chip gives up after NP_TIMEOUT_COM whatever the host waits
+static int slot_com_timeout(struct ifd_device *ifdnfc, int timeout)
+{
+  int com_timeout = timeout > IFDNFC_TIMEOUT_COM_MAX_MS ? 0 : timeout;
+  int res;
+
+  if (com_timeout != ifdnfc->com_timeout) {
+    res = rf_set_property_int(ifdnfc, NP_TIMEOUT_COM, com_timeout);
+    if (res < 0)
+      return res;
+    ifdnfc->com_timeout = com_timeout;
+  }
+  return NFC_SUCCESS;
+}
+
+/*
+ * Raw frame between slot_raw_begin() and slot_raw_end(), the reader only
+ * adds and checks the CRC. The card may take timeout ms to answer.
+ */
+static int slot_transceive_frame(struct ifd_device *ifdnfc, const uint8_t *tx, size_t tx_len,
+                                 uint8_t *rx, size_t rx_len, int timeout)
+{
+  int res = slot_com_timeout(ifdnfc, timeout);
+
+  if (res < 0)
+    return res;
+  // The card's time plus the one of the host link
+  return rf_transceive_bytes(ifdnfc, tx, tx_len, rx, rx_len, timeout + ifdnfc->probe_timeout);
+}
+
+/*
+ * Short frame of 7 bits without CRC (REQA, WUPA) between slot_raw_begin()
+ * and slot_raw_end(). Returns the number of bits received.
+ */
+static int slot_transceive_short(struct ifd_device *ifdnfc, uint8_t cmd,
+                                 uint8_t *rx, size_t rx_len, int timeout)
+{
+  int res = slot_com_timeout(ifdnfc, timeout);
+
+  if (res < 0)
+    return res;
+  res = rf_set_property_bool(ifdnfc, NP_HANDLE_CRC, false);
+  if (res < 0)
+    return res;
+  res = rf_transceive_bits(ifdnfc, &cmd, 7, rx, rx_len);
+  if (rf_set_property_bool(ifdnfc, NP_HANDLE_CRC, true) < 0) {
+    Log2(PCSC_LOG_ERROR, "Could not set handle-CRC property (%s)", nfc_strerror(ifdnfc->device));
+    return NFC_EIO;
+  }
+  return res;
+}
+
+/*
+ * Driver-side ISO-DEP (soft_iso_dep of the profile). The reader only selects
+ * ISO14443-A cards, RATS and the blocks are sent by isodep.c as raw frames.
+ */
+static bool soft_iso_dep_wanted(const struct ifd_device *ifdnfc, const nfc_target *nt)
+{
+  return ifdnfc->profile.soft_iso_dep && !ifdnfc->secure_element_as_card
+         && nt->nm.nmt == NMT_ISO14443A && (nt->nti.nai.btSak & 0x20);
+}
+
+static int slot_iso_dep_frame(void *ctx, const uint8_t *tx, size_t tx_len,
+                              uint8_t *rx, size_t rx_len, unsigned int timeout)
+{
+  // timeout is the FWT, or the time of a waiting time extension
+  return slot_transceive_frame(ctx, tx, tx_len, rx, rx_len, timeout);
+}
+
+// RATS to the selected target nt between slot_raw_begin() and slot_raw_end()
+static bool slot_iso_dep_rats(struct ifd_device *ifdnfc, nfc_target *nt)
+{
+  size_t ats_len = sizeof nt->nti.nai.abtAts;
+
+  ifdnfc->slot.soft_iso_dep = false;
+  if (!isodep_rats(&ifdnfc->iso_dep, ifdnfc->profile.iso_dep_fsd, ifdnfc->profile.iso_dep_retries,
+                   nt->nti.nai.abtAts, &ats_len, slot_iso_dep_frame, ifdnfc))
+    return false;
+  nt->nti.nai.szAtsLen = ats_len;
+  ifdnfc->slot.soft_iso_dep = true;
+  return true;
+}
+
+// RATS to the selected target nt, its ATS is stored with it
+static bool slot_iso_dep_activate(struct ifd_device *ifdnfc, nfc_target *nt)
+{
+  bool res;
+
+  ifdnfc->slot.soft_iso_dep = false;
+  if (!slot_raw_begin(ifdnfc))
+    return false;
+  res = slot_iso_dep_rats(ifdnfc, nt);
+  slot_raw_end(ifdnfc);
+  return res;
+}
+
+// APDU exchange with the card, through the ISO-DEP layer of the driver if it runs one
+static int slot_transceive_apdu(struct ifd_device *ifdnfc, const uint8_t *tx, size_t tx_len,
+                                uint8_t *rx, size_t rx_len, int timeout)
+{
+  int res;
+
+  if (!ifdnfc->slot.soft_iso_dep)
+    return rf_transceive_bytes(ifdnfc, tx, tx_len, rx, rx_len, timeout);
+
+  if (!slot_raw_begin(ifdnfc))
+    return NFC_EIO;
+  size_t span = ifdnfc_trace_begin(&ifdnfc->trace, "isodep_transceive");
+  res = isodep_transceive(&ifdnfc->iso_dep, tx, tx_len, rx, rx_len, slot_iso_dep_frame, ifdnfc);
+  ifdnfc_trace_end(&ifdnfc->trace, span);
+  slot_raw_end(ifdnfc);
+  if (res == ISODEP_EPROTOCOL)
+    res = NFC_ERFTRANS;
+  else if (res == ISODEP_EOVERFLOW)
+    res = NFC_EOVFLOW;
+  return res;
+}
+
+// Deselect the card, which ends an ISO-DEP session of the driver first
+static int slot_deselect(struct ifd_device *ifdnfc)
+{
+  if (ifdnfc->slot.soft_iso_dep) {
+    ifdnfc->slot.soft_iso_dep = false;
+    if (!slot_raw_begin(ifdnfc))
+      return NFC_EIO;
+    if (!isodep_deselect(&ifdnfc->iso_dep, slot_iso_dep_frame, ifdnfc))
+      Log1(PCSC_LOG_DEBUG, "Card did not answer S(DESELECT).");
+    slot_raw_end(ifdnfc);
+  }
+  return rf_deselect_target(ifdnfc);
+}
+
+/*
+ * SELECTED, ACTIVE -> ASLEEP: halt an ISO14443-A card that was powered down.
+ * S(DESELECT) puts an ISO-DEP card into HALT. Only WUPA wakes it up again, so
+ * it neither answers discovery of other cards nor keeps a session the next
+ * application could stumble upon. The chip has no target for a card woken
+ * up with raw frames, so cards are only halted when the driver's ISO-DEP layer
+ * carries them anyway (soft_iso_dep of the profile). Other cards, and cards
+ * whose ISO-DEP activation is still pending, stay selected.
+ */
+#define IFDNFC_ACTIVATION_TIMEOUT_MS 5    // HLTA, WUPA, SELECT: cards answer within 100 us
+
+static bool slot_sleep(struct ifd_device *ifdnfc)
+{
+  const nfc_target *nt = &ifdnfc->slot.target;
+
+  if (!ifdnfc->profile.halt_on_power_down || ifdnfc->slot.iso_dep_pending
+      || !soft_iso_dep_wanted(ifdnfc, nt))
+    return false;
+  if (slot_deselect(ifdnfc) < 0) {
+    Log2(PCSC_LOG_DEBUG, "Could not deselect target (%s).", nfc_strerror(ifdnfc->device));
+    return false;
+  }
+  ifdnfc_slot_set(ifdnfc, IFDNFC_SLOT_ASLEEP);
+  return true;
+}
+
+// WUPA between slot_raw_begin() and slot_raw_end(): the halted card answers
+static bool slot_wupa(struct ifd_device *ifdnfc)
+{
+  const uint8_t *atqa = ifdnfc->slot.target.nti.nai.abtAtqa;
+  uint8_t rx[2];
+
+  // The ATQA goes over the air LSB first
+  return slot_transceive_short(ifdnfc, 0x52, rx, sizeof rx, IFDNFC_ACTIVATION_TIMEOUT_MS) == 16
+         && rx[0] == atqa[1] && rx[1] == atqa[0];
+}
+
+// HLTA between slot_raw_begin() and slot_raw_end(), a halted card does not answer
+static bool slot_hlta(struct ifd_device *ifdnfc)
+{
+  const uint8_t hlta[] = { 0x50, 0x00 };
+  uint8_t rx[1];
+  int res = slot_transceive_frame(ifdnfc, hlta, sizeof hlta, rx, sizeof rx,
+                                  IFDNFC_ACTIVATION_TIMEOUT_MS);
+
+  return res == NFC_ERFTRANS || res == NFC_ETIMEOUT;
+}
+
+/*
+ * SELECT of the known UID between slot_raw_begin() and slot_raw_end(), one
+ * cascade level after the other and without anticollision
+ */
+static bool slot_select_uid(struct ifd_device *ifdnfc)
+{
+  static const uint8_t sel[] = { 0x93, 0x95, 0x97 };
+  const nfc_iso14443a_info *nai = &ifdnfc->slot.target.nti.nai;
+  uint8_t tx[7], sak = 0;
+  size_t levels, level, uid = 0;
+
+  if (nai->szUidLen != 4 && nai->szUidLen != 7 && nai->szUidLen != 10)
+    return false;
+  levels = (nai->szUidLen - 1) / 3;
+  for (level = 0; level < levels; level++) {
+    tx[0] = sel[level];
+    tx[1] = 0x70;
+    if (level + 1 < levels) {
+      // Cascade tag, the UID goes on at the next level
+      tx[2] = 0x88;
+      memcpy(tx + 3, nai->abtUid + uid, 3);
+      uid += 3;
+    } else {
+      memcpy(tx + 2, nai->abtUid + uid, 4);
+    }
+    tx[6] = tx[2] ^ tx[3] ^ tx[4] ^ tx[5];
+    if (slot_transceive_frame(ifdnfc, tx, sizeof tx, &sak, 1, IFDNFC_ACTIVATION_TIMEOUT_MS) != 1
+        || !(sak & 0x04) != (level + 1 == levels))
+      return false;
+  }
+
+  return sak == nai->btSak;
+}
+
+/*
+ * Recently closed devices stay open for a while, so that a reader coming back
+ * under the same connection string skips nfc_open() and the chip setup. A
+ * reaper thread closes them once IFDNFC_WARM_TTL_MS elapsed, which releases
+ * the USB or serial port for other programs.
+ */
+#define IFDNFC_WARM_DEVICES 4
+#define IFDNFC_WARM_TTL_MS 60000
+
+struct ifdnfc_warm_device {
+  nfc_device *device;
+  nfc_connstring connstring;
+  uint64_t parked;
+  bool opening;             // opened ahead of time by ifdnfc_prefetch()
+  bool prefetched;          // thread is to be joined, once opening is cleared
+  pthread_t thread;
+};
+
+static struct ifdnfc_warm_device ifdnfc_warm_devices[IFDNFC_WARM_DEVICES];
+static pthread_mutex_t ifdnfc_warm_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ifdnfc_warm_opened = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ifdnfc_warm_changed = PTHREAD_COND_INITIALIZER;
+static pthread_t ifdnfc_warm_reaper;
+static bool ifdnfc_warm_reaping;
+static bool ifdnfc_warm_exiting;
+
+// Close the devices parked for too long, needs ifdnfc_warm_lock
+static void ifdnfc_warm_expire(uint64_t now)
+{
+  size_t i;
+
+  for (i = 0; i < IFDNFC_WARM_DEVICES; i++) {
+    struct ifdnfc_warm_device *warm = &ifdnfc_warm_devices[i];
+    if (warm->device && now - warm->parked >= IFDNFC_WARM_TTL_MS) {
+      Log2(PCSC_LOG_DEBUG, "Closing %s.", warm->connstring);
+      nfc_close(warm->device);
+      warm->device = NULL;
+    }
+  }
+}
+
+static void *warm_reap(void *arg)
+{
+  struct timespec ts;
+  uint64_t now, next;
+  size_t i;
+
+  (void) arg;
+  pthread_mutex_lock(&ifdnfc_warm_lock);
+  while (!ifdnfc_warm_exiting) {
+    now = ifdnfc_now_ms();
+    ifdnfc_warm_expire(now);
+    next = 0;
+    for (i = 0; i < IFDNFC_WARM_DEVICES; i++)
+      if (ifdnfc_warm_devices[i].device
+          && (!next || ifdnfc_warm_devices[i].parked + IFDNFC_WARM_TTL_MS < next))
+        next = ifdnfc_warm_devices[i].parked + IFDNFC_WARM_TTL_MS;
+    if (!next) {
+      pthread_cond_wait(&ifdnfc_warm_changed, &ifdnfc_warm_lock);
+      continue;
+    }
+    // The condition variable waits on the wall clock
+    clock_gettime(CLOCK_REALTIME, &ts);
+    next -= now;
+    ts.tv_sec += next / 1000;
+    ts.tv_nsec += (next % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&ifdnfc_warm_changed, &ifdnfc_warm_lock, &ts);
+  }
+  pthread_mutex_unlock(&ifdnfc_warm_lock);
+
+  return NULL;
+}
+
+// A device was parked, needs ifdnfc_warm_lock
+static void ifdnfc_warm_arm(void)
+{
+  if (ifdnfc_warm_reaping) {
+    pthread_cond_signal(&ifdnfc_warm_changed);
+    return;
+  }
+  if (pthread_create(&ifdnfc_warm_reaper, NULL, warm_reap, NULL) == 0)
+    ifdnfc_warm_reaping = true;
+  else
+    Log1(PCSC_LOG_ERROR, "Could not start the reaper of parked devices.");
+}
+
+static void ifdnfc_warm_park(nfc_device *device, const char *connstring)
+{
+  uint64_t now = ifdnfc_now_ms();
+  struct ifdnfc_warm_device *warm = NULL;
+  size_t i;
+
+  // The field is not needed until the device is used again
+  if (nfc_idle(device) < 0) {
+    nfc_close(device);
+    return;
+  }
+
+  pthread_mutex_lock(&ifdnfc_warm_lock);
+  ifdnfc_warm_expire(now);
+  for (i = 0; i < IFDNFC_WARM_DEVICES; i++) {
+    if (ifdnfc_warm_devices[i].opening)
+      continue;
+    if (!ifdnfc_warm_devices[i].device) {
+      warm = &ifdnfc_warm_devices[i];
+      break;
+    }
+    if (!warm || ifdnfc_warm_devices[i].parked < warm->parked)
+      warm = &ifdnfc_warm_devices[i];
+  }
+  if (!warm) {
+    pthread_mutex_unlock(&ifdnfc_warm_lock);
+    nfc_close(device);
+    return;
+  }
+  if (warm->device)
+    nfc_close(warm->device);
+  warm->device = device;
+  strncpy(warm->connstring, connstring, sizeof warm->connstring - 1);
+  warm->connstring[sizeof warm->connstring - 1] = '\0';
+  warm->parked = now;
+  ifdnfc_warm_arm();
+  pthread_mutex_unlock(&ifdnfc_warm_lock);
+
+  Log2(PCSC_LOG_DEBUG, "Keeping %s open for reuse.", connstring);
+}
+
+static nfc_device *ifdnfc_warm_take(const char *connstring)
+{
+  struct ifdnfc_warm_device *warm;
+  nfc_device *device = NULL;
+  size_t i;
+
+  pthread_mutex_lock(&ifdnfc_warm_lock);
+  ifdnfc_warm_expire(ifdnfc_now_ms());
+  for (;;) {
+    warm = NULL;
+    for (i = 0; i < IFDNFC_WARM_DEVICES; i++)
+      if ((ifdnfc_warm_devices[i].device || ifdnfc_warm_devices[i].opening)
+          && !strcmp(ifdnfc_warm_devices[i].connstring, connstring)) {
+        warm = &ifdnfc_warm_devices[i];
+        break;
+      }
+    if (!warm || !warm->opening)
+      break;
+    // Being opened ahead of time, which is as fast as opening it here
+    pthread_cond_wait(&ifdnfc_warm_opened, &ifdnfc_warm_lock);
+  }
+  if (warm) {
+    device = warm->device;
+    warm->device = NULL;
+  }
+  pthread_mutex_unlock(&ifdnfc_warm_lock);
+
+  if (device && nfc_idle(device) < 0) {
+    // The reader went away in the meantime
+    nfc_close(device);
+    device = NULL;
+  }
+  if (device)
+    Log2(PCSC_LOG_DEBUG, "Reusing open device %s.", connstring);
+
+  return device;
+}
+
+#ifdef __GNUC__
+__attribute__((destructor))
+#endif
+static void ifdnfc_fini(void)
+{
+  size_t i;
+
+  for (i = 0; i < IFDNFC_WARM_DEVICES; i++)
+    if (ifdnfc_warm_devices[i].prefetched) {
+      pthread_join(ifdnfc_warm_devices[i].thread, NULL);
+      ifdnfc_warm_devices[i].prefetched = false;
+    }
+  pthread_mutex_lock(&ifdnfc_warm_lock);
+  ifdnfc_warm_exiting = true;
+  pthread_cond_signal(&ifdnfc_warm_changed);
+  pthread_mutex_unlock(&ifdnfc_warm_lock);
+  if (ifdnfc_warm_reaping)
+    pthread_join(ifdnfc_warm_reaper, NULL);
+  ifdnfc_warm_reaping = false;
+  pthread_mutex_lock(&ifdnfc_warm_lock);
+  ifdnfc_warm_expire(UINT64_MAX);
+  pthread_mutex_unlock(&ifdnfc_warm_lock);
+  if (context) {
+    nfc_exit(context);
+    context = NULL;
+  }
+}
+
+// The profile was applied: cache what the threads of pcscd read of it
+static void ifdnfc_profile_publish(struct ifd_device *ifdnfc)
+{
+  pthread_mutex_lock(&ifdnfc->rf_lock);
+  ifdnfc->slots = ifdnfc->profile.secure_element_slot ? 2 : 1;
+  pthread_mutex_unlock(&ifdnfc->rf_lock);
+}
+
+// The SE slot follows the reader of slot 0 and has to be selected again
+static void ifdnfc_se_sync(struct ifd_device *host)
+{
+  struct ifd_device *se = host->se;
+
+  host->chip_owner = NULL;
+  if (!se)
+    return;
+  se->device = host->device;
+  se->connected = host->connected;
+  memcpy(se->connstring, host->connstring, sizeof se->connstring);
+  se->profile = host->profile;
+  se->uart_rate = host->uart_rate;
+  pthread_mutex_lock(&se->rf_lock);
+  se->link_rtt = host->link_rtt;
+  se->request_timeout = se->profile.transceive_timeout + host->worker_margin;
+  se->slots = se->profile.secure_element_slot ? 2 : 1;
+  pthread_mutex_unlock(&se->rf_lock);
+  se->worker_margin = host->worker_margin;
+  se->probe_timeout = host->probe_timeout;
+  se->presence_interval = host->presence_interval;
+  se->poll_interval_min = host->poll_interval_min;
+  ifdnfc_rf_init(se);
+  ifdnfc_slot_set(se, IFDNFC_SLOT_FIELD_OFF);
+}
+
+static void ifdnfc_disconnect(struct ifd_device *ifdnfc)
+{
+  if (ifdnfc->connected) {
+    if (ifdnfc->slot.state == IFDNFC_SLOT_SELECTED
+        || ifdnfc->slot.state == IFDNFC_SLOT_ACTIVE) {
+      if (slot_deselect(ifdnfc) < 0)
+        Log3(PCSC_LOG_ERROR, "Could not disconnect from %s (%s).", str_nfc_modulation_type(ifdnfc->slot.target.nm.nmt), nfc_strerror(ifdnfc->device));
+    }
+    ifdnfc_warm_park(ifdnfc->device, ifdnfc->connstring);
+    ifdnfc_memo_clear(&ifdnfc->memo);
+    ifdnfc->connected = false;
+    ifdnfc->device = NULL;
+    ifdnfc_slot_set(ifdnfc, IFDNFC_SLOT_FIELD_OFF);
+    ifdnfc_se_sync(ifdnfc);
+  }
+  ifdnfc_watchdog_reset(ifdnfc);
+}
+
+/*
+ * pn532_uart readers: libnfc drives the serial link at the rate of the
+ * connstring, 115200 baud by default, which is slower than the RF for long
+ * APDUs. Before libnfc opens the port, the chip is switched up to the
+ * uart_baud_rate of the profile. It keeps its rate until it is reset, so the
+ * rate that worked is remembered and tried first the next time. When the
+ * memo is lost with pcscd, the rate is found by ifdnfc_hsu_probe().
+ */
+#define IFDNFC_HSU_MEMOS 8
+
+struct ifdnfc_hsu_memo {
+  nfc_connstring connstring;
+  uint32_t rate;
+};
+
+static struct ifdnfc_hsu_memo ifdnfc_hsu_memos[IFDNFC_HSU_MEMOS];
+static size_t ifdnfc_hsu_memos_next;
+static pthread_mutex_t ifdnfc_hsu_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t ifdnfc_hsu_recall(const char *connstring)
+{
+  uint32_t rate = 0;
+  size_t i;
+
+  pthread_mutex_lock(&ifdnfc_hsu_lock);
+  for (i = 0; i < IFDNFC_HSU_MEMOS; i++)
+    if (ifdnfc_hsu_memos[i].rate && !strcmp(ifdnfc_hsu_memos[i].connstring, connstring)) {
+      rate = ifdnfc_hsu_memos[i].rate;
+      break;
+    }
+  pthread_mutex_unlock(&ifdnfc_hsu_lock);
+
+  return rate;
+}
+
+static void ifdnfc_hsu_remember(const nfc_connstring connstring, uint32_t rate)
+{
+  struct ifdnfc_hsu_memo *memo = NULL;
+  size_t i;
+
+  pthread_mutex_lock(&ifdnfc_hsu_lock);
+  for (i = 0; i < IFDNFC_HSU_MEMOS; i++)
+    if (ifdnfc_hsu_memos[i].rate && !strcmp(ifdnfc_hsu_memos[i].connstring, connstring))
+      memo = &ifdnfc_hsu_memos[i];
+  if (!memo) {
+    memo = &ifdnfc_hsu_memos[ifdnfc_hsu_memos_next];
+    ifdnfc_hsu_memos_next = (ifdnfc_hsu_memos_next + 1) % IFDNFC_HSU_MEMOS;
+    memcpy(memo->connstring, connstring, sizeof memo->connstring);
+  }
+  memo->rate = rate;
+  pthread_mutex_unlock(&ifdnfc_hsu_lock);
+}
+
+static nfc_device *ifdnfc_hsu_open(const char *port, uint32_t rate)
+{
+  nfc_connstring connstring;
+
+  snprintf(connstring, sizeof connstring, "pn532_uart:%s:%lu", port, (unsigned long) rate);
+  return nfc_open(context, connstring);
+}
+
+static nfc_device *ifdnfc_open_device(const char *connstring, uint32_t *uart_rate)
+{
+  const struct ifdnfc_profile *profile = ifdnfc_conf_match(&ifdnfc_conf, connstring, NULL);
+  char port[256];
+  uint32_t initial, rate;
+  nfc_device *device;
+
+  *uart_rate = 0;
+  if (!ifdnfc_hsu_parse(connstring, port, sizeof port, &initial))
+    return nfc_open(context, connstring);
+
+  // The chip may still run at the rate of the last time
+  rate = ifdnfc_hsu_recall(connstring);
+  if (rate && rate != initial && (device = ifdnfc_hsu_open(port, rate))) {
+    *uart_rate = rate;
+    return device;
+  }
+
+  rate = initial;
+  if (profile->uart_baud_rate > initial)
+    rate = ifdnfc_hsu_negotiate(port, initial, profile->uart_baud_rate);
+  device = ifdnfc_hsu_open(port, rate);
+  if (!device && rate != initial && ifdnfc_hsu_restore(port, rate, initial)) {
+    rate = initial;
+    device = ifdnfc_hsu_open(port, rate);
+  }
+  if (!device && (rate = ifdnfc_hsu_probe(port))) {
+    // Left at a negotiated rate by an earlier pcscd, the memos are lost
+    if (rate > initial && rate > profile->uart_baud_rate
+        && ifdnfc_hsu_restore(port, rate, initial))
+      rate = initial;
+    device = ifdnfc_hsu_open(port, rate);
+  }
+  if (device) {
+    Log3(PCSC_LOG_INFO, "%s runs at %lu baud.", port, (unsigned long) rate);
+    *uart_rate = rate;
+    ifdnfc_hsu_remember(connstring, rate);
+  }
+
+  return device;
+}
+
+static void *prefetch(void *arg)
+{
+  struct ifdnfc_warm_device *warm = arg;
+  nfc_device *device;
+  uint32_t uart_rate;
+
+  device = ifdnfc_open_device(warm->connstring, &uart_rate);
+  if (!device)
+    Log2(PCSC_LOG_ERROR, "Could not open %s.", warm->connstring);
+
+  pthread_mutex_lock(&ifdnfc_warm_lock);
+  warm->device = device;
+  warm->parked = ifdnfc_now_ms();
+  warm->opening = false;
+  pthread_cond_broadcast(&ifdnfc_warm_opened);
+  if (device)
+    ifdnfc_warm_arm();
+  pthread_mutex_unlock(&ifdnfc_warm_lock);
+
+  return NULL;
+}
+
+/*
+ * Open a device in the background, so that the IFDHCreateChannelByName()
+ * calls pcscd makes one after the other find their devices open
+ */
+static void ifdnfc_prefetch(const char *connstring)
+{
+  struct ifdnfc_warm_device *warm = NULL;
+  size_t i;
+
+  pthread_mutex_lock(&ifdnfc_warm_lock);
+  for (i = 0; i < IFDNFC_WARM_DEVICES; i++)
+    if (!ifdnfc_warm_devices[i].device && !ifdnfc_warm_devices[i].opening) {
+      warm = &ifdnfc_warm_devices[i];
+      break;
+    }
+  if (!warm) {
+    pthread_mutex_unlock(&ifdnfc_warm_lock);
+    return;
+  }
+  if (warm->prefetched) {
+    // Done with its device, it only has to return
+    pthread_join(warm->thread, NULL);
+    warm->prefetched = false;
+  }
+  strncpy(warm->connstring, connstring, sizeof warm->connstring - 1);
+  warm->connstring[sizeof warm->connstring - 1] = '\0';
+  warm->opening = true;
+  if (pthread_create(&warm->thread, NULL, prefetch, warm) != 0)
+    warm->opening = false;
+  else
+    warm->prefetched = true;
+  pthread_mutex_unlock(&ifdnfc_warm_lock);
+}
+
+/*
+ * Activations done with IFDNFC_CTRL_ACTIVE, saved in the state file so that
+ * the readers come back active when pcscd restarts
+ */
+static struct ifdnfc_state ifdnfc_state;
+static pthread_mutex_t ifdnfc_state_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void ifdnfc_state_update(struct ifd_device *ifdnfc)
+{
+  if (!ifdnfc_conf.state_file[0] || !ifdnfc->device_name[0])
+    return;
+
+  pthread_mutex_lock(&ifdnfc_state_lock);
+  if (ifdnfc->connected) {
+    if (!ifdnfc_state_set(&ifdnfc_state, ifdnfc->device_name,
+                          ifdnfc->secure_element_as_card, ifdnfc->connstring))
+      Log2(PCSC_LOG_ERROR, "Could not save the activation of %s.", ifdnfc->device_name);
+  } else {
+    ifdnfc_state_remove(&ifdnfc_state, ifdnfc->device_name);
+  }
+  ifdnfc_state_save(&ifdnfc_state, ifdnfc_conf.state_file);
+  pthread_mutex_unlock(&ifdnfc_state_lock);
+}
+
+// Driver initialization: start opening all the saved devices at once
+static void ifdnfc_state_prefetch(void)
+{
+  size_t i;
+
+  if (!ifdnfc_conf.state_file[0])
+    return;
+
+  pthread_mutex_lock(&ifdnfc_state_lock);
+  if (!ifdnfc_state_load(&ifdnfc_state, ifdnfc_conf.state_file))
+    Log2(PCSC_LOG_ERROR, "Errors in %s, ignoring invalid activations.", ifdnfc_conf.state_file);
+  for (i = 0; i < ifdnfc_state.entries_len; i++)
+    ifdnfc_prefetch(ifdnfc_state.entries[i].connstring);
+  pthread_mutex_unlock(&ifdnfc_state_lock);
+}
+
+/*
+ * Round trip calibration. Switching the field off, which it is after open,
+ * is a chip command that does not go over the air on every reader; the
+ * median of a few of them is the cost of the host link (USB, UART, PC/SC).
+ * They are counted and watched like all other commands of the device.
+ */
+#define IFDNFC_CALIBRATION_ROUNDS   5
+#define IFDNFC_PROBE_CARD_MS        30    // card side of a presence check READ
+#define IFDNFC_PROBE_TIMEOUT_MAX_MS 500
+#define IFDNFC_PRESENCE_DUTY        20    // presence checks and polls take 1/20 of the link at most
+#define IFDNFC_WORKER_MARGIN_MIN_MS 500   // room for the recovery of a timed out APDU
+#define IFDNFC_WORKER_MARGIN_RTTS   32    // round trips of the chip commands of a request
+
+static uint32_t ifdnfc_link_rtt(struct ifd_device *ifdnfc)
+{
+  uint32_t samples[IFDNFC_CALIBRATION_ROUNDS], rtt;
+  uint64_t start;
+  size_t i, j;
+
+  for (i = 0; i < IFDNFC_CALIBRATION_ROUNDS; i++) {
+    start = ifdnfc_now_us();
+    if (rf_set_property_bool(ifdnfc, NP_ACTIVATE_FIELD, false) < 0) {
+      Log2(PCSC_LOG_DEBUG, "Could not calibrate (%s).", nfc_strerror(ifdnfc->device));
+      return 0;
+    }
+    rtt = ifdnfc_now_us() - start;
+    for (j = i; j > 0 && samples[j - 1] > rtt; j--)
+      samples[j] = samples[j - 1];
+    samples[j] = rtt;
+  }
+
+  return samples[IFDNFC_CALIBRATION_ROUNDS / 2];
+}
+
+/*
+ * Timing of presence checks, discovery and of the wait for the worker from
+ * the profile and the measured round trip
+ */
+static void ifdnfc_timing_update(struct ifd_device *ifdnfc)
+{
+  uint32_t rtt = ifdnfc->link_rtt;  // only written by the worker
+  unsigned int margin = IFDNFC_WORKER_MARGIN_MS;
+
+  ifdnfc->probe_timeout = IFDNFC_PROBE_TIMEOUT_MS;
+  ifdnfc->presence_interval = ifdnfc->profile.presence_interval;
+  ifdnfc->poll_interval_min = ifdnfc->profile.rf.poll_interval_min_ms;
+  if (rtt) {
+    // A READ takes one round trip, the reader may add as much for itself
+    ifdnfc->probe_timeout = IFDNFC_PROBE_CARD_MS + 4 * ((rtt + 999) / 1000);
+    if (ifdnfc->probe_timeout > IFDNFC_PROBE_TIMEOUT_MAX_MS)
+      ifdnfc->probe_timeout = IFDNFC_PROBE_TIMEOUT_MAX_MS;
+    if (ifdnfc->presence_interval < rtt * IFDNFC_PRESENCE_DUTY / 1000)
+      ifdnfc->presence_interval = rtt * IFDNFC_PRESENCE_DUTY / 1000;
+    if (ifdnfc->poll_interval_min < rtt * IFDNFC_PRESENCE_DUTY / 1000)
+      ifdnfc->poll_interval_min = rtt * IFDNFC_PRESENCE_DUTY / 1000;
+    margin = IFDNFC_WORKER_MARGIN_MIN_MS + IFDNFC_WORKER_MARGIN_RTTS * ((rtt + 999) / 1000);
+    if (margin > IFDNFC_WORKER_MARGIN_MS)
+      margin = IFDNFC_WORKER_MARGIN_MS;
+  }
+  if (ifdnfc->poll_interval && ifdnfc->poll_interval < ifdnfc->poll_interval_min)
+    ifdnfc->poll_interval = ifdnfc->poll_interval_min;
+
+  ifdnfc->worker_margin = margin;
+  pthread_mutex_lock(&ifdnfc->rf_lock);
+  ifdnfc->request_timeout = ifdnfc->profile.transceive_timeout + margin;
+  pthread_mutex_unlock(&ifdnfc->rf_lock);
+}
+
+static void ifdnfc_calibrate(struct ifd_device *ifdnfc)
+{
+  uint32_t rtt = 0;
+
+  if (ifdnfc->connected && ifdnfc->profile.calibrate)
+    rtt = ifdnfc_link_rtt(ifdnfc);
+  pthread_mutex_lock(&ifdnfc->rf_lock);
+  ifdnfc->link_rtt = rtt;
+  pthread_mutex_unlock(&ifdnfc->rf_lock);
+
+  ifdnfc_timing_update(ifdnfc);
+  if (rtt) {
+    Log5(PCSC_LOG_INFO, "%s: link round trip %lu us, probe timeout %u ms, presence interval %u ms.",
+         ifdnfc->connstring, (unsigned long) rtt, ifdnfc->probe_timeout, ifdnfc->presence_interval);
+    Log4(PCSC_LOG_INFO, "%s: poll interval %u ms, worker margin %u ms.",
+         ifdnfc->connstring, ifdnfc->poll_interval_min, ifdnfc->worker_margin);
+  }
+}
+
+static void ifdnfc_open(struct ifd_device *ifdnfc)
+{
+  const char *driver_connstring;
+
+  ifdnfc->device = ifdnfc_warm_take(ifdnfc->connstring);
+  if (ifdnfc->device)
+    ifdnfc->uart_rate = ifdnfc_hsu_recall(ifdnfc->connstring);
+  else
+    ifdnfc->device = ifdnfc_open_device(ifdnfc->connstring, &ifdnfc->uart_rate);
+  ifdnfc->connected = (ifdnfc->device) ? true : false;
+  ifdnfc->slot.state = IFDNFC_SLOT_FIELD_OFF;
+  ifdnfc->slot.reset = false;
+
+  driver_connstring = ifdnfc->device ? nfc_device_get_connstring(ifdnfc->device) : NULL;
+  ifdnfc->profile = *ifdnfc_conf_match(&ifdnfc_conf, ifdnfc->connstring, driver_connstring);
+  ifdnfc_profile_publish(ifdnfc);
+  if (ifdnfc->connected)
+    Log3(PCSC_LOG_DEBUG, "Using profile \"%s\" for %s.", ifdnfc->profile.name, ifdnfc->connstring);
+  ifdnfc->secure_element_as_card = ifdnfc->profile.secure_element
+                                   && !ifdnfc->profile.secure_element_slot;
+  ifdnfc_memo_init(&ifdnfc->memo, ifdnfc->connected ? ifdnfc->profile.response_cache : 0);
+  ifdnfc_rf_init(ifdnfc);
+  ifdnfc_watchdog_reset(ifdnfc);
+  ifdnfc_calibrate(ifdnfc);
+  ifdnfc_se_sync(ifdnfc);
+}
+
+/*
+ * Watchdog: replace a hung device by a new one on the same connstring. The
+ * Lun and the slots stay, a card that was known is selected again by the
+ * next request as after a field off.
+ */
+static void ifdnfc_reopen(struct ifd_device *ifdnfc)
+{
+  nfc_device *device;
+
+  Log2(PCSC_LOG_INFO, "Reopening %s.", ifdnfc->connstring);
+  pthread_mutex_lock(&ifdnfc->rf_lock);
+  device = ifdnfc->device;
+  ifdnfc->device = NULL;
+  pthread_mutex_unlock(&ifdnfc->rf_lock);
+  // Not parked in the warm cache, it is broken
+  if (device)
+    nfc_close(device);
+
+  device = ifdnfc_open_device(ifdnfc->connstring, &ifdnfc->uart_rate);
+  pthread_mutex_lock(&ifdnfc->rf_lock);
+  ifdnfc->device = device;
+  if (device)
+    ifdnfc->restarts++;
+  pthread_mutex_unlock(&ifdnfc->rf_lock);
+
+  if (ifdnfc_slot_present(&ifdnfc->slot))
+    ifdnfc_slot_set(ifdnfc, IFDNFC_SLOT_HALTED);
+  else
+    ifdnfc_slot_set(ifdnfc, IFDNFC_SLOT_FIELD_OFF);
+  ifdnfc_rf_init(ifdnfc);
+  if (device) {
+    ifdnfc->connected = true;
+    ifdnfc_watchdog_reset(ifdnfc);
+    ifdnfc_calibrate(ifdnfc);
+  } else {
+    // Tried again with the next request, no card until then
+    Log2(PCSC_LOG_ERROR, "Could not reopen %s.", ifdnfc->connstring);
+    ifdnfc_slot_set(ifdnfc, IFDNFC_SLOT_FIELD_OFF);
+    ifdnfc->connected = false;
+    ifdnfc->next_reopen = ifdnfc_now_ms() + IFDNFC_WATCHDOG_RETRY_MS;
+  }
+  ifdnfc_se_sync(ifdnfc);
+}
+
+static bool ifdnfc_state_restore(struct ifd_device *ifdnfc)
+{
+  const struct ifdnfc_state_entry *entry;
+  bool secure_element = false;
+
+  pthread_mutex_lock(&ifdnfc_state_lock);
+  entry = ifdnfc_state_find(&ifdnfc_state, ifdnfc->device_name);
+  if (entry) {
+    memcpy(ifdnfc->connstring, entry->connstring, sizeof ifdnfc->connstring);
+    secure_element = entry->secure_element;
+  }
+  pthread_mutex_unlock(&ifdnfc_state_lock);
+  if (!entry)
+    return false;
+
+  Log3(PCSC_LOG_INFO, "Restoring activation of %s with %s.", ifdnfc->device_name, ifdnfc->connstring);
+  ifdnfc_open(ifdnfc);
+  if (secure_element)
+    ifdnfc->secure_element_as_card = !ifdnfc->profile.secure_element_slot;
+  return ifdnfc->connected;
+}
+
+// Standard (ISO14443-A part 3) and card name of PC/SC part 3 from the SAK
+static const unsigned char *storage_card_name(uint8_t sak)
+{
+  static const unsigned char mifare_1k[] = { 0x03, 0x00, 0x01 };
+  static const unsigned char mifare_4k[] = { 0x03, 0x00, 0x02 };
+  static const unsigned char mifare_ul[] = { 0x03, 0x00, 0x03 };
+  static const unsigned char mifare_mini[] = { 0x03, 0x00, 0x26 };
+  static const unsigned char unknown[] = { 0x03, 0x00, 0x00 };
+
+  switch (sak) {
+    case 0x08:
+      return mifare_1k;
+    case 0x18:
+      return mifare_4k;
+    case 0x00:
+      return mifare_ul;
+    case 0x09:
+      return mifare_mini;
+    default:
+      return unknown;
+  }
+}
+
+static bool target_to_atr(struct ifd_device *ifdnfc)
+{
+  unsigned char atqb[12];
+  ifdnfc->slot.atr_len = sizeof(ifdnfc->slot.atr);
+
+  switch (ifdnfc->slot.target.nm.nmt) {
+    case NMT_ISO14443A:
+      // Type 2 tags are read with READ BINARY like other storage cards
+      if (ifdnfc->profile.uid_only || ifdnfc->slot.target.nti.nai.btSak == 0x00) {
+        if (!get_atr(ATR_ISO14443A_STORAGE, storage_card_name(ifdnfc->slot.target.nti.nai.btSak), 3,
+                     (unsigned char *) ifdnfc->slot.atr, &(ifdnfc->slot.atr_len))) {
+          ifdnfc->slot.atr_len = 0;
+          return false;
+        }
+        break;
+      }
+      /* libnfc already strips TL and CRC1/CRC2 */
+      if (!get_atr(ATR_ISO14443A_106,
+                   ifdnfc->slot.target.nti.nai.abtAts, ifdnfc->slot.target.nti.nai.szAtsLen,
+                   (unsigned char *) ifdnfc->slot.atr, &(ifdnfc->slot.atr_len))) {
+        Log1(PCSC_LOG_DEBUG, "get_atr: FAIL");
+        ifdnfc->slot.atr_len = 0;
+        return false;
+      }
+      Log1(PCSC_LOG_DEBUG, "get_atr: OK");
+      break;
+    case NMT_ISO14443B:
+      // First ATQB byte always equal to 0x50
+      atqb[0] = 0x50;
+
+      // Store the PUPI (Pseudo-Unique PICC Identifier)
+      memcpy(&atqb[1], ifdnfc->slot.target.nti.nbi.abtPupi, 4);
+
+      // Store the Application Data
+      memcpy(&atqb[5], ifdnfc->slot.target.nti.nbi.abtApplicationData, 4);
+
+      // Store the Protocol Info
+      memcpy(&atqb[9], ifdnfc->slot.target.nti.nbi.abtProtocolInfo, 3);
+      if (!get_atr(ATR_ISO14443B_106, atqb, sizeof(atqb),
+                   (unsigned char *) ifdnfc->slot.atr, &(ifdnfc->slot.atr_len)))
+        ifdnfc->slot.atr_len = 0;
+      return false;
+      break;
+    case NMT_ISO14443BI:
+    case NMT_ISO14443B2CT:
+    case NMT_ISO14443B2SR:
+    case NMT_JEWEL:
+    case NMT_FELICA:
+    case NMT_DEP:
+      /* for all other types: Empty ATR */
+      Log1(PCSC_LOG_INFO, "Returning empty ATR for card without APDU support.");
+      ifdnfc->slot.atr_len = 0;
+      return true;
+  }
+
+  return true;
+}
+
+static bool ifdnfc_target_to_atr(struct ifd_device *ifdnfc)
+{
+  size_t span = ifdnfc_trace_begin(&ifdnfc->trace, "ifdnfc_target_to_atr");
+  bool res = target_to_atr(ifdnfc);
+  ifdnfc_trace_end(&ifdnfc->trace, span);
+  return res;
+}
+
+/*
+ * Time left to the worker for the request it executes, short of
+ * IFDNFC_RECOVER_SLACK_MS to hand the result over before its caller gives up
+ */
+#define IFDNFC_RECOVER_SLACK_MS 100
+// Least time worth a resend or a reselection with RATS
+#define IFDNFC_RECOVER_MIN_MS   200
+
+static unsigned int request_time_left(const struct ifd_device *ifdnfc)
+{
+  uint64_t now = ifdnfc_now_ms() + IFDNFC_RECOVER_SLACK_MS;
+
+  return now < ifdnfc->deadline ? ifdnfc->deadline - now : 0;
+}
+
+/*
+ * With infinite_select the card is selected again until it answers, but only
+ * while the caller of the request waits: a selection retried by the chip
+ * itself would only end with the abort of the request.
+ */
+static int reselect_passive_target(struct ifd_device *ifdnfc, const uint8_t *uid, size_t uid_len,
+                                   nfc_target *pnt)
+{
+  int res;
+
+  do
+    res = rf_select_passive_target(ifdnfc, ifdnfc->slot.target.nm, uid, uid_len, pnt);
+  while (!res && ifdnfc->profile.infinite_select
+         && request_time_left(ifdnfc) >= IFDNFC_RECOVER_MIN_MS);
+
+  return res;
+}
+
+static bool reselect_target(struct ifd_device *ifdnfc, bool warm)
+{
+  switch (ifdnfc->slot.target.nm.nmt) {
+    case NMT_ISO14443A:
+      if (rf_set_property_bool(ifdnfc, NP_INFINITE_SELECT, false) < 0) {
+        Log2(PCSC_LOG_ERROR, "Could not set infinite-select property (%s)", nfc_strerror(ifdnfc->device));
+        return false;
+      }
+      bool soft = !ifdnfc->slot.iso_dep_pending && soft_iso_dep_wanted(ifdnfc, &ifdnfc->slot.target);
+      ifdnfc->slot.soft_iso_dep = false;
+      if (rf_set_property_bool(ifdnfc, NP_AUTO_ISO14443_4, !ifdnfc->slot.iso_dep_pending && !soft) < 0) {
+        Log2(PCSC_LOG_ERROR, "Could not set auto-ISO14443-4 property (%s)", nfc_strerror(ifdnfc->device));
+        return false;
+      }
+      nfc_target nt;
+      // the UID might change when the field was lost. We don't reuse it for a cold reselection
+      if (reselect_passive_target(ifdnfc, warm ? ifdnfc->slot.target.nti.nai.abtUid : NULL, warm ? ifdnfc->slot.target.nti.nai.szUidLen : 0, &nt) < 1) {
+        Log3(PCSC_LOG_DEBUG, "Could not select target %s. (%s)", str_nfc_modulation_type(ifdnfc->slot.target.nm.nmt), nfc_strerror(ifdnfc->device));
+        return false;
+      } else if (soft && !slot_iso_dep_activate(ifdnfc, &nt)) {
+        Log1(PCSC_LOG_DEBUG, "Could not activate ISO14443-4.");
+        return false;
+      } else {
+        if (!warm) {
+          // for a warm reset compare the ATS
+          if (ifdnfc->slot.target.nti.nai.szAtsLen == nt.nti.nai.szAtsLen
+              && 0 == memcmp(ifdnfc->slot.target.nti.nai.abtAts, nt.nti.nai.abtAts, nt.nti.nai.szAtsLen)) {
+            return true;
+          } else {
+            return false;
+          }
+        }
+        return true;
+      }
+      break;
+    case NMT_DEP:
+    case NMT_FELICA:
+    case NMT_ISO14443B2CT:
+    case NMT_ISO14443B2SR:
+    case NMT_ISO14443B:
+    case NMT_ISO14443BI:
+    case NMT_JEWEL:
+    default:
+      // TODO Implement me :)
+      break;
+  }
+  return false;
+}
+
+static bool ifdnfc_reselect_target(struct ifd_device *ifdnfc, bool warm)
+{
+  size_t span = ifdnfc_trace_begin(&ifdnfc->trace, "ifdnfc_reselect_target");
+  bool res = reselect_target(ifdnfc, warm);
+  ifdnfc_trace_end(&ifdnfc->trace, span);
+  return res;
+}
+
+// Select an ISO14443-A target again by its UID, with RATS this time
+static bool target_activate_iso_dep(struct ifd_device *ifdnfc, const nfc_target *target,
+                                    nfc_target *nt)
+{
+  bool soft = soft_iso_dep_wanted(ifdnfc, target);
+
+  // The driver's RATS goes to the target that is still selected
+  *nt = *target;
+  if (soft && slot_iso_dep_activate(ifdnfc, nt))
+    return true;
+  if (slot_deselect(ifdnfc) < 0)
+    Log2(PCSC_LOG_DEBUG, "Could not deselect target (%s).", nfc_strerror(ifdnfc->device));
+  if (rf_set_property_bool(ifdnfc, NP_AUTO_ISO14443_4, !soft) < 0
+      || rf_select_passive_target(ifdnfc, target->nm, target->nti.nai.abtUid,
+                                  target->nti.nai.szUidLen, nt) < 1)
+    return false;
+  return !soft || slot_iso_dep_activate(ifdnfc, nt);
+}
+
+static enum ifd_presence_probe presence_probe(const nfc_target *nt)
+{
+  switch (nt->nm.nmt) {
+    case NMT_ISO14443A:
+      if (nt->nti.nai.btSak & 0x20)
+        return IFDNFC_PROBE_ISO_DEP;
+      if (nt->nti.nai.btSak & 0x08)
+        return IFDNFC_PROBE_MIFARE;
+      if (nt->nti.nai.btSak == 0x00)
+        return IFDNFC_PROBE_T2T;
+      break;
+    case NMT_ISO14443B:
+      return IFDNFC_PROBE_ISO_DEP;
+    default:
+      break;
+  }
+  return IFDNFC_PROBE_GENERIC;
+}
+
+// A card that was just selected has no session state yet
+static void slot_selected(struct ifd_device *ifdnfc)
+{
+  if (ifdnfc->slot.iso_dep_pending)
+    ifdnfc->slot.probe = IFDNFC_PROBE_RESELECT;
+  else if (ifdnfc->slot.soft_iso_dep)
+    ifdnfc->slot.probe = IFDNFC_PROBE_SOFT_ISO_DEP;
+  else
+    ifdnfc->slot.probe = presence_probe(&ifdnfc->slot.target);
+  ifdnfc->slot.mifare_authenticated = false;
+  t2t_reset(&ifdnfc->slot.t2t);
+  // The SELECTs of the application are sent again before the next APDU
+  ifdnfc->slot.memo_path_sent = 0;
+  ifdnfc->slot.memo_off = false;
+  Log2(PCSC_LOG_DEBUG, "Presence probe: %s.", presence_probe_names[ifdnfc->slot.probe]);
+}
+
+static bool se_is_available(struct ifd_device *ifdnfc)
+{
+  if (!ifdnfc->connected)
+    return false;
+
+  if (ifdnfc->slot.state == IFDNFC_SLOT_SELECTED
+      || ifdnfc->slot.state == IFDNFC_SLOT_ACTIVE)
+    return true; // SE is considered as wired, so it is always available once detected as present
+
+  if (rf_initiator_init_secure_element(ifdnfc) < 0) {
+    Log2(PCSC_LOG_ERROR, "Could not initialize secure element mode. (%s)", nfc_strerror(ifdnfc->device));
+    ifdnfc_slot_set(ifdnfc, IFDNFC_SLOT_FIELD_OFF);
+    return false;
+  }
+  // Let the reader only try once to find a tag
+  if (rf_set_property_bool(ifdnfc, NP_INFINITE_SELECT, false) < 0) {
+    ifdnfc_slot_set(ifdnfc, IFDNFC_SLOT_FIELD_OFF);
+    return false;
+  }
+  // Read the SAM's info
+  const nfc_modulation nmSAM = {
+    .nmt = NMT_ISO14443A,
+    .nbr = NBR_106,
+  };
+
+  int res;
+  if ((res = rf_select_passive_target(ifdnfc, nmSAM, NULL, 0, &(ifdnfc->slot.target))) < 0) {
+    Log2(PCSC_LOG_ERROR, "Could not select secure element. (%s)", nfc_strerror(ifdnfc->device));
+    ifdnfc_slot_set(ifdnfc, IFDNFC_SLOT_FIELD_OFF);
+    return false;
+  } else if (res == 0) {
+    Log2(PCSC_LOG_ERROR, "No secure element available. (%s)", nfc_strerror(ifdnfc->device));
+    ifdnfc_slot_set(ifdnfc, IFDNFC_SLOT_FIELD_OFF);
+    return false;
+  } // else
+  Log1(PCSC_LOG_DEBUG, "Secure element selected.");
+  ifdnfc->slot.last_seen = ifdnfc_now_ms();
+  ifdnfc->slot.iso_dep_pending = false;
+  ifdnfc_target_to_atr(ifdnfc);
+  ifdnfc_slot_set(ifdnfc, IFDNFC_SLOT_SELECTED);
+  slot_selected(ifdnfc);
+
+  return true;
+}
+
+static bool ifdnfc_se_is_available(struct ifd_device *ifdnfc)
+{
+  size_t span = ifdnfc_trace_begin(&ifdnfc->trace, "ifdnfc_se_is_available");
+  bool res = se_is_available(ifdnfc);
+  ifdnfc_trace_end(&ifdnfc->trace, span);
+  return res;
+}
+
+static bool slot_probe(struct ifd_device *ifdnfc)
+{
+  uint8_t abtRead[2] = { 0x30, 0x00 };
+  uint8_t abtRx[16];
+  bool present;
+
+  switch (ifdnfc->slot.probe) {
+    case IFDNFC_PROBE_MIFARE:
+      // libnfc reselects MIFARE Classic cards, which would end the
+      // authentication. Reading within the authenticated sector keeps it.
+      if (!ifdnfc->slot.mifare_authenticated)
+        break;
+      abtRead[1] = ifdnfc->slot.mifare_block;
+      return rf_transceive_bytes(ifdnfc, abtRead, sizeof abtRead, abtRx, sizeof abtRx,
+                                 ifdnfc->probe_timeout) >= 0;
+    case IFDNFC_PROBE_T2T:
+      return rf_transceive_bytes(ifdnfc, abtRead, sizeof abtRead, abtRx, sizeof abtRx,
+                                 ifdnfc->probe_timeout) >= 0;
+    case IFDNFC_PROBE_RESELECT:
+      // Anything but RATS sends a selected ISO14443-4 card back to idle
+      if (rf_deselect_target(ifdnfc) < 0)
+        return false;
+      return ifdnfc_reselect_target(ifdnfc, true);
+    case IFDNFC_PROBE_SOFT_ISO_DEP:
+      if (!slot_raw_begin(ifdnfc))
+        return false;
+      present = isodep_present(&ifdnfc->iso_dep, slot_iso_dep_frame, ifdnfc);
+      slot_raw_end(ifdnfc);
+      return present;
+    case IFDNFC_PROBE_ISO_DEP:
+    case IFDNFC_PROBE_GENERIC:
+      break;
+  }
+  return rf_target_is_present(ifdnfc) >= 0;
+}
+
+/*
+ * Probe again a card that missed a presence check, so that a brief dropout
+ * at the edge of the field does not end the session
+ */
+static bool slot_probe_debounced(struct ifd_device *ifdnfc, uint64_t now)
+{
+  const struct ifdnfc_profile *profile = &ifdnfc->profile;
+  unsigned int failures = 0;
+  uint64_t pause_ms;
+  struct timespec pause;
+
+  if (slot_probe(ifdnfc))
+    return true;
+
+  pause_ms = profile->removal_probes > 1 ? profile->removal_window / profile->removal_probes : 0;
+  pause.tv_sec = pause_ms / 1000;
+  pause.tv_nsec = (pause_ms % 1000) * 1000000;
+  do {
+    if (++failures >= profile->removal_probes
+        || ifdnfc_now_ms() - now >= profile->removal_window)
+      return false;
+    Log2(PCSC_LOG_DEBUG, "Presence check %u failed, probing again.", failures);
+    nanosleep(&pause, NULL);
+  } while (!slot_probe(ifdnfc));
+
+  Log2(PCSC_LOG_INFO, "Card answered again after %u failed presence checks.", failures);
+  return true;
+}
+
+// SELECTED, ACTIVE: check the selected card with the probe for its type
+static bool slot_ping(struct ifd_device *ifdnfc, uint64_t now)
+{
+  if (!slot_probe_debounced(ifdnfc, now)) {
+    Log3(PCSC_LOG_INFO, "Connection lost with %s. (%s)", str_nfc_modulation_type(ifdnfc->slot.target.nm.nmt), nfc_strerror(ifdnfc->device));
+    ifdnfc_slot_set(ifdnfc, IFDNFC_SLOT_REMOVED);
+    ifdnfc_rf_wake(ifdnfc, now);
+    return false;
+  }
+  ifdnfc->slot.last_seen = now;
+  return true;
+}
+
+// HALTED -> SELECTED: switch the field on and select the known card again
+static bool slot_wake(struct ifd_device *ifdnfc, uint64_t now)
+{
+  if (rf_initiator_init(ifdnfc) < 0) {
+    Log2(PCSC_LOG_ERROR, "Could not initialize initiator mode. (%s)", nfc_strerror(ifdnfc->device));
+    ifdnfc_slot_set(ifdnfc, IFDNFC_SLOT_FIELD_OFF);
+    return false;
+  }
+  // the field was off, so the card needs a cold selection
+  if (!ifdnfc_reselect_target(ifdnfc, false)) {
+    Log3(PCSC_LOG_INFO, "Connection lost with %s. (%s)", str_nfc_modulation_type(ifdnfc->slot.target.nm.nmt), nfc_strerror(ifdnfc->device));
+    ifdnfc_slot_set(ifdnfc, IFDNFC_SLOT_REMOVED);
+    ifdnfc_rf_wake(ifdnfc, now);
+    return false;
+  }
+  ifdnfc_slot_set(ifdnfc, IFDNFC_SLOT_SELECTED);
+  slot_selected(ifdnfc);
+  ifdnfc->slot.last_seen = now;
+  return true;
+}
+
+/*
+ * ASLEEP -> SELECTED: wake the halted card up with WUPA, select it by its UID
+ * and activate ISO-DEP with the driver's RATS. InListPassiveTarget only sends
+ * REQA, which a halted card ignores.
+ */
+static bool slot_wake_asleep(struct ifd_device *ifdnfc, uint64_t now)
+{
+  nfc_target nt = ifdnfc->slot.target;
+  bool woken;
+
+  woken = slot_raw_begin(ifdnfc);
+  if (woken) {
+    woken = slot_wupa(ifdnfc) && slot_select_uid(ifdnfc) && slot_iso_dep_rats(ifdnfc, &nt);
+    slot_raw_end(ifdnfc);
+  }
+  if (!woken) {
+    Log3(PCSC_LOG_INFO, "Connection lost with %s. (%s)", str_nfc_modulation_type(ifdnfc->slot.target.nm.nmt), nfc_strerror(ifdnfc->device));
+    ifdnfc_slot_set(ifdnfc, IFDNFC_SLOT_REMOVED);
+    ifdnfc_rf_wake(ifdnfc, now);
+    return false;
+  }
+  ifdnfc->slot.target = nt;
+  ifdnfc_slot_set(ifdnfc, IFDNFC_SLOT_SELECTED);
+  slot_selected(ifdnfc);
+  ifdnfc->slot.last_seen = now;
+  return true;
+}
+
+// ASLEEP: presence check, the card answers WUPA and is halted again
+static bool slot_asleep_ping(struct ifd_device *ifdnfc, uint64_t now)
+{
+  bool present;
+
+  present = slot_raw_begin(ifdnfc);
+  if (present) {
+    present = slot_wupa(ifdnfc) && slot_hlta(ifdnfc);
+    slot_raw_end(ifdnfc);
+  }
+  if (!present) {
+    Log1(PCSC_LOG_INFO, "Halted card does not answer WUPA anymore.");
+    ifdnfc_slot_set(ifdnfc, IFDNFC_SLOT_REMOVED);
+    ifdnfc_rf_wake(ifdnfc, now);
+    return false;
+  }
+  ifdnfc->slot.last_seen = now;
+  return true;
+}
+
+/*
+ * HALTED, ASLEEP -> ACTIVE: the other slot of the device had taken the chip
+ * over, or the card is used without a power up after a power down
+ */
+static bool slot_resume(struct ifd_device *ifdnfc)
+{
+  uint64_t now = ifdnfc_now_ms();
+
+  if (ifdnfc->secure_element_as_card) {
+    if (!ifdnfc_se_is_available(ifdnfc))
+      return false;
+  } else if (ifdnfc->slot.state == IFDNFC_SLOT_ASLEEP) {
+    if (!slot_wake_asleep(ifdnfc, now))
+      return false;
+  } else if (!slot_wake(ifdnfc, now)) {
+    return false;
+  }
+  ifdnfc_slot_set(ifdnfc, IFDNFC_SLOT_ACTIVE);
+  return true;
+}
+
+/*
+ * Devices with secure_element_slot: the SE and the contactless interface
+ * cannot be used at the same time, libnfc sets the PN53x up for one of them.
+ * A slot takes the chip over for the command it executes and the card of the
+ * other slot is halted. It stays present and its state machine selects it
+ * again when it is powered up next, which also sets the chip up for it. A
+ * powered card loses its session this way, so it is reported reset to pcscd
+ * with slot_report_reset(). A presence check leaves the chip to a powered
+ * card that was used within the last IFDNFC_CHIP_HOLD_MS.
+ */
+#define IFDNFC_CHIP_HOLD_MS 500
+
+static bool slot_claim_chip(struct ifd_device *ifdnfc, bool preempt)
+{
+  struct ifd_device *host = ifdnfc->host ? ifdnfc->host : ifdnfc;
+  struct ifd_device *other = ifdnfc->host ? ifdnfc->host : ifdnfc->se;
+
+  if (!other || host->chip_owner == ifdnfc)
+    return true;
+  if (host->chip_owner == other) {
+    if (!preempt && other->slot.state == IFDNFC_SLOT_ACTIVE
+        && ifdnfc_now_ms() - other->slot.last_seen < IFDNFC_CHIP_HOLD_MS)
+      return false;
+    Log2(PCSC_LOG_DEBUG, "Switching to the %s.",
+         ifdnfc->secure_element_as_card ? "secure element" : "contactless interface");
+    if (other->slot.state == IFDNFC_SLOT_ACTIVE)
+      slot_report_reset(other);
+    ifdnfc_slot_set(other, ifdnfc_slot_present(&other->slot) ? IFDNFC_SLOT_HALTED : IFDNFC_SLOT_FIELD_OFF);
+  }
+  host->chip_owner = ifdnfc;
+  return true;
+}
+
+// Historical bytes of the ATS of an ISO14443-A target
+static const uint8_t *ats_historical_bytes(const nfc_iso14443a_info *nai, size_t *len)
+{
+  size_t idx = 1;
+
+  *len = 0;
+  if (!nai->szAtsLen)
+    return NULL;
+  /* Bits 5 to 7 tell if TA1/TB1/TC1 are available */
+  if (nai->abtAts[0] & 0x10) idx++; // TA
+  if (nai->abtAts[0] & 0x20) idx++; // TB
+  if (nai->abtAts[0] & 0x40) idx++; // TC
+  if (nai->szAtsLen <= idx)
+    return NULL;
+  *len = nai->szAtsLen - idx;
+  return nai->abtAts + idx;
+}
+
+enum filter_match {
+  FILTER_NO_MATCH,
+  FILTER_UNKNOWN,           // the other criteria match, hb needs the ATS
+  FILTER_MATCH,
+};
+
+static enum filter_match filter_match(const struct ifdnfc_target_filter *f,
+                                      const nfc_iso14443a_info *nai, bool ats_known)
+{
+  const uint8_t *hb;
+  size_t hb_len, i;
+
+  if (f->has_atqa)
+    for (i = 0; i < sizeof f->atqa; i++)
+      if ((nai->abtAtqa[i] & f->atqa_mask[i]) != (f->atqa[i] & f->atqa_mask[i]))
+        return FILTER_NO_MATCH;
+  if (f->has_sak && (nai->btSak & f->sak_mask) != (f->sak & f->sak_mask))
+    return FILTER_NO_MATCH;
+  if (f->uid_len > nai->szUidLen || memcmp(nai->abtUid, f->uid, f->uid_len))
+    return FILTER_NO_MATCH;
+  if (!f->hb_len)
+    return FILTER_MATCH;
+  if (!ats_known)
+    return FILTER_UNKNOWN;
+  hb = ats_historical_bytes(nai, &hb_len);
+  if (f->hb_len > hb_len || memcmp(hb, f->hb, f->hb_len))
+    return FILTER_NO_MATCH;
+  return FILTER_MATCH;
+}
+
+/*
+ * allow_targets and deny_targets of the profile: FILTER_MATCH serves the
+ * target, FILTER_UNKNOWN needs its ATS to decide
+ */
+static enum filter_match target_filter(const struct ifdnfc_profile *profile,
+                                       const nfc_iso14443a_info *nai, bool ats_known)
+{
+  enum filter_match allowed = profile->allow_len ? FILTER_NO_MATCH : FILTER_MATCH;
+  enum filter_match m;
+  bool unknown = false;
+  size_t i;
+
+  for (i = 0; i < profile->deny_len; i++) {
+    m = filter_match(&profile->deny[i], nai, ats_known);
+    if (m == FILTER_MATCH)
+      return FILTER_NO_MATCH;
+    unknown |= m == FILTER_UNKNOWN;
+  }
+  for (i = 0; i < profile->allow_len && allowed != FILTER_MATCH; i++) {
+    m = filter_match(&profile->allow[i], nai, ats_known);
+    if (m > allowed)
+      allowed = m;
+  }
+  if (allowed == FILTER_NO_MATCH)
+    return FILTER_NO_MATCH;
+
+  return unknown || allowed == FILTER_UNKNOWN ? FILTER_UNKNOWN : FILTER_MATCH;
+}
+
+static struct ifdnfc_mute_card *mute_find(struct ifd_device *ifdnfc, const nfc_target *nt)
+{
+  const nfc_iso14443a_info *nai = &nt->nti.nai;
+  size_t i;
+
+  for (i = 0; i < IFDNFC_MUTE_CARDS; i++)
+    if (ifdnfc->mute[i].uid_len && ifdnfc->mute[i].uid_len == nai->szUidLen
+        && !memcmp(ifdnfc->mute[i].uid, nai->abtUid, nai->szUidLen))
+      return &ifdnfc->mute[i];
+  return NULL;
+}
+
+static bool mute_is_ignored(struct ifd_device *ifdnfc, const nfc_target *nt, uint64_t now)
+{
+  const struct ifdnfc_mute_card *card = mute_find(ifdnfc, nt);
+
+  return card && card->failures >= ifdnfc->profile.mute_failures && now < card->until;
+}
+
+static void mute_failed(struct ifd_device *ifdnfc, const nfc_target *nt, uint64_t now)
+{
+  struct ifdnfc_mute_card *card;
+  size_t i;
+
+  if (!ifdnfc->profile.mute_failures || nt->nm.nmt != NMT_ISO14443A || !nt->nti.nai.szUidLen)
+    return;
+  card = mute_find(ifdnfc, nt);
+  if (!card) {
+    // Replace the card that failed longest ago
+    card = &ifdnfc->mute[0];
+    for (i = 1; i < IFDNFC_MUTE_CARDS; i++)
+      if (ifdnfc->mute[i].last_failure < card->last_failure)
+        card = &ifdnfc->mute[i];
+    memset(card, 0, sizeof *card);
+    memcpy(card->uid, nt->nti.nai.abtUid, nt->nti.nai.szUidLen);
+    card->uid_len = nt->nti.nai.szUidLen;
+  }
+  if (card->failures >= ifdnfc->profile.mute_failures)
+    // Ignored before, one more chance was not taken
+    card->failures = 0;
+  card->failures++;
+  card->last_failure = now;
+  if (card->failures >= ifdnfc->profile.mute_failures) {
+    card->until = now + ifdnfc->profile.mute_time;
+    LogXxd(PCSC_LOG_INFO, "Ignoring card that fails activation, UID ", card->uid, card->uid_len);
+  }
+}
+
+static void mute_forgive(struct ifd_device *ifdnfc, const nfc_target *nt)
+{
+  struct ifdnfc_mute_card *card = mute_find(ifdnfc, nt);
+
+  if (card)
+    memset(card, 0, sizeof *card);
+}
+
+#define IFDNFC_DISCOVERY_SKIPS 4
+
+/*
+ * Card skipped by discovery: released by the chip, which ends an ISO-DEP
+ * session with S(DESELECT), and halted, so that the next anticollision
+ * finds the other cards in the field
+ */
+static void slot_halt_skipped(struct ifd_device *ifdnfc)
+{
+  if (slot_deselect(ifdnfc) < 0)
+    Log2(PCSC_LOG_DEBUG, "Could not deselect target (%s).", nfc_strerror(ifdnfc->device));
+  if (!slot_raw_begin(ifdnfc))
+    return;
+  if (!slot_hlta(ifdnfc))
+    Log1(PCSC_LOG_DEBUG, "Card answered HLTA.");
+  slot_raw_end(ifdnfc);
+}
+
+/*
+ * ISO14443-A discovery with filters or mute card blacklisting: anticollision
+ * runs without RATS, so that unwanted cards are halted (HLTA) before anything
+ * else is sent to them and discovery moves on to the next one. ISO14443-4 is
+ * then activated by a selection by UID, a card that fails it is halted as
+ * well and counts one failure per discovery.
+ */
+static bool discover_screened(struct ifd_device *ifdnfc, const nfc_modulation nm, uint64_t now)
+{
+  const struct ifdnfc_profile *profile = &ifdnfc->profile;
+  nfc_target *nt = &ifdnfc->slot.target;
+  nfc_target iso;
+  enum filter_match m;
+  unsigned int skips;
+  bool failed = false;
+
+  for (skips = 0; skips < IFDNFC_DISCOVERY_SKIPS; skips++) {
+    if (rf_set_property_bool(ifdnfc, NP_AUTO_ISO14443_4, false) < 0
+        || rf_list_passive_targets(ifdnfc, nm, nt, 1) != 1)
+      return false;
+
+    // Without RATS now or later, there are no historical bytes to wait for
+    bool ats_known = profile->uid_only || !(nt->nti.nai.btSak & 0x20);
+    m = target_filter(profile, &nt->nti.nai, ats_known);
+    if (m == FILTER_NO_MATCH || mute_is_ignored(ifdnfc, nt, now)) {
+      LogXxd(PCSC_LOG_DEBUG, "Skipping card, UID ", nt->nti.nai.abtUid, nt->nti.nai.szUidLen);
+      slot_halt_skipped(ifdnfc);
+      continue;
+    }
+    if (ats_known)
+      return true;
+
+    if (!target_activate_iso_dep(ifdnfc, nt, &iso)) {
+      Log2(PCSC_LOG_INFO, "Could not activate ISO14443-4 (%s).", nfc_strerror(ifdnfc->device));
+      if (!failed)
+        mute_failed(ifdnfc, nt, now);
+      failed = true;
+      slot_halt_skipped(ifdnfc);
+      continue;
+    }
+    mute_forgive(ifdnfc, nt);
+    *nt = iso;
+    if (m == FILTER_UNKNOWN && target_filter(profile, &nt->nti.nai, true) != FILTER_MATCH) {
+      LogXxd(PCSC_LOG_DEBUG, "Skipping card, UID ", nt->nti.nai.abtUid, nt->nti.nai.szUidLen);
+      slot_halt_skipped(ifdnfc);
+      continue;
+    }
+    return true;
+  }
+
+  return false;
+}
+
+static bool slot_discover(struct ifd_device *ifdnfc, const nfc_modulation nm, uint64_t now)
+{
+  const struct ifdnfc_profile *profile = &ifdnfc->profile;
+  nfc_target *nt = &ifdnfc->slot.target;
+  bool found;
+
+  if (nm.nmt != NMT_ISO14443A
+      || (!profile->allow_len && !profile->deny_len && !profile->mute_failures)) {
+    if (rf_list_passive_targets(ifdnfc, nm, nt, 1) != 1)
+      return false;
+    if (profile->uid_only || !soft_iso_dep_wanted(ifdnfc, nt))
+      return true;
+    if (!slot_iso_dep_activate(ifdnfc, nt)) {
+      Log1(PCSC_LOG_INFO, "Could not activate ISO14443-4.");
+      mute_failed(ifdnfc, nt, now);
+      return false;
+    }
+    mute_forgive(ifdnfc, nt);
+    return true;
+  }
+
+  found = discover_screened(ifdnfc, nm, now);
+  if (!profile->uid_only && !profile->soft_iso_dep
+      && rf_set_property_bool(ifdnfc, NP_AUTO_ISO14443_4, true) < 0)
+    Log2(PCSC_LOG_ERROR, "Could not set auto-ISO14443-4 property (%s)", nfc_strerror(ifdnfc->device));
+
+  return found;
+}
+
+static bool target_is_available(struct ifd_device *ifdnfc)
+{
+  if (!ifdnfc->connected)
+    return false;
+
+  uint64_t now = ifdnfc_now_ms();
+
+  switch (ifdnfc->slot.state) {
+    case IFDNFC_SLOT_ACTIVE:
+      if (now - ifdnfc->slot.last_seen < ifdnfc->presence_interval)
+        return true;
+      return slot_ping(ifdnfc, now);
+    case IFDNFC_SLOT_SELECTED:
+      // Card is powered down: switch the field off once the hysteresis
+      // elapsed and only check it again at the discovery rate
+      if (!ifdnfc_rf_field_off_due(ifdnfc, now))
+        return slot_ping(ifdnfc, now);
+      ifdnfc_rf_field_off(ifdnfc);
+      if (ifdnfc->slot.state != IFDNFC_SLOT_HALTED)
+        return slot_ping(ifdnfc, now);
+      ifdnfc->next_poll = now + ifdnfc->poll_interval_min;
+      return true;
+    case IFDNFC_SLOT_HALTED:
+      if (!ifdnfc_rf_poll_due(ifdnfc, now))
+        return true;
+      // Still there? Let it sleep again right away, the field is not needed
+      if (!slot_wake(ifdnfc, now))
+        return false;
+      ifdnfc_rf_field_off(ifdnfc);
+      ifdnfc->next_poll = now + ifdnfc->poll_interval_min;
+      return true;
+    case IFDNFC_SLOT_ASLEEP:
+      // Halted by a power down: same hysteresis before the field goes off,
+      // until then the card is to answer WUPA at the discovery rate
+      if (ifdnfc_rf_field_off_due(ifdnfc, now)) {
+        ifdnfc_rf_field_off(ifdnfc);
+        if (ifdnfc->slot.state == IFDNFC_SLOT_HALTED) {
+          ifdnfc->next_poll = now + ifdnfc->poll_interval_min;
+          return true;
+        }
+      }
+      if (!ifdnfc_rf_poll_due(ifdnfc, now))
+        return true;
+      if (!slot_asleep_ping(ifdnfc, now))
+        return false;
+      ifdnfc->next_poll = now + ifdnfc->poll_interval_min;
+      return true;
+    case IFDNFC_SLOT_FIELD_OFF:
+    case IFDNFC_SLOT_IDLE:
+    case IFDNFC_SLOT_REMOVED:
+      break;
+  }
+
+  // Low duty cycle discovery while no card has shown up for a while
+  if (!ifdnfc_rf_poll_due(ifdnfc, now))
+    return false;
+
+  // The field is needed to discover a card
+  if (ifdnfc->slot.state == IFDNFC_SLOT_FIELD_OFF) {
+    if (rf_initiator_init(ifdnfc) < 0) {
+      Log2(PCSC_LOG_ERROR, "Could not init NFC device in initiator mode (%s).", nfc_strerror(ifdnfc->device));
+      return false;
+    }
+    ifdnfc_slot_set(ifdnfc, IFDNFC_SLOT_IDLE);
+  }
+
+  // UID-only mode stops after anticollision, RATS of the driver's ISO-DEP follows it
+  if ((ifdnfc->profile.uid_only || ifdnfc->profile.soft_iso_dep)
+      && rf_set_property_bool(ifdnfc, NP_AUTO_ISO14443_4, false) < 0)
+    Log2(PCSC_LOG_ERROR, "Could not set auto-ISO14443-4 property (%s)", nfc_strerror(ifdnfc->device));
+
+  // find new connection
+  size_t i;
+  for (i = 0; i < ifdnfc->profile.modulations_len; i++) {
+    if (ifdnfc->profile.modulations[i].nbr > ifdnfc->profile.max_bitrate)
+      continue;
+    if (slot_discover(ifdnfc, ifdnfc->profile.modulations[i], now)) {
+      ifdnfc->slot.iso_dep_pending = ifdnfc->profile.uid_only
+                                     && ifdnfc->slot.target.nm.nmt == NMT_ISO14443A
+                                     && (ifdnfc->slot.target.nti.nai.btSak & 0x20);
+      ifdnfc_target_to_atr(ifdnfc);
+      slot_selected(ifdnfc);
+      // The target stays selected with the field on until it is powered
+      // up or the field off delay elapsed
+      ifdnfc_slot_set(ifdnfc, IFDNFC_SLOT_SELECTED);
+      ifdnfc->slot.last_seen = now;
+      ifdnfc_rf_wake(ifdnfc, now);
+      Log2(PCSC_LOG_INFO, "Connected to %s.", str_nfc_modulation_type(ifdnfc->slot.target.nm.nmt));
+      return true;
+    }
+  }
+  Log1(PCSC_LOG_DEBUG, "Could not find any NFC targets.");
+  ifdnfc_slot_set(ifdnfc, IFDNFC_SLOT_IDLE);
+  ifdnfc_rf_backoff(ifdnfc, now);
+  return false;
+}
+
+static bool ifdnfc_target_is_available(struct ifd_device *ifdnfc)
+{
+  size_t span = ifdnfc_trace_begin(&ifdnfc->trace, "ifdnfc_target_is_available");
+  bool res = target_is_available(ifdnfc);
+  ifdnfc_trace_end(&ifdnfc->trace, span);
+  return res;
+}
+
+// Power up: bring the card to ACTIVE from whatever state it is in
+static bool slot_power_up(struct ifd_device *ifdnfc)
+{
+  uint64_t now = ifdnfc_now_ms();
+
+  switch (ifdnfc->slot.state) {
+    case IFDNFC_SLOT_HALTED:
+      if (!slot_wake(ifdnfc, now))
+        return false;
+      break;
+    case IFDNFC_SLOT_ASLEEP:
+      // Not the card that was halted anymore: find out what is there now
+      if (!slot_wake_asleep(ifdnfc, now) && !ifdnfc_target_is_available(ifdnfc))
+        return false;
+      break;
+    case IFDNFC_SLOT_SELECTED:
+    case IFDNFC_SLOT_ACTIVE:
+      if (now - ifdnfc->slot.last_seen >= ifdnfc->presence_interval
+          && !slot_ping(ifdnfc, now))
+        return false;
+      break;
+    case IFDNFC_SLOT_FIELD_OFF:
+    case IFDNFC_SLOT_IDLE:
+    case IFDNFC_SLOT_REMOVED:
+      if (!ifdnfc_target_is_available(ifdnfc))
+        return false;
+      break;
+  }
+  ifdnfc_slot_set(ifdnfc, IFDNFC_SLOT_ACTIVE);
+
+  return true;
+}
+
+/*
+ * Runtime tuning through the vendor attributes. The worker of the reader
+ * reads and writes them between two requests, so that each command sees
+ * either the old or the new values. It also reads the counters of the
+ * ISO-DEP layer and the ATR of the slot, which only it updates.
+ */
+static bool tuning_tag(DWORD Tag)
+{
+  switch (Tag) {
+    case IFDNFC_ATTR_TRANSCEIVE_TIMEOUT:
+    case IFDNFC_ATTR_PRESENCE_INTERVAL:
+    case IFDNFC_ATTR_INFINITE_SELECT:
+    case IFDNFC_ATTR_MODULATIONS:
+      return true;
+  }
+  return false;
+}
+
+static RESPONSECODE tuning_get(struct ifd_device *ifdnfc, DWORD Tag,
+                               PUCHAR Value, PDWORD Length)
+{
+  const struct ifdnfc_profile *profile = &ifdnfc->profile;
+  uint32_t value;
+  size_t i;
+
+  switch (Tag) {
+    case IFDNFC_ATTR_TRANSCEIVE_TIMEOUT:
+      value = profile->transceive_timeout;
+      break;
+    case IFDNFC_ATTR_PRESENCE_INTERVAL:
+      value = profile->presence_interval;
+      break;
+    case IFDNFC_ATTR_INFINITE_SELECT:
+      value = profile->infinite_select;
+      break;
+    case IFDNFC_ATTR_ISO_DEP_BLOCKS:
+      value = ifdnfc->iso_dep.stats.blocks;
+      break;
+    case IFDNFC_ATTR_ISO_DEP_CHAINED:
+      value = ifdnfc->iso_dep.stats.chained;
+      break;
+    case IFDNFC_ATTR_ISO_DEP_WTX:
+      value = ifdnfc->iso_dep.stats.wtx;
+      break;
+    case IFDNFC_ATTR_ISO_DEP_RETRANSMISSIONS:
+      value = ifdnfc->iso_dep.stats.retransmissions;
+      break;
+    case IFDNFC_ATTR_ISO_DEP_ERRORS:
+      value = ifdnfc->iso_dep.stats.errors;
+      break;
+    case TAG_IFD_ATR:
+#ifdef SCARD_ATTR_ATR_STRING
+    case SCARD_ATTR_ATR_STRING:
+#endif
+      if (!ifdnfc->connected || !ifdnfc_slot_present(&ifdnfc->slot))
+        return IFD_COMMUNICATION_ERROR;
+      if (*Length < ifdnfc->slot.atr_len)
+        return IFD_COMMUNICATION_ERROR;
+      memcpy(Value, ifdnfc->slot.atr, ifdnfc->slot.atr_len);
+      *Length = ifdnfc->slot.atr_len;
+      return IFD_SUCCESS;
+    case IFDNFC_ATTR_CARD_ENTERED:
+      if (!ifdnfc_slot_present(&ifdnfc->slot))
+        return IFD_COMMUNICATION_ERROR;
+      if (*Length < sizeof ifdnfc->card_entered)
+        return IFD_ERROR_INSUFFICIENT_BUFFER;
+      memcpy(Value, &ifdnfc->card_entered, sizeof ifdnfc->card_entered);
+      *Length = sizeof ifdnfc->card_entered;
+      return IFD_SUCCESS;
+    case IFDNFC_ATTR_MODULATIONS:
+      if (*Length < 2 * profile->modulations_len)
+        return IFD_ERROR_INSUFFICIENT_BUFFER;
+      for (i = 0; i < profile->modulations_len; i++) {
+        Value[2 * i] = profile->modulations[i].nmt;
+        Value[2 * i + 1] = profile->modulations[i].nbr;
+      }
+      *Length = 2 * profile->modulations_len;
+      return IFD_SUCCESS;
+    default:
+      return IFD_ERROR_TAG;
+  }
+  if (*Length < sizeof value)
+    return IFD_ERROR_INSUFFICIENT_BUFFER;
+  memcpy(Value, &value, sizeof value);
+  *Length = sizeof value;
+
+  return IFD_SUCCESS;
+}
+
+static RESPONSECODE tuning_set(struct ifd_device *ifdnfc, DWORD Tag,
+                               PUCHAR Value, DWORD Length)
+{
+  struct ifd_device *owner = ifdnfc->host ? ifdnfc->host : ifdnfc;
+  struct ifdnfc_profile profile = owner->profile;
+  uint32_t value = 0;
+  size_t i;
+
+  if (Tag == IFDNFC_ATTR_MODULATIONS) {
+    if (!Length || Length % 2 || Length / 2 > IFDNFC_CONF_MAX_MODULATIONS)
+      return IFD_ERROR_SET_FAILURE;
+    for (i = 0; i < Length / 2; i++) {
+      // passive targets only
+      if (Value[2 * i] < NMT_ISO14443A || Value[2 * i] >= NMT_DEP
+          || Value[2 * i + 1] < NBR_106 || Value[2 * i + 1] > NBR_847)
+        return IFD_ERROR_SET_FAILURE;
+      profile.modulations[i].nmt = Value[2 * i];
+      profile.modulations[i].nbr = Value[2 * i + 1];
+    }
+    profile.modulations_len = Length / 2;
+  } else {
+    if (Length != sizeof value)
+      return IFD_ERROR_SET_FAILURE;
+    memcpy(&value, Value, sizeof value);
+    switch (Tag) {
+      case IFDNFC_ATTR_TRANSCEIVE_TIMEOUT:
+        if (value > INT_MAX)
+          return IFD_ERROR_SET_FAILURE;
+        profile.transceive_timeout = value;
+        break;
+      case IFDNFC_ATTR_PRESENCE_INTERVAL:
+        profile.presence_interval = value;
+        break;
+      case IFDNFC_ATTR_INFINITE_SELECT:
+        if (value > 1)
+          return IFD_ERROR_SET_FAILURE;
+        profile.infinite_select = value;
+        break;
+      default:
+        return IFD_ERROR_TAG;
+    }
+  }
+
+  Log3(PCSC_LOG_INFO, "%s: attribute %08lx changed.", owner->connstring, (unsigned long) Tag);
+  owner->profile = profile;
+  ifdnfc_timing_update(owner);
+  if (owner->se) {
+    // The SE slot keeps its own secure element settings
+    owner->se->profile.transceive_timeout = profile.transceive_timeout;
+    owner->se->profile.presence_interval = profile.presence_interval;
+    owner->se->profile.infinite_select = profile.infinite_select;
+    memcpy(owner->se->profile.modulations, profile.modulations, sizeof profile.modulations);
+    owner->se->profile.modulations_len = profile.modulations_len;
+    ifdnfc_timing_update(owner->se);
+  }
+
+  return IFD_SUCCESS;
+}
+
+enum ifdnfc_request_type {
+  IFDNFC_REQUEST_POWER,
+  IFDNFC_REQUEST_TRANSMIT,
+  IFDNFC_REQUEST_PRESENCE,
+  IFDNFC_REQUEST_CONTROL,
+  IFDNFC_REQUEST_GET_ATTRIBUTE,
+  IFDNFC_REQUEST_SET_ATTRIBUTE,
+};
+
+/*
+ * IFDH call executed by the worker of a device. The request owns copies of
+ * the caller's buffers, so that it may outlive a caller who gave up waiting.
+ */
+struct ifdnfc_request {
+  struct ifdnfc_work work;
+  struct ifd_device *ifdnfc;
+  enum ifdnfc_request_type type;
+  DWORD code;                 // Action, dwControlCode, Tag or peek
+  PUCHAR tx;
+  DWORD tx_len;
+  PUCHAR rx;
+  DWORD rx_len;               // capacity of rx, then length of the response
+  SCARD_IO_HEADER recv_pci;
+  RESPONSECODE rv;
+  uint64_t deadline;          // the caller stops waiting then
+};
+
+static RESPONSECODE ifdnfc_power_icc(struct ifd_device *ifdnfc, DWORD Action,
+                                     PUCHAR Atr, PDWORD AtrLength);
+static RESPONSECODE ifdnfc_transmit(struct ifd_device *ifdnfc, PUCHAR TxBuffer,
+                                    DWORD TxLength, PUCHAR RxBuffer, PDWORD RxLength,
+                                    PSCARD_IO_HEADER RecvPci);
+static RESPONSECODE ifdnfc_icc_presence(struct ifd_device *ifdnfc, bool peek);
+static RESPONSECODE ifdnfc_control(struct ifd_device *ifdnfc, DWORD dwControlCode,
+                                   PUCHAR TxBuffer, DWORD TxLength, PUCHAR RxBuffer,
+                                   DWORD RxLength, LPDWORD pdwBytesReturned);
+
+static void ifdnfc_request_run(struct ifdnfc_work *work)
+{
+  struct ifdnfc_request *req = (struct ifdnfc_request *) work;
+  struct ifd_device *owner = req->ifdnfc->host ? req->ifdnfc->host : req->ifdnfc;
+  DWORD dwBytesReturned = 0;
+
+  req->ifdnfc->deadline = req->deadline;
+  ifdnfc_rf_rearm(req->ifdnfc);
+  if (ifdnfc_watchdog_due(owner))
+    ifdnfc_reopen(owner);
+
+  switch (req->type) {
+    case IFDNFC_REQUEST_POWER:
+      req->rv = ifdnfc_power_icc(req->ifdnfc, req->code, req->rx, &req->rx_len);
+      break;
+    case IFDNFC_REQUEST_TRANSMIT:
+      req->rv = ifdnfc_transmit(req->ifdnfc, req->tx, req->tx_len,
+                                req->rx, &req->rx_len, &req->recv_pci);
+      break;
+    case IFDNFC_REQUEST_PRESENCE:
+      req->rv = ifdnfc_icc_presence(req->ifdnfc, req->code != 0);
+      break;
+    case IFDNFC_REQUEST_CONTROL:
+      req->rv = ifdnfc_control(req->ifdnfc, req->code, req->tx, req->tx_len,
+                               req->rx, req->rx_len, &dwBytesReturned);
+      req->rx_len = dwBytesReturned;
+      break;
+    case IFDNFC_REQUEST_GET_ATTRIBUTE:
+      req->rv = tuning_get(req->ifdnfc, req->code, req->rx, &req->rx_len);
+      break;
+    case IFDNFC_REQUEST_SET_ATTRIBUTE:
+      req->rv = tuning_set(req->ifdnfc, req->code, req->tx, req->tx_len);
+      break;
+  }
+}
+
+static void ifdnfc_request_release(struct ifdnfc_work *work)
+{
+  free(work);
+}
+
+/*
+ * Let the worker of the device execute the request and wait at most
+ * timeout_ms for the result, so that a stalled device only blocks its
+ * own callers.
+ */
+static RESPONSECODE ifdnfc_call(struct ifd_device *ifdnfc, enum ifdnfc_request_type type,
+                                DWORD code, PUCHAR tx, DWORD tx_len,
+                                PUCHAR rx, PDWORD rx_len, PSCARD_IO_HEADER recv_pci,
+                                unsigned int timeout_ms)
+{
+  DWORD rx_cap = rx_len ? *rx_len : 0;
+  // The SE slot shares the worker of slot 0, which owns the reader
+  struct ifdnfc_worker *worker = ifdnfc->host ? &ifdnfc->host->worker : &ifdnfc->worker;
+  struct ifdnfc_request *req;
+  RESPONSECODE rv;
+
+  req = malloc(sizeof *req + tx_len + rx_cap);
+  if (!req)
+    return IFD_COMMUNICATION_ERROR;
+  req->work.run = ifdnfc_request_run;
+  req->work.release = ifdnfc_request_release;
+  req->ifdnfc = ifdnfc;
+  req->type = type;
+  req->code = code;
+  req->tx = (PUCHAR) (req + 1);
+  req->tx_len = tx_len;
+  if (tx_len)
+    memcpy(req->tx, tx, tx_len);
+  req->rx = req->tx + tx_len;
+  req->rx_len = rx_cap;
+  memset(&req->recv_pci, 0, sizeof req->recv_pci);
+  req->rv = IFD_COMMUNICATION_ERROR;
+  req->deadline = ifdnfc_now_ms() + timeout_ms;
+
+  switch (ifdnfc_worker_submit(worker, &req->work, timeout_ms)) {
+    case IFDNFC_WORK_DONE:
+      rv = req->rv;
+      if (rx_len) {
+        if (req->rx_len > rx_cap)
+          req->rx_len = rx_cap;
+        memcpy(rx, req->rx, req->rx_len);
+        *rx_len = req->rx_len;
+      }
+      if (recv_pci)
+        recv_pci->Protocol = req->recv_pci.Protocol;
+      break;
+    case IFDNFC_WORK_ABANDONED:
+      // the worker frees the request when the device comes back
+      Log2(PCSC_LOG_ERROR, "%s does not respond.", ifdnfc->connstring);
+      ifdnfc_abort(ifdnfc);
+      ifdnfc_watchdog_trip(ifdnfc);
+      if (rx_len)
+        *rx_len = 0;
+      return IFD_RESPONSE_TIMEOUT;
+    default:
+      Log2(PCSC_LOG_ERROR, "%s is busy.", ifdnfc->connstring);
+      if (rx_len)
+        *rx_len = 0;
+      rv = IFD_RESPONSE_TIMEOUT;
+      break;
+  }
+  free(req);
+
+  return rv;
+}
+
+/*
+ * List of Defined Functions Available to IFD_Handler 3.0
+ */
+// pcscd opens the SE slot after slot 0, with the same device name
+static RESPONSECODE create_se_slot(DWORD Lun)
+{
+  struct ifd_device *host, *se = NULL;
+  int device_index, i;
+
+  pthread_mutex_lock(&ifd_devices_lock);
+  device_index = lun2device_index(Lun & ~(DWORD) 0xFFFF);
+  if (device_index < 0 || ifd_devices[device_index].se) {
+    pthread_mutex_unlock(&ifd_devices_lock);
+    return IFD_COMMUNICATION_ERROR;
+  }
+  host = &ifd_devices[device_index];
+  for (i = 0; i < ifdnfc_max_devices(); i++)
+    if (ifd_devices[i].Lun == -1) {
+      se = &ifd_devices[i];
+      break;
+    }
+  if (!se) {
+    pthread_mutex_unlock(&ifd_devices_lock);
+    return IFD_COMMUNICATION_ERROR;
+  }
+  se->Lun = Lun;
+  se->host = host;
+  se->se = NULL;
+  se->chip_owner = NULL;
+  se->secure_element_as_card = true;
+  se->slot.state = IFDNFC_SLOT_FIELD_OFF;
+  se->slot.reset = false;
+  ifdnfc_cancel_init(se);
+  host->se = se;
+  ifdnfc_se_sync(host);
+  pthread_mutex_unlock(&ifd_devices_lock);
+
+  Log2(PCSC_LOG_INFO, "Secure element of %s is on slot 1.", host->connstring);
+  return IFD_SUCCESS;
+}
+
+RESPONSECODE
+IFDHCreateChannelByName(DWORD Lun, LPSTR DeviceName)
+{
+  (void) Lun;
+  int device_index = 0, i;
+  pthread_mutex_lock(&ifd_devices_lock);
   if (! ifdnfc_initialized) {
     Log1(PCSC_LOG_DEBUG, "Driver initialization");
     for (i = 0; i < IFDNFC_MAX_DEVICES; i++)
       ifd_devices[i].Lun = -1;
+    ifdnfc_conf_init(&ifdnfc_conf);
+    const char *conf_file = getenv("IFDNFC_CONF");
+    if (!ifdnfc_conf_load(&ifdnfc_conf, conf_file ? conf_file : IFDNFC_CONF_FILE))
+      Log1(PCSC_LOG_ERROR, "Errors in configuration file, ignoring invalid options.");
+    ifdnfc_trace_setup(ifdnfc_conf.trace_file, ifdnfc_conf.trace_threshold);
     nfc_init(&context);
     if (context == NULL) {
       Log1(PCSC_LOG_ERROR, "Unable to init libnfc (malloc)");
+      pthread_mutex_unlock(&ifd_devices_lock);
       return IFD_COMMUNICATION_ERROR;
     }
+    ifdnfc_state_prefetch();
     ifdnfc_initialized = true;
     // First slot is free
     device_index = 0;
+  } else if (Lun & 0xFFFF) {
+    pthread_mutex_unlock(&ifd_devices_lock);
+    return create_se_slot(Lun);
   } else {
     // Find a free slot
-    for (i = 0; i < IFDNFC_MAX_DEVICES; i++)
+    for (i = 0; i < ifdnfc_max_devices(); i++)
       if (ifd_devices[i].Lun == -1) {
         device_index = i;
         break;
-      } else if (i == IFDNFC_MAX_DEVICES - 1) {
+      } else if (i == ifdnfc_max_devices() - 1) {
         // No free slot
+        pthread_mutex_unlock(&ifd_devices_lock);
         return IFD_COMMUNICATION_ERROR;
       }
   }
 
   struct ifd_device *ifdnfc = &ifd_devices[device_index];
-  ifdnfc->device = NULL;
-  ifdnfc->connected = false;
-  ifdnfc->slot.present = false;
+  ifdnfc->Lun = Lun;
+  pthread_mutex_unlock(&ifd_devices_lock);
+  ifdnfc->device = NULL;
+  ifdnfc->connstring[0] = '\0';
+  ifdnfc->connected = false;
+  ifdnfc->host = NULL;
+  ifdnfc->se = NULL;
+  ifdnfc->chip_owner = NULL;
+  ifdnfc->uart_rate = 0;
+  strncpy(ifdnfc->device_name, DeviceName, sizeof ifdnfc->device_name - 1);
+  ifdnfc->device_name[sizeof ifdnfc->device_name - 1] = '\0';
+  ifdnfc->slot.state = IFDNFC_SLOT_FIELD_OFF;
+  ifdnfc->profile = ifdnfc_conf.defaults;
+  ifdnfc_rf_init(ifdnfc);
+  ifdnfc_cancel_init(ifdnfc);
+  ifdnfc_profile_publish(ifdnfc);
+
+  // USB DeviceNames can be immediately handled, e.g.:
+  // usb:1fd3/0608:libudev:0:/dev/bus/usb/002/079
+  // => connstring usb:002:079
+  int n = strlen(DeviceName) + 1;
+  char *vidpid      = malloc(n);
+  char *hpdriver    = malloc(n);
+  char *ifn         = malloc(n);
+  char *devpath     = malloc(n);
+  char *dirname     = malloc(n);
+  char *filename    = malloc(n);
+
+  int res = sscanf(DeviceName, "usb:%4[^:]:%4[^:]:%32[^:]:%32[^:]", vidpid, hpdriver, ifn, devpath);
+  if (res == 4) {
+    res = sscanf(devpath, "/dev/bus/usb/%3[^/]/%3[^/]", dirname, filename);
+    if (res == 2) {
+      strcpy(ifdnfc->connstring, "usb:xxx:xxx");
+      memcpy(ifdnfc->connstring + 4, dirname, 3);
+      memcpy(ifdnfc->connstring + 8, filename, 3);
+      ifdnfc_open(ifdnfc);
+    }
+  }
+  free(vidpid);
+  free(hpdriver);
+  free(ifn);
+  free(devpath);
+  free(dirname);
+  free(filename);
+
+  if (!ifdnfc->connected)
+    ifdnfc_state_restore(ifdnfc);
+
+  if (!ifdnfc_worker_start(&ifdnfc->worker)) {
+    Log1(PCSC_LOG_ERROR, "Could not start worker thread.");
+    ifdnfc_disconnect(ifdnfc);
+    ifdnfc_cancel_destroy(ifdnfc);
+    ifdnfc->Lun = -1;
+    return IFD_COMMUNICATION_ERROR;
+  }
+
+  if (!ifdnfc->connected)
+    Log2(PCSC_LOG_DEBUG, "\"DEVICENAME    %s\" is not used.", DeviceName);
+  else
+    Log2(PCSC_LOG_DEBUG, "\"DEVICENAME    %s\" is used by libnfc.", DeviceName);
+  Log1(PCSC_LOG_INFO, "IFD-handler for NFC devices is ready.");
+  return IFD_SUCCESS;
+}
+
+RESPONSECODE
+// cppcheck-suppress unusedFunction
+IFDHCreateChannel(DWORD Lun, DWORD Channel)
+{
+  char str[16];
+  snprintf(str, sizeof str, "/dev/pcsc/%lu", (unsigned long) Channel);
+
+  return IFDHCreateChannelByName(Lun, str);
+}
+
+RESPONSECODE
+// cppcheck-suppress unusedFunction
+IFDHCloseChannel(DWORD Lun)
+{
+  (void) Lun;
+  int device_index = lun2device_index(Lun);
+  if (device_index < 0)
+    return IFD_COMMUNICATION_ERROR;
+  struct ifd_device *ifdnfc = &ifd_devices[device_index];
+  ifdnfc_abort(ifdnfc);
+  if (ifdnfc->host) {
+    // SE slot, the reader stays with slot 0
+    pthread_mutex_lock(&ifd_devices_lock);
+    if (ifdnfc->host->chip_owner == ifdnfc)
+      ifdnfc->host->chip_owner = NULL;
+    ifdnfc->host->se = NULL;
+    ifdnfc->host = NULL;
+    pthread_mutex_unlock(&ifd_devices_lock);
+  } else {
+    ifdnfc_worker_stop(&ifdnfc->worker);
+    ifdnfc_disconnect(ifdnfc);
+    pthread_mutex_lock(&ifd_devices_lock);
+    if (ifdnfc->se) {
+      // Left without reader, its calls fail until pcscd closes it
+      ifdnfc->se->host = NULL;
+      ifdnfc->se = NULL;
+    }
+    pthread_mutex_unlock(&ifd_devices_lock);
+  }
+  ifdnfc_cancel_destroy(ifdnfc);
+
+  // libnfc stays initialized until the driver is unloaded, see ifdnfc_fini()
+  pthread_mutex_lock(&ifd_devices_lock);
+  ifdnfc->Lun = -1;
+  pthread_mutex_unlock(&ifd_devices_lock);
+  return IFD_SUCCESS;
+}
+
+/*
+ * How long the threads of pcscd wait for a request of the worker. The
+ * profile itself is only for the worker, which changes it at runtime.
+ */
+static unsigned int ifdnfc_request_timeout(struct ifd_device *ifdnfc)
+{
+  unsigned int timeout;
+
+  pthread_mutex_lock(&ifdnfc->rf_lock);
+  timeout = ifdnfc->request_timeout;
+  pthread_mutex_unlock(&ifdnfc->rf_lock);
+
+  return timeout;
+}
+
+/*
+ * Presence check of the worker. With peek, a reset card that is still to be
+ * reported absent stays so for the next check.
+ */
+static RESPONSECODE icc_presence(struct ifd_device *ifdnfc, bool peek)
+{
+  RESPONSECODE rv = ifdnfc_call(ifdnfc, IFDNFC_REQUEST_PRESENCE, peek, NULL, 0,
+                                NULL, NULL, NULL, ifdnfc_request_timeout(ifdnfc));
+  if (rv == IFD_RESPONSE_TIMEOUT)
+    // The device is busy, report what we knew last
+    return ifdnfc_present(ifdnfc) ? IFD_SUCCESS : IFD_ICC_NOT_PRESENT;
+
+  return rv;
+}
+
+/*
+ * Wait between two presence checks of a thread waiting for a card event, at
+ * the polling rate of the device, but not shorter than
+ * IFDNFC_POLL_WAIT_MIN_MS. With events, a queued card event ends the wait.
+ * Returns false when the reader goes away or the deadline is reached.
+ */
+#define IFDNFC_POLL_WAIT_MIN_MS 50
+
+static bool ifdnfc_poll_wait(struct ifd_device *ifdnfc, uint64_t deadline, bool events)
+{
+  pthread_mutex_lock(&ifdnfc->rf_lock);
+  unsigned int wait = ifdnfc->poll_interval_min;
+  pthread_mutex_unlock(&ifdnfc->rf_lock);
+  if (wait < IFDNFC_POLL_WAIT_MIN_MS)
+    wait = IFDNFC_POLL_WAIT_MIN_MS;
+  uint64_t wakeup = ifdnfc_now_ms() + wait;
+  if (wakeup > deadline)
+    wakeup = deadline;
+  struct timespec ts = { wakeup / 1000, (wakeup % 1000) * 1000000 };
+
+  pthread_mutex_lock(&ifdnfc->rf_lock);
+  while (!ifdnfc->poll_stop && !(events && ifdnfc->events_len)
+         && pthread_cond_timedwait(&ifdnfc->rf_event, &ifdnfc->rf_lock, &ts) != ETIMEDOUT)
+    ;
+  bool stop = ifdnfc->poll_stop;
+  pthread_mutex_unlock(&ifdnfc->rf_lock);
+
+  return !stop && wakeup < deadline;
+}
+
+#if defined(HAVE_DECL_TAG_IFD_POLLING_THREAD_WITH_TIMEOUT) && HAVE_DECL_TAG_IFD_POLLING_THREAD_WITH_TIMEOUT
+/*
+ * Polling thread of pcscd: wait up to timeout ms for the card to be inserted
+ * or removed, checking its presence at the polling rate of the device.
+ */
+static RESPONSECODE ifdnfc_poll_card_event(DWORD Lun, int timeout)
+{
+  int device_index = lun2device_index(Lun);
+  if (device_index < 0)
+    return IFD_COMMUNICATION_ERROR;
+  struct ifd_device *ifdnfc = &ifd_devices[device_index];
+  uint64_t deadline = ifdnfc_now_ms() + (timeout > 0 ? timeout : 0);
+  pthread_mutex_lock(&ifdnfc->rf_lock);
+  bool present = ifdnfc->reported;
+  pthread_mutex_unlock(&ifdnfc->rf_lock);
+
+  for (;;) {
+    // The reset of a card is left to IFDHICCPresence() to report
+    if ((icc_presence(ifdnfc, true) == IFD_SUCCESS) != present)
+      return IFD_SUCCESS;
+    if (!ifdnfc_poll_wait(ifdnfc, deadline, false))
+      return IFD_SUCCESS;
+  }
+}
+#endif
+
+#if defined(HAVE_DECL_TAG_IFD_STOP_POLLING_THREAD) && HAVE_DECL_TAG_IFD_STOP_POLLING_THREAD
+/*
+ * Called by pcscd when the reader goes away to get the polling thread out of
+ * its wait and out of the command it may be blocked in. pcscd serializes all
+ * other IFDH calls of a reader with the transmission of APDUs, so this is
+ * the only one that can reach a command while it is running.
+ */
+static RESPONSECODE ifdnfc_stop_polling(DWORD Lun)
+{
+  int device_index = lun2device_index(Lun);
+  if (device_index < 0)
+    return IFD_COMMUNICATION_ERROR;
+  struct ifd_device *ifdnfc = &ifd_devices[device_index];
+
+  pthread_mutex_lock(&ifdnfc->rf_lock);
+  ifdnfc->poll_stop = true;
+  pthread_cond_broadcast(&ifdnfc->rf_event);
+  pthread_mutex_unlock(&ifdnfc->rf_lock);
+  ifdnfc_abort(ifdnfc);
+
+  return IFD_SUCCESS;
+}
+#endif
+
+RESPONSECODE
+// cppcheck-suppress unusedFunction
+IFDHGetCapabilities(DWORD Lun, DWORD Tag, PDWORD Length, PUCHAR Value)
+{
+  Log4(PCSC_LOG_DEBUG, "IFDHGetCapabilities(DWORD Lun (%08lx), DWORD Tag (%08lx), PDWORD Length (%lu), PUCHAR Value)", Lun, Tag, *Length);
+  (void) Lun;
+  int device_index = lun2device_index(Lun);
+  if (device_index < 0)
+    return IFD_COMMUNICATION_ERROR;
+  struct ifd_device *ifdnfc = &ifd_devices[device_index];
+  if (!Length || !Value)
+    return IFD_COMMUNICATION_ERROR;
 
-  // USB DeviceNames can be immediately handled, e.g.:
-  // usb:1fd3/0608:libudev:0:/dev/bus/usb/002/079
-  // => connstring usb:002:079
-  int n = strlen(DeviceName) + 1;
-  char *vidpid      = malloc(n);
-  char *hpdriver    = malloc(n);
-  char *ifn         = malloc(n);
-  char *devpath     = malloc(n);
-  char *dirname     = malloc(n);
-  char *filename    = malloc(n);
+  switch (Tag) {
+    case TAG_IFD_ATR:
+#ifdef SCARD_ATTR_ATR_STRING
+    case SCARD_ATTR_ATR_STRING:
+#endif
+      // The worker changes the slot while a card comes and goes
+      return ifdnfc_call(ifdnfc, IFDNFC_REQUEST_GET_ATTRIBUTE, Tag, NULL, 0,
+                         Value, Length, NULL, IFDNFC_CONTROL_TIMEOUT_MS);
 
-  int res = sscanf(DeviceName, "usb:%4[^:]:%4[^:]:%32[^:]:%32[^:]", vidpid, hpdriver, ifn, devpath);
-  if (res == 4) {
-    res = sscanf(devpath, "/dev/bus/usb/%3[^/]/%3[^/]", dirname, filename);
-    if (res == 2) {
-      strcpy(ifd_connstring, "usb:xxx:xxx");
-      memcpy(ifd_connstring + 4, dirname, 3);
-      memcpy(ifd_connstring + 8, filename, 3);
-      ifdnfc->device = nfc_open(context, ifd_connstring);
-      ifdnfc->connected = (ifdnfc->device) ? true : false;
-      ifdnfc->Lun = Lun;
+    case TAG_IFD_SIMULTANEOUS_ACCESS:
+      if (*Length >= 1) {
+        *Length = 1;
+        *Value = ifdnfc_max_devices();
+      } else
+        return IFD_ERROR_INSUFFICIENT_BUFFER;
+      break;
+    case TAG_IFD_THREAD_SAFE:
+      // each device serializes its I/O in its own worker thread
+      if (*Length < 1)
+        return IFD_COMMUNICATION_ERROR;
+      *Value  = 1;
+      *Length = 1;
+      break;
+    case IFDNFC_ATTR_POLLS:
+    case IFDNFC_ATTR_POLL_RF_COMMANDS:
+    case IFDNFC_ATTR_LAST_POLL_RF_COMMANDS: {
+      uint32_t value;
+      if (*Length < sizeof value)
+        return IFD_ERROR_INSUFFICIENT_BUFFER;
+      pthread_mutex_lock(&ifdnfc->rf_lock);
+      if (Tag == IFDNFC_ATTR_POLLS)
+        value = ifdnfc->polls;
+      else if (Tag == IFDNFC_ATTR_POLL_RF_COMMANDS)
+        value = ifdnfc->poll_rf_commands;
+      else
+        value = ifdnfc->last_poll_rf_commands;
+      pthread_mutex_unlock(&ifdnfc->rf_lock);
+      memcpy(Value, &value, sizeof value);
+      *Length = sizeof value;
+    }
+    break;
+    case IFDNFC_ATTR_RESTARTS: {
+      struct ifd_device *owner = ifdnfc->host ? ifdnfc->host : ifdnfc;
+      uint32_t value;
+      if (*Length < sizeof value)
+        return IFD_ERROR_INSUFFICIENT_BUFFER;
+      pthread_mutex_lock(&owner->rf_lock);
+      value = owner->restarts;
+      pthread_mutex_unlock(&owner->rf_lock);
+      memcpy(Value, &value, sizeof value);
+      *Length = sizeof value;
+    }
+    break;
+    case IFDNFC_ATTR_LINK_RTT: {
+      uint32_t value;
+      if (*Length < sizeof value)
+        return IFD_ERROR_INSUFFICIENT_BUFFER;
+      pthread_mutex_lock(&ifdnfc->rf_lock);
+      value = ifdnfc->link_rtt;
+      pthread_mutex_unlock(&ifdnfc->rf_lock);
+      memcpy(Value, &value, sizeof value);
+      *Length = sizeof value;
     }
+    break;
+    case IFDNFC_ATTR_TRANSCEIVE_TIMEOUT:
+    case IFDNFC_ATTR_PRESENCE_INTERVAL:
+    case IFDNFC_ATTR_INFINITE_SELECT:
+    case IFDNFC_ATTR_MODULATIONS:
+    case IFDNFC_ATTR_ISO_DEP_BLOCKS:
+    case IFDNFC_ATTR_ISO_DEP_CHAINED:
+    case IFDNFC_ATTR_ISO_DEP_WTX:
+    case IFDNFC_ATTR_ISO_DEP_RETRANSMISSIONS:
+    case IFDNFC_ATTR_ISO_DEP_ERRORS:
+    case IFDNFC_ATTR_CARD_ENTERED:
+      return ifdnfc_call(ifdnfc, IFDNFC_REQUEST_GET_ATTRIBUTE, Tag, NULL, 0,
+                         Value, Length, NULL, IFDNFC_CONTROL_TIMEOUT_MS);
+    case TAG_IFD_SLOTS_NUMBER:
+      if (*Length < 1)
+        return IFD_COMMUNICATION_ERROR;
+      pthread_mutex_lock(&ifdnfc->rf_lock);
+      *Value  = ifdnfc->slots;
+      pthread_mutex_unlock(&ifdnfc->rf_lock);
+      *Length = 1;
+      break;
+    case TAG_IFD_SLOT_THREAD_SAFE:
+      // both slots go through the worker of slot 0
+      if (*Length < 1)
+        return IFD_COMMUNICATION_ERROR;
+      *Value  = 1;
+      *Length = 1;
+      break;
+#if defined(HAVE_DECL_TAG_IFD_POLLING_THREAD_WITH_TIMEOUT) && HAVE_DECL_TAG_IFD_POLLING_THREAD_WITH_TIMEOUT
+    case TAG_IFD_POLLING_THREAD_WITH_TIMEOUT:
+      if (*Length < sizeof(void *))
+        return IFD_ERROR_INSUFFICIENT_BUFFER;
+      *(RESPONSECODE (**)(DWORD, int)) Value = ifdnfc_poll_card_event;
+      *Length = sizeof(void *);
+      break;
+#endif
+#if defined(HAVE_DECL_TAG_IFD_STOP_POLLING_THREAD) && HAVE_DECL_TAG_IFD_STOP_POLLING_THREAD
+    case TAG_IFD_STOP_POLLING_THREAD:
+      if (*Length < sizeof(void *))
+        return IFD_ERROR_INSUFFICIENT_BUFFER;
+      *(RESPONSECODE (**)(DWORD)) Value = ifdnfc_stop_polling;
+      *Length = sizeof(void *);
+      break;
+#endif
+    case TAG_IFD_POLLING_THREAD_KILLABLE:
+      // Cancelling the thread would leave the worker of the device waiting
+      return IFD_ERROR_NOT_SUPPORTED;
+    default:
+      Log3(PCSC_LOG_ERROR, "Tag %08lx (%lu) not supported", (unsigned long) Tag, (unsigned long) Tag);
+      return IFD_ERROR_TAG;
   }
-  free(vidpid);
-  free(hpdriver);
-  free(ifn);
-  free(devpath);
-  free(dirname);
-  free(filename);
 
-  if (!ifdnfc->connected)
-    Log2(PCSC_LOG_DEBUG, "\"DEVICENAME    %s\" is not used.", DeviceName);
-  else
-    Log2(PCSC_LOG_DEBUG, "\"DEVICENAME    %s\" is used by libnfc.", DeviceName);
-  Log1(PCSC_LOG_INFO, "IFD-handler for NFC devices is ready.");
   return IFD_SUCCESS;
 }
 
 RESPONSECODE
 // cppcheck-suppress unusedFunction
-IFDHCreateChannel(DWORD Lun, DWORD Channel)
+IFDHSetCapabilities(DWORD Lun, DWORD Tag, DWORD Length, PUCHAR Value)
 {
-  char str[16];
-  snprintf(str, sizeof str, "/dev/pcsc/%lu", (unsigned long) Channel);
+  Log4(PCSC_LOG_DEBUG, "IFDHSetCapabilities(DWORD Lun (%08lx), DWORD Tag (%08lx), DWORD Length (%lu), PUCHAR Value)", Lun, Tag, Length);
+  int device_index = lun2device_index(Lun);
+  if (device_index < 0)
+    return IFD_COMMUNICATION_ERROR;
+  struct ifd_device *ifdnfc = &ifd_devices[device_index];
+  if (!tuning_tag(Tag))
+    return IFD_ERROR_VALUE_READ_ONLY;
+  if (!Value && Length)
+    return IFD_COMMUNICATION_ERROR;
 
-  return IFDHCreateChannelByName(Lun, str);
+  return ifdnfc_call(ifdnfc, IFDNFC_REQUEST_SET_ATTRIBUTE, Tag, Value, Length,
+                     NULL, NULL, NULL, IFDNFC_CONTROL_TIMEOUT_MS);
 }
 
 RESPONSECODE
 // cppcheck-suppress unusedFunction
-IFDHCloseChannel(DWORD Lun)
+IFDHSetProtocolParameters(DWORD Lun, DWORD Protocol, UCHAR Flags, UCHAR PTS1,
+                          UCHAR PTS2, UCHAR PTS3)
 {
   (void) Lun;
-  int device_index = lun2device_index(Lun);
-  if (device_index < 0)
-    return IFD_COMMUNICATION_ERROR;
-  struct ifd_device *ifdnfc = &ifd_devices[device_index];
-  ifdnfc_disconnect(ifdnfc);
+  (void) Flags;
+  (void) PTS1;
+  (void) PTS2;
+  (void) PTS3;
+  if (Protocol != SCARD_PROTOCOL_T1)
+    return IFD_PROTOCOL_NOT_SUPPORTED;
 
-  // Check if there are still devices used
-  int i;
-  for (i = 0; i < IFDNFC_MAX_DEVICES; i++)
-    if (ifd_devices[i].Lun != -1)
-      // yes so don't exit libnfc
+  return IFD_SUCCESS;
+}
+
+static RESPONSECODE power_icc(struct ifd_device *ifdnfc, DWORD Action,
+                              PUCHAR Atr, PDWORD AtrLength)
+{
+  switch (Action) {
+    case IFD_POWER_DOWN:
+      // IFD_POWER_DOWN: Power down the card (Atr and AtrLength should be zeroed)
+      // Switching the field off right away leads to spurious RFoff/RFon
+      // during operation (LoGO + JCOP with Vonjeek applet + mrpkey.py), so
+      // the field is only switched off by IFDHICCPresence() once the
+      // hysteresis delay of the RF policy elapsed without a new power up.
+      // The card itself is halted, the next power up wakes it by its UID.
+      if (ifdnfc->slot.state == IFDNFC_SLOT_ACTIVE) {
+        if (slot_sleep(ifdnfc))
+          ifdnfc->next_poll = ifdnfc_now_ms() + ifdnfc->poll_interval_min;
+        else
+          ifdnfc_slot_set(ifdnfc, IFDNFC_SLOT_SELECTED);
+      }
+      ifdnfc->last_activity = ifdnfc_now_ms();
+      *AtrLength = 0;
+      return IFD_SUCCESS;
+      break;
+    case IFD_RESET:
+      // IFD_RESET: Perform a warm reset of the card (no power down). If the card is not powered then power up the card (store and return Atr and AtrLength)
+      ifdnfc->slot.memo_path_len = 0;
+      ifdnfc->slot.memo_path_sent = 0;
+      if (ifdnfc->slot.state == IFDNFC_SLOT_HALTED
+          || ifdnfc->slot.state == IFDNFC_SLOT_ASLEEP) {
+        // The card was halted, a new selection is as good as a reset
+        if (!slot_resume(ifdnfc)) {
+          *AtrLength = 0;
+          return IFD_ERROR_POWER_ACTION;
+        }
+      } else if (ifdnfc_slot_present(&ifdnfc->slot)) {
+        if (slot_deselect(ifdnfc) < 0) {
+          Log2(PCSC_LOG_ERROR, "Could not deselect NFC target (%s).", nfc_strerror(ifdnfc->device));
+          ifdnfc_slot_set(ifdnfc, IFDNFC_SLOT_REMOVED);
+          *AtrLength = 0;
+          return IFD_ERROR_POWER_ACTION;
+        }
+        if (!ifdnfc_reselect_target(ifdnfc, true)) {
+          ifdnfc_slot_set(ifdnfc, IFDNFC_SLOT_REMOVED);
+          *AtrLength = 0;
+          return IFD_ERROR_POWER_ACTION;
+        }
+        slot_selected(ifdnfc);
+        ifdnfc_slot_set(ifdnfc, IFDNFC_SLOT_ACTIVE);
+      } else
+        break;
+      // In contactless, ATR on warm reset is always same as on cold reset
+      if (*AtrLength < ifdnfc->slot.atr_len)
+        return IFD_COMMUNICATION_ERROR;
+      memcpy(Atr, ifdnfc->slot.atr, ifdnfc->slot.atr_len);
+      // memset(Atr + ifdnfc->slot.atr_len, 0, *AtrLength - ifd_slot.atr_len);
+      *AtrLength = ifdnfc->slot.atr_len;
       return IFD_SUCCESS;
-  // No more device, we can shutdown libnfc
-  nfc_exit(context);
-  context = NULL;
+    case IFD_POWER_UP:
+      // IFD_POWER_UP: Power up the card (store and return Atr and AtrLength)
+      ifdnfc->slot.memo_path_len = 0;
+      ifdnfc->slot.memo_path_sent = 0;
+      ifdnfc_rf_wake(ifdnfc, ifdnfc_now_ms());
+      if (((ifdnfc->secure_element_as_card) && (ifdnfc_se_is_available(ifdnfc)))
+          || (!ifdnfc->host && slot_power_up(ifdnfc))) {
+        ifdnfc_slot_set(ifdnfc, IFDNFC_SLOT_ACTIVE);
+        if (*AtrLength < ifdnfc->slot.atr_len)
+          return IFD_COMMUNICATION_ERROR;
+        memcpy(Atr, ifdnfc->slot.atr, ifdnfc->slot.atr_len);
+        // memset(Atr + ifdnfc->slot.atr_len, 0, *AtrLength - ifd_slot.atr_len);
+        *AtrLength = ifdnfc->slot.atr_len;
+      } else {
+        *AtrLength = 0;
+        return IFD_COMMUNICATION_ERROR;
+      }
+      break;
+    default:
+      Log2(PCSC_LOG_ERROR, "Action %lu not supported", (unsigned long) Action);
+      return IFD_NOT_SUPPORTED;
+  }
+
   return IFD_SUCCESS;
 }
 
+static RESPONSECODE ifdnfc_power_icc(struct ifd_device *ifdnfc, DWORD Action,
+                                     PUCHAR Atr, PDWORD AtrLength)
+{
+  if (!ifdnfc->connected)
+    return(IFD_COMMUNICATION_ERROR);
+  if (Action != IFD_POWER_DOWN) {
+    // A new session, pcscd knows about the reset
+    ifdnfc->slot.reset = false;
+    slot_claim_chip(ifdnfc, true);
+  }
+
+  if (Action == IFD_POWER_UP && !ifdnfc_slot_present(&ifdnfc->slot))
+    ifdnfc_trace_start(&ifdnfc->trace, ifdnfc - ifd_devices);
+  size_t span = ifdnfc_trace_begin(&ifdnfc->trace, "IFDHPowerICC");
+  RESPONSECODE rv = power_icc(ifdnfc, Action, Atr, AtrLength);
+  ifdnfc_trace_end(&ifdnfc->trace, span);
+
+  return rv;
+}
+
 RESPONSECODE
 // cppcheck-suppress unusedFunction
-IFDHGetCapabilities(DWORD Lun, DWORD Tag, PDWORD Length, PUCHAR Value)
+IFDHPowerICC(DWORD Lun, DWORD Action, PUCHAR Atr, PDWORD AtrLength)
 {
-  Log4(PCSC_LOG_DEBUG, "IFDHGetCapabilities(DWORD Lun (%08x), DWORD Tag (%08x), PDWORD Length (%lu), PUCHAR Value)", Lun, Tag, *Length);
   (void) Lun;
   int device_index = lun2device_index(Lun);
   if (device_index < 0)
     return IFD_COMMUNICATION_ERROR;
   struct ifd_device *ifdnfc = &ifd_devices[device_index];
-  if (!Length || !Value)
+  if (!Atr || !AtrLength)
     return IFD_COMMUNICATION_ERROR;
 
-  switch (Tag) {
-    case TAG_IFD_ATR:
-#ifdef SCARD_ATTR_ATR_STRING
-    case SCARD_ATTR_ATR_STRING:
-#endif
-      if (!ifdnfc->connected || !ifdnfc->slot.present)
-        return(IFD_COMMUNICATION_ERROR);
-      if (*Length < ifdnfc->slot.atr_len)
-        return IFD_COMMUNICATION_ERROR;
+  if (Action == IFD_POWER_DOWN)
+    // The card is released, whatever is still running on it is moot
+    ifdnfc_abort(ifdnfc);
+
+  return ifdnfc_call(ifdnfc, IFDNFC_REQUEST_POWER, Action, NULL, 0,
+                     Atr, AtrLength, NULL, ifdnfc_request_timeout(ifdnfc));
+}
+
+// UID-only mode: run the ISO14443-4 activation skipped at discovery
+static bool slot_activate_iso_dep(struct ifd_device *ifdnfc)
+{
+  nfc_target nt;
+
+  Log1(PCSC_LOG_DEBUG, "Activating ISO14443-4 on demand.");
+  if (!target_activate_iso_dep(ifdnfc, &ifdnfc->slot.target, &nt)) {
+    Log2(PCSC_LOG_ERROR, "Could not activate ISO14443-4 (%s).", nfc_strerror(ifdnfc->device));
+    mute_failed(ifdnfc, &ifdnfc->slot.target, ifdnfc_now_ms());
+    ifdnfc_slot_set(ifdnfc, IFDNFC_SLOT_REMOVED);
+    return false;
+  }
+  // pcscd keeps the storage ATR, GET DATA now also gets the ATS
+  ifdnfc->slot.target = nt;
+  ifdnfc->slot.iso_dep_pending = false;
+  slot_selected(ifdnfc);
+
+  return true;
+}
+
+static bool slot_is_t2t(const struct ifd_slot *slot)
+{
+  return slot->target.nm.nmt == NMT_ISO14443A && slot->target.nti.nai.btSak == 0x00;
+}
+
+// Type 2 tag commands such as GET_VERSION clash with the MIFARE commands of
+// the reader, so they are sent as raw frames
+static int slot_transceive_raw(void *ctx, const uint8_t *tx, size_t tx_len,
+                               uint8_t *rx, size_t rx_len)
+{
+  // A tag answers READ as fast as a presence check
+  return slot_transceive_frame(ctx, tx, tx_len, rx, rx_len, IFDNFC_PROBE_CARD_MS);
+}
+
+static bool slot_reselect(void *ctx)
+{
+  return ifdnfc_reselect_target(ctx, true);
+}
+
+// READ BINARY (PC/SC part 3) of a Type 2 tag: P1 P2 is the page, Le the length
+static RESPONSECODE t2t_read_binary(struct ifd_device *ifdnfc, PUCHAR TxBuffer,
+                                    DWORD TxLength, PUCHAR RxBuffer, PDWORD RxLength)
+{
+  size_t Le;
+  int res;
+
+  if (*RxLength < 2)
+    return IFD_COMMUNICATION_ERROR;
+  if (TxLength != 5) {
+    // Wrong length
+    RxBuffer[0] = 0x67;
+    RxBuffer[1] = 0x00;
+    *RxLength = 2;
+    return IFD_SUCCESS;
+  }
+  Le = TxBuffer[4] ? TxBuffer[4] : 256;
+  if (Le > *RxLength - 2)
+    Le = *RxLength - 2;
+
+  if (!slot_raw_begin(ifdnfc)) {
+    *RxLength = 0;
+    return IFD_COMMUNICATION_ERROR;
+  }
+  res = t2t_read(&ifdnfc->slot.t2t, (TxBuffer[2] << 8) | TxBuffer[3], RxBuffer, Le,
+                 slot_transceive_raw, slot_reselect, ifdnfc);
+  slot_raw_end(ifdnfc);
+  if (res < 0) {
+    *RxLength = 0;
+    return IFD_COMMUNICATION_ERROR;
+  }
+  ifdnfc->slot.last_seen = ifdnfc_now_ms();
+
+  if (res == 0) {
+    // Wrong parameters P1-P2
+    RxBuffer[0] = 0x6B;
+    RxBuffer[1] = 0x00;
+    *RxLength = 2;
+  } else {
+    // End of user memory reached before Le bytes
+    RxBuffer[res] = ((size_t) res < Le) ? 0x62 : 0x90;
+    RxBuffer[res + 1] = ((size_t) res < Le) ? 0x82 : 0x00;
+    *RxLength = res + 2;
+  }
+
+  return IFD_SUCCESS;
+}
+
+// Largest DESFire response frame, including the status word
+#define IFDNFC_DESFIRE_FRAME_MAX 64
+
+/*
+ * ISO wrapped DESFire commands whose 91 AF means that more response data is
+ * waiting. For the other commands, e.g. authentication or writes, the card
+ * expects the next frame from the application.
+ */
+static bool desfire_is_read(const PUCHAR TxBuffer, DWORD TxLength)
+{
+  if (TxLength < 5 || TxBuffer[0] != 0x90 || TxBuffer[2] != 0x00 || TxBuffer[3] != 0x00)
+    return false;
+
+  switch (TxBuffer[1]) {
+    case 0x60: // GetVersion
+    case 0x61: // GetISOFileIDs
+    case 0x6A: // GetApplicationIDs
+    case 0x6D: // GetDFNames
+    case 0x6F: // GetFileIDs
+    case 0xBB: // ReadRecords
+    case 0xBD: // ReadData
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Fetch the additional frames of a DESFire read and concatenate their data
+static int desfire_chain(struct ifd_device *ifdnfc, uint8_t *RxBuffer, size_t len,
+                         size_t RxLength)
+{
+  const uint8_t abtAdditionalFrame[] = { 0x90, 0xAF, 0x00, 0x00, 0x00 };
+  int res;
+
+  while (len >= 2 && RxBuffer[len - 2] == 0x91 && RxBuffer[len - 1] == 0xAF
+         && RxLength - (len - 2) >= IFDNFC_DESFIRE_FRAME_MAX) {
+    // The status word of the previous frame gets overwritten
+    len -= 2;
+    res = slot_transceive_apdu(ifdnfc, abtAdditionalFrame, sizeof abtAdditionalFrame,
+                              RxBuffer + len, RxLength - len,
+                              ifdnfc->profile.transceive_timeout);
+    if (res < 2)
+      return -1;
+    len += res;
+  }
+
+  return len;
+}
+
+// Errors after which the card is most likely still in the field
+static bool rf_error_is_transient(int res)
+{
+  return res == NFC_ETIMEOUT || res == NFC_ERFTRANS;
+}
+
+static bool apdu_is_repeatable(const struct ifdnfc_profile *profile,
+                               const PUCHAR TxBuffer, DWORD TxLength)
+{
+  size_t i;
+
+  if (TxLength < 4)
+    return false;
+  for (i = 0; i < profile->retry_ins_len; i++)
+    if (TxBuffer[1] == profile->retry_ins[i])
+      return true;
+
+  return false;
+}
+
+/*
+ * Recover from the transient RF error res of an APDU, within the time the
+ * caller still waits. The reader chip or the driver's ISO-DEP layer already
+ * resent the blocks, so a repeatable APDU is sent again as a whole. If the
+ * card still does not answer, it is reselected by its UID so that the slot
+ * stays usable. This starts a new session on the card, which is reported to
+ * pcscd: the APDU fails and the card is reported removed once.
+ */
+static int transmit_recover(struct ifd_device *ifdnfc, const PUCHAR TxBuffer,
+                            DWORD TxLength, PUCHAR RxBuffer, size_t RxLength, int res)
+{
+  bool repeatable = apdu_is_repeatable(&ifdnfc->profile, TxBuffer, TxLength);
+  unsigned int i, timeout;
+
+  if (!ifdnfc->profile.rf_retries || !rf_error_is_transient(res))
+    return res;
+
+  for (i = 0; repeatable && i < ifdnfc->profile.rf_retries && rf_error_is_transient(res); i++) {
+    timeout = request_time_left(ifdnfc);
+    if (timeout < IFDNFC_RECOVER_MIN_MS)
+      return res;
+    if (timeout > ifdnfc->profile.transceive_timeout)
+      timeout = ifdnfc->profile.transceive_timeout;
+    Log2(PCSC_LOG_INFO, "Sending APDU again (%s).", nfc_strerror(ifdnfc->device));
+    res = slot_transceive_apdu(ifdnfc, TxBuffer, TxLength, RxBuffer, RxLength, timeout);
+  }
+  if (!rf_error_is_transient(res) || request_time_left(ifdnfc) < IFDNFC_RECOVER_MIN_MS)
+    return res;
+
+  size_t span = ifdnfc_trace_begin(&ifdnfc->trace, "transmit_recover");
+  Log2(PCSC_LOG_INFO, "Reselecting card after RF error (%s).", nfc_strerror(ifdnfc->device));
+  if (slot_deselect(ifdnfc) < 0)
+    Log2(PCSC_LOG_DEBUG, "Could not deselect target (%s).", nfc_strerror(ifdnfc->device));
+  if (!ifdnfc_reselect_target(ifdnfc, true)) {
+    Log1(PCSC_LOG_INFO, "Card is gone.");
+    ifdnfc_slot_set(ifdnfc, IFDNFC_SLOT_REMOVED);
+  } else {
+    ifdnfc_slot_set(ifdnfc, IFDNFC_SLOT_SELECTED);
+    slot_selected(ifdnfc);
+    slot_report_reset(ifdnfc);
+  }
+  ifdnfc_trace_end(&ifdnfc->trace, span);
 
-      memcpy(Value, ifdnfc->slot.atr, ifdnfc->slot.atr_len);
-      *Length = ifdnfc->slot.atr_len;
-      break;
+  return res;
+}
 
-    case TAG_IFD_SIMULTANEOUS_ACCESS:
-      if (*Length >= 1) {
-        *Length = 1;
-        *Value = 10;
-      } else
-        return IFD_ERROR_INSUFFICIENT_BUFFER;
+/*
+ * Response cache (response_cache of the profile). A response is found by the
+ * card, the SELECTs it got since the last absolute one and the APDU, so that
+ * the READ BINARYs of different files are told apart. SELECTs answered from
+ * the cache reach the card only before the next APDU that is not. Once an
+ * APDU outside of cache_apdus was sent, e.g. a VERIFY, responses may depend
+ * on the security state of the card: the cache is left alone until the card
+ * is selected again.
+ */
+#define IFDNFC_MEMO_MAX_CARD (3 + 10 + MAX_ATR_SIZE)
+#define IFDNFC_MEMO_MAX_APDU 255
+#define IFDNFC_MEMO_MAX_KEY  (IFDNFC_MEMO_MAX_CARD + 2 + IFDNFC_MEMO_MAX_PATH + IFDNFC_MEMO_MAX_APDU)
+
+// Card the responses belong to, 0 if it is not recognized on the next tap
+static size_t memo_card(const struct ifd_slot *slot, uint8_t *id)
+{
+  const uint8_t *uid;
+  size_t uid_len, hb_len, len = 0;
+
+  switch (slot->target.nm.nmt) {
+    case NMT_ISO14443A:
+      uid = slot->target.nti.nai.abtUid;
+      uid_len = slot->target.nti.nai.szUidLen;
+      // Random single size UIDs start with 08
+      if (!uid_len || (uid_len == 4 && uid[0] == 0x08))
+        return 0;
       break;
-    case TAG_IFD_THREAD_SAFE:
-      if (*Length < 1)
-        return IFD_COMMUNICATION_ERROR;
-      *Value  = 0;
-      *Length = 1;
+    case NMT_ISO14443B:
+      uid = slot->target.nti.nbi.abtPupi;
+      uid_len = sizeof slot->target.nti.nbi.abtPupi;
       break;
-    case TAG_IFD_SLOTS_NUMBER:
-      if (*Length < 1)
-        return IFD_COMMUNICATION_ERROR;
-      *Value  = 1;
-      *Length = 1;
+    case NMT_FELICA:
+      uid = slot->target.nti.nfi.abtId;
+      uid_len = sizeof slot->target.nti.nfi.abtId;
       break;
-#if defined(HAVE_DECL_TAG_IFD_STOP_POLLING_THREAD) && HAVE_DECL_TAG_IFD_POLLING_THREAD
-    case TAG_IFD_STOP_POLLING_THREAD:
-#endif
-#if defined(HAVE_DECL_TAG_IFD_POLLING_THREAD_WITH_TIMEOUT) && HAVE_DECL_TAG_IFD_POLLING_THREAD_WITH_TIMEOUT
-	case TAG_IFD_POLLING_THREAD_WITH_TIMEOUT:
-#endif
-	case TAG_IFD_POLLING_THREAD_KILLABLE:
-	  return IFD_ERROR_NOT_SUPPORTED;
     default:
-      Log3(PCSC_LOG_ERROR, "Tag %08x (%lu) not supported", Tag, (unsigned long) Tag);
-      return IFD_ERROR_TAG;
+      return 0;
   }
+  // Historical bytes of the ATR from target_to_atr(): 3B 8n 80 01 ... TCK
+  hb_len = slot->atr_len > 5 ? slot->atr_len - 5 : 0;
 
-  return IFD_SUCCESS;
+  id[len++] = slot->target.nm.nmt;
+  id[len++] = uid_len;
+  memcpy(id + len, uid, uid_len);
+  len += uid_len;
+  id[len++] = hb_len;
+  memcpy(id + len, slot->atr + 4, hb_len);
+  len += hb_len;
+
+  return len;
 }
 
-RESPONSECODE
-// cppcheck-suppress unusedFunction
-IFDHSetCapabilities(DWORD Lun, DWORD Tag, DWORD Length, PUCHAR Value)
+// APDUs that change the content of the card, ISO7816-4 and DESFire
+static bool apdu_is_write(const PUCHAR TxBuffer, DWORD TxLength)
 {
-  (void) Lun;
-  (void) Tag;
-  (void) Length;
-  (void) Value;
-  return IFD_ERROR_VALUE_READ_ONLY;
+  static const uint8_t iso_ins[] = {
+    0x04, 0x0E, 0x0F, 0x24, 0x2C, 0x44, 0xD0, 0xD1, 0xD2, 0xD6, 0xD7,
+    0xDA, 0xDB, 0xDC, 0xDD, 0xE0, 0xE2, 0xE4, 0xE6, 0xE8, 0xFE,
+  };
+  static const uint8_t desfire_ins[] = {
+    0x0C, 0x1C, 0x3B, 0x3D, 0xC7, 0xDA, 0xDC, 0xDF, 0xFC,
+  };
+  size_t i;
+
+  if (TxLength < 4)
+    return false;
+  for (i = 0; i < sizeof iso_ins; i++)
+    if (TxBuffer[1] == iso_ins[i])
+      return true;
+  for (i = 0; TxBuffer[0] == 0x90 && i < sizeof desfire_ins; i++)
+    if (TxBuffer[1] == desfire_ins[i])
+      return true;
+
+  return false;
 }
 
-RESPONSECODE
-// cppcheck-suppress unusedFunction
-IFDHSetProtocolParameters(DWORD Lun, DWORD Protocol, UCHAR Flags, UCHAR PTS1,
-                          UCHAR PTS2, UCHAR PTS3)
+static bool apdu_is_cacheable(const struct ifdnfc_profile *profile,
+                              const PUCHAR TxBuffer, DWORD TxLength)
 {
-  (void) Lun;
-  (void) Flags;
-  (void) PTS1;
-  (void) PTS2;
-  (void) PTS3;
-  if (Protocol != SCARD_PROTOCOL_T1)
-    return IFD_PROTOCOL_NOT_SUPPORTED;
+  size_t i;
 
-  return IFD_SUCCESS;
+  // Basic channel without secure messaging or chaining, short APDU
+  if (TxLength < 4 || TxLength > IFDNFC_MEMO_MAX_APDU || TxBuffer[0] != 0x00
+      || (TxLength > 5 && TxBuffer[4] == 0x00))
+    return false;
+  for (i = 0; i < profile->cache_ins_len; i++)
+    if (TxBuffer[1] == profile->cache_ins[i])
+      return true;
+
+  return false;
 }
 
-RESPONSECODE
-// cppcheck-suppress unusedFunction
-IFDHPowerICC(DWORD Lun, DWORD Action, PUCHAR Atr, PDWORD AtrLength)
+// SELECT by DF name, by path from the MF or of the MF itself
+static bool apdu_is_absolute_select(const PUCHAR TxBuffer, DWORD TxLength)
 {
-  (void) Lun;
-  int device_index = lun2device_index(Lun);
-  if (device_index < 0)
-    return IFD_COMMUNICATION_ERROR;
-  struct ifd_device *ifdnfc = &ifd_devices[device_index];
-  if (!Atr || !AtrLength)
-    return IFD_COMMUNICATION_ERROR;
+  if (TxBuffer[1] != 0xA4)
+    return false;
+  if (TxBuffer[2] == 0x04 || TxBuffer[2] == 0x08)
+    return true;
+  return TxBuffer[2] == 0x00
+         && (TxLength <= 5
+             || (TxLength >= 7 && TxBuffer[4] == 2 && TxBuffer[5] == 0x3F && TxBuffer[6] == 0x00));
+}
 
-  if (!ifdnfc->connected)
-    return(IFD_COMMUNICATION_ERROR);
+static bool rapdu_is_ok(const PUCHAR RxBuffer, size_t RxLength)
+{
+  return RxLength >= 2 && RxBuffer[RxLength - 2] == 0x90 && RxBuffer[RxLength - 1] == 0x00;
+}
 
-  switch (Action) {
-    case IFD_POWER_DOWN:
-      // IFD_POWER_DOWN: Power down the card (Atr and AtrLength should be zeroed)
-// Warning, this means putting card to HALT, not reader to IDLE or RFoff
-// FixMe: Disabling entirely power-down for now because of spurious RFoff/RFon during operation
-// Test case: LoGO + JCOP with Vonjeek applet + mrpkey.py (RFIDIOt)
-/*
-      if (nfc_idle(ifdnfc->device) < 0) {
-        Log2(PCSC_LOG_ERROR, "Could not idle NFC device (%s).", nfc_strerror(ifdnfc->device));
-        return IFD_ERROR_POWER_ACTION;
-      }
-*/
-      *AtrLength = 0;
-      return IFD_SUCCESS;
-      break;
-    case IFD_RESET:
-      // IFD_RESET: Perform a warm reset of the card (no power down). If the card is not powered then power up the card (store and return Atr and AtrLength)
-      if (ifdnfc->slot.present) {
-        ifdnfc->slot.present = false;
-        if (nfc_initiator_deselect_target(ifdnfc->device) < 0) {
-          Log2(PCSC_LOG_ERROR, "Could not deselect NFC target (%s).", nfc_strerror(ifdnfc->device));
-          *AtrLength = 0;
-          return IFD_ERROR_POWER_ACTION;
-        }
-        if (!ifdnfc_reselect_target(ifdnfc, true)) {
-          *AtrLength = 0;
-          return IFD_ERROR_POWER_ACTION;
-        }
-        // In contactless, ATR on warm reset is always same as on cold reset
-        if (*AtrLength < ifdnfc->slot.atr_len)
-          return IFD_COMMUNICATION_ERROR;
-        memcpy(Atr, ifdnfc->slot.atr, ifdnfc->slot.atr_len);
-        // memset(Atr + ifdnfc->slot.atr_len, 0, *AtrLength - ifd_slot.atr_len);
-        *AtrLength = ifdnfc->slot.atr_len;
-        return IFD_SUCCESS;
-      }
-      break;
-    case IFD_POWER_UP:
-      // IFD_POWER_UP: Power up the card (store and return Atr and AtrLength)
-      if (((ifdnfc->secure_element_as_card) && (ifdnfc_se_is_available(ifdnfc))) || ifdnfc_target_is_available(ifdnfc)) {
-        if (*AtrLength < ifdnfc->slot.atr_len)
-          return IFD_COMMUNICATION_ERROR;
-        memcpy(Atr, ifdnfc->slot.atr, ifdnfc->slot.atr_len);
-        // memset(Atr + ifdnfc->slot.atr_len, 0, *AtrLength - ifd_slot.atr_len);
-        *AtrLength = ifdnfc->slot.atr_len;
-      } else {
-        *AtrLength = 0;
-        return IFD_COMMUNICATION_ERROR;
-      }
-      break;
-    default:
-      Log2(PCSC_LOG_ERROR, "Action %lu not supported", (unsigned long) Action);
-      return IFD_NOT_SUPPORTED;
+// Record a successful SELECT, false if there is no room left
+static bool memo_path_select(struct ifd_slot *slot, const PUCHAR TxBuffer,
+                             DWORD TxLength, bool sent)
+{
+  if (apdu_is_absolute_select(TxBuffer, TxLength)) {
+    slot->memo_path_len = 0;
+    slot->memo_path_sent = 0;
+  } else if (!slot->memo_path_len) {
+    // Relative to a selection the cache does not know
+    return true;
   }
+  if (slot->memo_path_len + 1 + TxLength > sizeof slot->memo_path)
+    return false;
 
-  return IFD_SUCCESS;
+  slot->memo_path[slot->memo_path_len++] = TxLength;
+  memcpy(slot->memo_path + slot->memo_path_len, TxBuffer, TxLength);
+  slot->memo_path_len += TxLength;
+  if (sent)
+    slot->memo_path_sent = slot->memo_path_len;
+
+  return true;
 }
 
-RESPONSECODE
-// cppcheck-suppress unusedFunction
-IFDHTransmitToICC(DWORD Lun, SCARD_IO_HEADER SendPci, PUCHAR TxBuffer, DWORD
-                  TxLength, PUCHAR RxBuffer, PDWORD RxLength, PSCARD_IO_HEADER RecvPci)
+// Key of the response to the APDU, 0 if it is not cached
+static size_t memo_key(struct ifd_device *ifdnfc, const PUCHAR TxBuffer,
+                       DWORD TxLength, uint8_t *key)
 {
-  (void) Lun;
-  int device_index = lun2device_index(Lun);
-  if (device_index < 0)
-    return IFD_COMMUNICATION_ERROR;
-  struct ifd_device *ifdnfc = &ifd_devices[device_index];
-  (void) SendPci;
-  if (!RxLength || !RecvPci)
-    return IFD_COMMUNICATION_ERROR;
+  struct ifd_slot *slot = &ifdnfc->slot;
+  size_t len, path_len;
 
-  if (!ifdnfc->connected || !ifdnfc->slot.present) {
-    *RxLength = 0;
-    return IFD_ICC_NOT_PRESENT;
+  if (apdu_is_write(TxBuffer, TxLength)) {
+    len = memo_card(slot, key);
+    if (len)
+      ifdnfc_memo_forget(&ifdnfc->memo, key, len);
+    slot->memo_off = true;
+    return 0;
+  }
+  if (slot->memo_off)
+    return 0;
+  if (!apdu_is_cacheable(&ifdnfc->profile, TxBuffer, TxLength)) {
+    slot->memo_off = true;
+    return 0;
+  }
+  len = memo_card(slot, key);
+  if (!len)
+    return 0;
+
+  if (apdu_is_absolute_select(TxBuffer, TxLength))
+    path_len = 0;
+  else if (slot->memo_path_len)
+    path_len = slot->memo_path_len;
+  else
+    // Depends on a selection the cache does not know
+    return 0;
+
+  key[len++] = path_len >> 8;
+  key[len++] = path_len;
+  memcpy(key + len, slot->memo_path, path_len);
+  len += path_len;
+  memcpy(key + len, TxBuffer, TxLength);
+  len += TxLength;
+
+  return len;
+}
+
+// Send the SELECTs answered from the cache, so that the card catches up
+static bool memo_sync(struct ifd_device *ifdnfc)
+{
+  struct ifd_slot *slot = &ifdnfc->slot;
+  uint8_t resp[256 + 2];
+  size_t len;
+  int res;
+
+  while (slot->memo_path_sent < slot->memo_path_len) {
+    len = slot->memo_path[slot->memo_path_sent];
+    LogXxd(PCSC_LOG_INFO, "Sending cached SELECT to NFC target\n",
+           slot->memo_path + slot->memo_path_sent + 1, len);
+    res = slot_transceive_apdu(ifdnfc, slot->memo_path + slot->memo_path_sent + 1, len,
+                              resp, sizeof resp, ifdnfc->profile.transceive_timeout);
+    if (res < 0 || !rapdu_is_ok(resp, res)) {
+      Log1(PCSC_LOG_ERROR, "Card does not accept a SELECT answered from the cache.");
+      slot->memo_path_len = 0;
+      slot->memo_path_sent = 0;
+      slot->memo_off = true;
+      return false;
+    }
+    slot->memo_path_sent += 1 + len;
   }
 
+  return true;
+}
+
+static RESPONSECODE transmit(struct ifd_device *ifdnfc, PUCHAR TxBuffer,
+                             DWORD TxLength, PUCHAR RxBuffer, PDWORD RxLength,
+                             PSCARD_IO_HEADER RecvPci)
+{
+  uint8_t key[IFDNFC_MEMO_MAX_KEY];
+  size_t key_len = 0, memo_len;
+
   if ((TxBuffer[0] == 0xFF) && (TxBuffer[1] == 0xCA)) {
     // Get Data
     LogXxd(PCSC_LOG_INFO, "Intercepting GetData\n", TxBuffer, TxLength);
@@ -677,21 +3809,7 @@ IFDHTransmitToICC(DWORD Lun, SCARD_IO_HEADER SendPci, PUCHAR TxBuffer, DWORD
       case 0x01: // Get ATS hist bytes
 
         if (ifdnfc->slot.target.nm.nmt == NMT_ISO14443A) {
-          Data = ifdnfc->slot.target.nti.nai.abtAts;
-          DataLength = ifdnfc->slot.target.nti.nai.szAtsLen;
-          if (DataLength) {
-            size_t idx = 1;
-            /* Bits 5 to 7 tell if TA1/TB1/TC1 are available */
-            if (Data[0] & 0x10) idx++; // TA
-            if (Data[0] & 0x20) idx++; // TB
-            if (Data[0] & 0x40) idx++; // TC
-            if (DataLength > idx) {
-              DataLength -= idx;
-              Data += idx;
-            } else {
-              DataLength = 0;
-            }
-          }
+          Data = (uint8_t *) ats_historical_bytes(&ifdnfc->slot.target.nti.nai, &DataLength);
           break;
         } // else:
       default:
@@ -723,61 +3841,268 @@ IFDHTransmitToICC(DWORD Lun, SCARD_IO_HEADER SendPci, PUCHAR TxBuffer, DWORD
     *RxLength = RxOff;
     return IFD_SUCCESS;
   }
+  if (TxLength >= 2 && TxBuffer[0] == 0xFF && TxBuffer[1] == 0xB0
+      && slot_is_t2t(&ifdnfc->slot)) {
+    RecvPci->Protocol = 1;
+    LogXxd(PCSC_LOG_INFO, "Intercepting ReadBinary\n", TxBuffer, TxLength);
+    return t2t_read_binary(ifdnfc, TxBuffer, TxLength, RxBuffer, RxLength);
+  }
+
+  if (slot_is_t2t(&ifdnfc->slot))
+    // The native command may write to the tag
+    t2t_invalidate(&ifdnfc->slot.t2t);
+
+  if (ifdnfc->memo.capacity) {
+    key_len = memo_key(ifdnfc, TxBuffer, TxLength, key);
+    memo_len = *RxLength;
+    if (key_len && ifdnfc_memo_lookup(&ifdnfc->memo, key, key_len, RxBuffer, &memo_len)
+        && (TxBuffer[1] != 0xA4 || memo_path_select(&ifdnfc->slot, TxBuffer, TxLength, false))) {
+      *RxLength = memo_len;
+      RecvPci->Protocol = 1;
+      LogXxd(PCSC_LOG_INFO, "Answered from the response cache\n", RxBuffer, *RxLength);
+      return IFD_SUCCESS;
+    }
+  }
+
+  if (ifdnfc->slot.iso_dep_pending && !slot_activate_iso_dep(ifdnfc)) {
+    *RxLength = 0;
+    return IFD_COMMUNICATION_ERROR;
+  }
+  if (!memo_sync(ifdnfc)) {
+    *RxLength = 0;
+    return IFD_COMMUNICATION_ERROR;
+  }
+  if (ifdnfc->slot.memo_off)
+    // The SELECTs from now on are not followed
+    ifdnfc->slot.memo_path_len = ifdnfc->slot.memo_path_sent = 0;
+
   LogXxd(PCSC_LOG_INFO, "Sending to NFC target\n", TxBuffer, TxLength);
 
   size_t tl = TxLength, rl = *RxLength;
   int res;
-  // timeout pushed to 5000ms, cf FWTmax in ISO14443-4
-  if ((res = nfc_initiator_transceive_bytes(ifdnfc->device, TxBuffer, tl,
-                                            RxBuffer, rl, 5000)) < 0) {
+  res = slot_transceive_apdu(ifdnfc, TxBuffer, tl, RxBuffer, rl,
+                            ifdnfc->profile.transceive_timeout);
+  if (res < 0)
+    res = transmit_recover(ifdnfc, TxBuffer, TxLength, RxBuffer, rl, res);
+  if (res < 0) {
     Log2(PCSC_LOG_ERROR, "Could not transceive data (%s).",
          nfc_strerror(ifdnfc->device));
     *RxLength = 0;
     return(IFD_COMMUNICATION_ERROR);
   }
 
+  if (ifdnfc->profile.desfire_chaining && desfire_is_read(TxBuffer, TxLength)
+      && (res = desfire_chain(ifdnfc, RxBuffer, res, rl)) < 0) {
+    Log2(PCSC_LOG_ERROR, "Could not get additional DESFire frame (%s).",
+         nfc_strerror(ifdnfc->device));
+    *RxLength = 0;
+    return(IFD_COMMUNICATION_ERROR);
+  }
+
   *RxLength = res;
   RecvPci->Protocol = 1;
+  ifdnfc->slot.last_seen = ifdnfc_now_ms();
+  if (key_len && rapdu_is_ok(RxBuffer, *RxLength)) {
+    if (TxBuffer[1] == 0xA4 && !memo_path_select(&ifdnfc->slot, TxBuffer, TxLength, true))
+      ifdnfc->slot.memo_off = true;
+    else
+      ifdnfc_memo_store(&ifdnfc->memo, key, key_len, RxBuffer, *RxLength);
+  }
+  if (ifdnfc->slot.probe == IFDNFC_PROBE_MIFARE && TxLength >= 2
+      && (TxBuffer[0] == 0x60 || TxBuffer[0] == 0x61)) {
+    // AUTH A/B, presence checks must stay within this sector from now on
+    ifdnfc->slot.mifare_authenticated = true;
+    ifdnfc->slot.mifare_block = TxBuffer[1];
+  }
 
   LogXxd(PCSC_LOG_INFO, "Received from NFC target\n", RxBuffer, *RxLength);
 
   return IFD_SUCCESS;
 }
 
+static RESPONSECODE ifdnfc_transmit(struct ifd_device *ifdnfc, PUCHAR TxBuffer,
+                                    DWORD TxLength, PUCHAR RxBuffer, PDWORD RxLength,
+                                    PSCARD_IO_HEADER RecvPci)
+{
+  if (!ifdnfc->connected || !ifdnfc_slot_present(&ifdnfc->slot)
+      || ifdnfc->slot.reset) {
+    *RxLength = 0;
+    return IFD_ICC_NOT_PRESENT;
+  }
+  slot_claim_chip(ifdnfc, true);
+  if ((ifdnfc->slot.state == IFDNFC_SLOT_HALTED || ifdnfc->slot.state == IFDNFC_SLOT_ASLEEP)
+      && !slot_resume(ifdnfc)) {
+    *RxLength = 0;
+    return IFD_COMMUNICATION_ERROR;
+  }
+
+  size_t span = ifdnfc_trace_begin(&ifdnfc->trace, "IFDHTransmitToICC");
+  RESPONSECODE rv = transmit(ifdnfc, TxBuffer, TxLength, RxBuffer, RxLength, RecvPci);
+  ifdnfc_trace_end(&ifdnfc->trace, span);
+  // The activation timeline ends with the first APDU
+  ifdnfc_trace_finish(&ifdnfc->trace);
+
+  return rv;
+}
+
 RESPONSECODE
 // cppcheck-suppress unusedFunction
-IFDHICCPresence(DWORD Lun)
+IFDHTransmitToICC(DWORD Lun, SCARD_IO_HEADER SendPci, PUCHAR TxBuffer, DWORD
+                  TxLength, PUCHAR RxBuffer, PDWORD RxLength, PSCARD_IO_HEADER RecvPci)
 {
   (void) Lun;
   int device_index = lun2device_index(Lun);
   if (device_index < 0)
     return IFD_COMMUNICATION_ERROR;
   struct ifd_device *ifdnfc = &ifd_devices[device_index];
+  (void) SendPci;
+  if (!RxLength || !RecvPci)
+    return IFD_COMMUNICATION_ERROR;
+
+  return ifdnfc_call(ifdnfc, IFDNFC_REQUEST_TRANSMIT, 0, TxBuffer, TxLength,
+                     RxBuffer, RxLength, RecvPci, ifdnfc_request_timeout(ifdnfc));
+}
+
+static RESPONSECODE ifdnfc_icc_presence(struct ifd_device *ifdnfc, bool peek)
+{
   if (!ifdnfc->connected)
     return IFD_ICC_NOT_PRESENT;
+  if (ifdnfc->slot.reset) {
+    // See slot_report_reset(), the card is reported again by the next check
+    if (!peek)
+      ifdnfc->slot.reset = false;
+    return IFD_ICC_NOT_PRESENT;
+  }
   if (ifdnfc->secure_element_as_card)
-    return ifdnfc->slot.present ? IFD_SUCCESS : IFD_ICC_NOT_PRESENT; // If available once, available forever :)
-  return ifdnfc_target_is_available(ifdnfc) ? IFD_SUCCESS : IFD_ICC_NOT_PRESENT;
+    return ifdnfc_slot_present(&ifdnfc->slot) ? IFD_SUCCESS : IFD_ICC_NOT_PRESENT; // If available once, available forever :)
+  if (!slot_claim_chip(ifdnfc, false))
+    // The SE slot is busy, report what we knew last
+    return ifdnfc_slot_present(&ifdnfc->slot) ? IFD_SUCCESS : IFD_ICC_NOT_PRESENT;
+
+  if (!ifdnfc_slot_present(&ifdnfc->slot))
+    ifdnfc_trace_start(&ifdnfc->trace, ifdnfc - ifd_devices);
+  size_t span = ifdnfc_trace_begin(&ifdnfc->trace, "IFDHICCPresence");
+  uint32_t rf_commands = ifdnfc->rf_commands;
+  bool present = ifdnfc_target_is_available(ifdnfc);
+  ifdnfc_trace_end(&ifdnfc->trace, span);
+  if (!present)
+    ifdnfc->last_miss = ifdnfc_now_us();
+
+  pthread_mutex_lock(&ifdnfc->rf_lock);
+  ifdnfc->polls++;
+  ifdnfc->last_poll_rf_commands = ifdnfc->rf_commands - rf_commands;
+  ifdnfc->poll_rf_commands += ifdnfc->last_poll_rf_commands;
+  pthread_mutex_unlock(&ifdnfc->rf_lock);
+  if (ifdnfc->last_poll_rf_commands)
+    Log2(PCSC_LOG_DEBUG, "Presence check sent %u RF commands.", (unsigned int) ifdnfc->last_poll_rf_commands);
+
+  return present ? IFD_SUCCESS : IFD_ICC_NOT_PRESENT;
 }
 
 RESPONSECODE
 // cppcheck-suppress unusedFunction
-IFDHControl(DWORD Lun, DWORD dwControlCode, PUCHAR TxBuffer, DWORD TxLength,
-            PUCHAR RxBuffer, DWORD RxLength, LPDWORD pdwBytesReturned)
+IFDHICCPresence(DWORD Lun)
 {
   (void) Lun;
   int device_index = lun2device_index(Lun);
   if (device_index < 0)
     return IFD_COMMUNICATION_ERROR;
   struct ifd_device *ifdnfc = &ifd_devices[device_index];
+
+  RESPONSECODE rv = icc_presence(ifdnfc, false);
+  pthread_mutex_lock(&ifdnfc->rf_lock);
+  ifdnfc->reported = rv == IFD_SUCCESS;
+  pthread_mutex_unlock(&ifdnfc->rf_lock);
+
+  return rv;
+}
+
+static bool ifdnfc_event_pop(struct ifd_device *ifdnfc, struct ifdnfc_event *event,
+                             unsigned int *dropped)
+{
+  bool found = false;
+
+  pthread_mutex_lock(&ifdnfc->rf_lock);
+  if (ifdnfc->events_len) {
+    *event = ifdnfc->events[ifdnfc->events_head];
+    ifdnfc->events_head = (ifdnfc->events_head + 1) % IFDNFC_EVENTS;
+    ifdnfc->events_len--;
+    *dropped = ifdnfc->events_dropped;
+    ifdnfc->events_dropped = 0;
+    found = true;
+  }
+  pthread_mutex_unlock(&ifdnfc->rf_lock);
+
+  return found;
+}
+
+/*
+ * Oldest queued card event, waiting up to the timeout of the request for
+ * one. pcscd holds the lock of the reader during IFDHControl(), which keeps
+ * its own presence checks out, so the wait runs them through the worker.
+ */
+static RESPONSECODE ifdnfc_get_event(struct ifd_device *ifdnfc, PUCHAR TxBuffer,
+                                     DWORD TxLength, PUCHAR RxBuffer,
+                                     DWORD RxLength, LPDWORD pdwBytesReturned)
+{
+  struct ifdnfc_event event;
+  unsigned int dropped = 0;
+  uint32_t timeout = 0;
+  bool found, waiting;
+  DWORD len = 0;
+
+  if (RxLength < IFDNFC_EVENT_MAX_LENGTH)
+    return IFD_COMMUNICATION_ERROR;
+  if (TxLength) {
+    if (TxLength != sizeof timeout)
+      return IFD_COMMUNICATION_ERROR;
+    memcpy(&timeout, TxBuffer, sizeof timeout);
+  }
+
+  uint64_t deadline = ifdnfc_now_ms() + timeout;
+  waiting = timeout > 0;
+  while (!(found = ifdnfc_event_pop(ifdnfc, &event, &dropped)) && waiting) {
+    // Queues the events, like the presence checks of pcscd would
+    icc_presence(ifdnfc, true);
+    waiting = ifdnfc_poll_wait(ifdnfc, deadline, true);
+  }
+
+  if (!found) {
+    RxBuffer[len++] = IFDNFC_EVENT_NONE;
+  } else {
+    RxBuffer[len++] = event.type;
+    RxBuffer[len++] = dropped > 0xff ? 0xff : dropped;
+    RxBuffer[len++] = event.atqa[0];
+    RxBuffer[len++] = event.atqa[1];
+    RxBuffer[len++] = event.sak;
+    RxBuffer[len++] = event.uid_len;
+    memcpy(RxBuffer + len, event.uid, event.uid_len);
+    len += event.uid_len;
+    RxBuffer[len++] = event.atr_len;
+    memcpy(RxBuffer + len, event.atr, event.atr_len);
+    len += event.atr_len;
+  }
   if (pdwBytesReturned)
-    *pdwBytesReturned = 0;
+    *pdwBytesReturned = len;
+
+  return IFD_SUCCESS;
+}
+
+static RESPONSECODE ifdnfc_control(struct ifd_device *ifdnfc, DWORD dwControlCode,
+                                   PUCHAR TxBuffer, DWORD TxLength, PUCHAR RxBuffer,
+                                   DWORD RxLength, LPDWORD pdwBytesReturned)
+{
+  *pdwBytesReturned = 0;
 
   switch (dwControlCode) {
     case IFDNFC_CTRL_ACTIVE:
       if (TxLength < 1 || !TxBuffer || RxLength < 1 || !RxBuffer)
         return IFD_COMMUNICATION_ERROR;
 
+      if (ifdnfc->host && *TxBuffer != IFDNFC_GET_STATUS)
+        // The reader is switched through slot 0
+        return IFD_ERROR_NOT_SUPPORTED;
+
       switch (*TxBuffer) {
         case IFDNFC_SET_ACTIVE:
         case IFDNFC_SET_ACTIVE_SE: {
@@ -785,17 +4110,20 @@ IFDHControl(DWORD Lun, DWORD dwControlCode, PUCHAR TxBuffer, DWORD TxLength,
           if (TxLength < (1 + sizeof(u16ConnstringLength)))
             return IFD_COMMUNICATION_ERROR;
           memcpy(&u16ConnstringLength, TxBuffer + 1, sizeof(u16ConnstringLength));
-          if ((TxLength - (1 + sizeof(u16ConnstringLength))) != u16ConnstringLength)
+          if ((TxLength - (1 + sizeof(u16ConnstringLength))) != u16ConnstringLength
+              || u16ConnstringLength > sizeof(ifdnfc->connstring))
             return IFD_COMMUNICATION_ERROR;
-          memcpy(ifd_connstring, TxBuffer + (1 + sizeof(u16ConnstringLength)), u16ConnstringLength);
-          ifdnfc->device = nfc_open(context, ifd_connstring);
-          ifdnfc->connected = (ifdnfc->device) ? true : false;
-          ifdnfc->Lun = Lun;
-          ifdnfc->secure_element_as_card = (TxBuffer[0] == IFDNFC_SET_ACTIVE_SE);
+          memcpy(ifdnfc->connstring, TxBuffer + (1 + sizeof(u16ConnstringLength)), u16ConnstringLength);
+          ifdnfc->connstring[sizeof(ifdnfc->connstring) - 1] = '\0';
+          ifdnfc_open(ifdnfc);
+          ifdnfc->secure_element_as_card = (TxBuffer[0] == IFDNFC_SET_ACTIVE_SE)
+                                           && !ifdnfc->profile.secure_element_slot;
+          ifdnfc_state_update(ifdnfc);
         }
         break;
         case IFDNFC_SET_INACTIVE:
           ifdnfc_disconnect(ifdnfc);
+          ifdnfc_state_update(ifdnfc);
           break;
         case IFDNFC_GET_STATUS:
           break;
@@ -808,18 +4136,22 @@ IFDHControl(DWORD Lun, DWORD dwControlCode, PUCHAR TxBuffer, DWORD TxLength,
           return IFD_COMMUNICATION_ERROR;
       }
 
-      if ((ifdnfc->connected) && ((!ifdnfc->secure_element_as_card) || ifdnfc_se_is_available(ifdnfc))) {
+      if ((ifdnfc->connected)
+          && ((!ifdnfc->secure_element_as_card) || ifdnfc_slot_present(&ifdnfc->slot)
+              || (slot_claim_chip(ifdnfc, false) && ifdnfc_se_is_available(ifdnfc)))) {
         Log1(PCSC_LOG_INFO, "IFD-handler for libnfc is active.");
         RxBuffer[0] = IFDNFC_IS_ACTIVE;
-        const uint16_t u16ConnstringLength = strlen(ifd_connstring) + 1;
+        const uint16_t u16ConnstringLength = strlen(ifdnfc->connstring) + 1;
+        const uint32_t u32UartRate = ifdnfc->uart_rate;
+        if (RxLength < 1 + sizeof(u16ConnstringLength) + u16ConnstringLength + sizeof(u32UartRate))
+          return IFD_ERROR_INSUFFICIENT_BUFFER;
         memcpy(RxBuffer + 1, &u16ConnstringLength, sizeof(u16ConnstringLength));
-        memcpy(RxBuffer + 1 + sizeof(u16ConnstringLength), ifd_connstring, u16ConnstringLength);
-        if (pdwBytesReturned)
-          *pdwBytesReturned = 1 + sizeof(u16ConnstringLength) + u16ConnstringLength;
+        memcpy(RxBuffer + 1 + sizeof(u16ConnstringLength), ifdnfc->connstring, u16ConnstringLength);
+        memcpy(RxBuffer + 1 + sizeof(u16ConnstringLength) + u16ConnstringLength, &u32UartRate, sizeof(u32UartRate));
+        *pdwBytesReturned = 1 + sizeof(u16ConnstringLength) + u16ConnstringLength + sizeof(u32UartRate);
       } else {
         Log1(PCSC_LOG_INFO, "IFD-handler for libnfc is inactive.");
-        if (pdwBytesReturned)
-          *pdwBytesReturned = 1;
+        *pdwBytesReturned = 1;
         *RxBuffer = IFDNFC_IS_INACTIVE;
       }
       break;
@@ -829,3 +4161,35 @@ IFDHControl(DWORD Lun, DWORD dwControlCode, PUCHAR TxBuffer, DWORD TxLength,
 
   return IFD_SUCCESS;
 }
+
+RESPONSECODE
+// cppcheck-suppress unusedFunction
+IFDHControl(DWORD Lun, DWORD dwControlCode, PUCHAR TxBuffer, DWORD TxLength,
+            PUCHAR RxBuffer, DWORD RxLength, LPDWORD pdwBytesReturned)
+{
+  (void) Lun;
+  int device_index = lun2device_index(Lun);
+  if (device_index < 0)
+    return IFD_COMMUNICATION_ERROR;
+  struct ifd_device *ifdnfc = &ifd_devices[device_index];
+  if (pdwBytesReturned)
+    *pdwBytesReturned = 0;
+  if (TxLength && !TxBuffer)
+    return IFD_COMMUNICATION_ERROR;
+  if (!RxBuffer)
+    RxLength = 0;
+
+  if (dwControlCode == IFDNFC_CTRL_GET_EVENT)
+    // Not through the worker, which it uses to wait for the events
+    return ifdnfc_get_event(ifdnfc, TxBuffer, TxLength, RxBuffer, RxLength,
+                            pdwBytesReturned);
+
+  DWORD dwBytesReturned = RxLength;
+  RESPONSECODE rv = ifdnfc_call(ifdnfc, IFDNFC_REQUEST_CONTROL, dwControlCode,
+                                TxBuffer, TxLength, RxBuffer, &dwBytesReturned,
+                                NULL, IFDNFC_CONTROL_TIMEOUT_MS);
+  if (pdwBytesReturned)
+    *pdwBytesReturned = dwBytesReturned;
+
+  return rv;
+}
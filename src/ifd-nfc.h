@@ -22,6 +22,20 @@
 #define IFDNFC_READER_NAME   "IFD-NFC"
 
 #define IFDNFC_CTRL_ACTIVE   1
+/*
+ * Take the oldest queued card event, waiting for one if the queue is empty.
+ * Input: none, or the timeout in ms (uint32_t, host byte order), 0 for no
+ * wait. Other applications wait for the reader meanwhile. Output: event
+ * type, number of events dropped before this one, ATQA (2 bytes), SAK, UID
+ * length, UID, ATR length, ATR. Only the event type IFDNFC_EVENT_NONE is
+ * returned when the timeout expired.
+ */
+#define IFDNFC_CTRL_GET_EVENT 3
+#define IFDNFC_EVENT_MAX_LENGTH (6 + 10 + 1 + 33)
+
+#define IFDNFC_EVENT_NONE     0
+#define IFDNFC_EVENT_INSERTED 1
+#define IFDNFC_EVENT_REMOVED  2
 
 #define IFDNFC_IS_ACTIVE     1
 #define IFDNFC_IS_INACTIVE   0
@@ -31,4 +45,47 @@
 #define IFDNFC_SET_ACTIVE_SE     2
 #define IFDNFC_GET_STATUS        3
 
+/*
+ * Response of IFDNFC_CTRL_ACTIVE: IFDNFC_IS_INACTIVE, or IFDNFC_IS_ACTIVE,
+ * connstring length (uint16_t), connstring with its NUL and the baud rate of
+ * the serial link (uint32_t, 0 for other devices), in host byte order
+ */
+#define IFDNFC_STATUS_MAX_LENGTH (1 + 2 + 1024 + 4) // NFC_BUFSIZE_CONNSTRING is 1024
+
+/*
+ * Vendor attributes for SCardGetAttrib(), uint32_t in host byte order. Tags
+ * are SCARD_ATTR_VALUE(SCARD_CLASS_VENDOR_DEFINED, n) of reader.h.
+ */
+#define IFDNFC_ATTR(n) ((7ul << 16) | (n))
+#define IFDNFC_ATTR_POLLS                 IFDNFC_ATTR(0x01) // presence checks
+#define IFDNFC_ATTR_POLL_RF_COMMANDS      IFDNFC_ATTR(0x02) // RF commands sent by all presence checks
+#define IFDNFC_ATTR_LAST_POLL_RF_COMMANDS IFDNFC_ATTR(0x03) // RF commands sent by the last one
+#define IFDNFC_ATTR_RESTARTS              IFDNFC_ATTR(0x04) // reopened by the watchdog
+#define IFDNFC_ATTR_LINK_RTT              IFDNFC_ATTR(0x05) // host link round trip in us, 0 if unknown
+
+/*
+ * Vendor attributes that SCardSetAttrib() changes as well. They apply to
+ * both slots of the reader between two commands, until it is activated
+ * again with the values of its profile.
+ */
+#define IFDNFC_ATTR_TRANSCEIVE_TIMEOUT    IFDNFC_ATTR(0x06) // ms
+#define IFDNFC_ATTR_PRESENCE_INTERVAL     IFDNFC_ATTR(0x07) // ms, the calibrated one may be longer
+#define IFDNFC_ATTR_INFINITE_SELECT       IFDNFC_ATTR(0x08) // 0 or 1
+// Discovery order: libnfc modulation type and baud rate, one byte each per modulation
+#define IFDNFC_ATTR_MODULATIONS           IFDNFC_ATTR(0x09)
+
+// Counters of the driver's ISO-DEP layer (soft_iso_dep), read only
+#define IFDNFC_ATTR_ISO_DEP_BLOCKS        IFDNFC_ATTR(0x0A) // blocks sent
+#define IFDNFC_ATTR_ISO_DEP_CHAINED       IFDNFC_ATTR(0x0B) // chained I-blocks, both directions
+#define IFDNFC_ATTR_ISO_DEP_WTX           IFDNFC_ATTR(0x0C) // waiting time extensions
+#define IFDNFC_ATTR_ISO_DEP_RETRANSMISSIONS IFDNFC_ATTR(0x0D)
+#define IFDNFC_ATTR_ISO_DEP_ERRORS        IFDNFC_ATTR(0x0E) // APDUs given up
+
+/*
+ * When the card in the slot entered the field, uint64_t in us of
+ * CLOCK_MONOTONIC: halfway between the last presence check that missed it
+ * and the one that found it. Read only.
+ */
+#define IFDNFC_ATTR_CARD_ENTERED          IFDNFC_ATTR(0x0F)
+
 #endif
@@ -42,7 +42,7 @@ main(int argc, char *argv[])
   char *reader;
   BYTE pbSendBuffer[1 + 1 + sizeof(nfc_connstring)];
   DWORD dwSendLength;
-  BYTE pbRecvBuffer[1];
+  BYTE pbRecvBuffer[IFDNFC_STATUS_MAX_LENGTH];
   DWORD dwActiveProtocol, dwRecvLength, dwReaders;
   char* mszReaders = NULL;
 
@@ -182,18 +182,25 @@ main(int argc, char *argv[])
   switch (pbRecvBuffer[0]) {
     case IFDNFC_IS_ACTIVE: {
       uint16_t u16ConnstringLength;
+      uint32_t u32UartRate;
       if (dwRecvLength < (1 + sizeof(u16ConnstringLength))) {
         rv = SCARD_F_INTERNAL_ERROR;
         goto pcsc_error;
       }
       memcpy(&u16ConnstringLength, pbRecvBuffer + 1, sizeof(u16ConnstringLength));
-      if ((dwRecvLength - (1 + sizeof(u16ConnstringLength))) != u16ConnstringLength) {
+      if ((dwRecvLength - (1 + sizeof(u16ConnstringLength))) != u16ConnstringLength + sizeof(u32UartRate)
+          || u16ConnstringLength == 0 || u16ConnstringLength > sizeof(nfc_connstring)) {
         rv = SCARD_F_INTERNAL_ERROR;
         goto pcsc_error;
       }
       nfc_connstring connstring;
       memcpy(connstring, pbRecvBuffer + 1 + sizeof(u16ConnstringLength), u16ConnstringLength);
-      printf("%s is active using %s.\n", IFDNFC_READER_NAME, connstring);
+      connstring[u16ConnstringLength - 1] = '\0';
+      memcpy(&u32UartRate, pbRecvBuffer + 1 + sizeof(u16ConnstringLength) + u16ConnstringLength, sizeof(u32UartRate));
+      if (u32UartRate)
+        printf("%s is active using %s at %lu baud.\n", IFDNFC_READER_NAME, connstring, (unsigned long) u32UartRate);
+      else
+        printf("%s is active using %s.\n", IFDNFC_READER_NAME, connstring);
     }
     break;
     case IFDNFC_IS_INACTIVE:
@@ -0,0 +1,1027 @@
+/*
+ * Copyright (C) 2010 Frank Morgner
+ *
+ * This file is part of ifdnfc.
+ *
+ * ifdnfc is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * ifdnfc is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * ifdnfc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Tap-to-first-APDU latency: wait for a card, connect to it and send an APDU,
+ * tap after tap, then print percentiles of each stage. The simulated card
+ * backend (-s) needs neither pcscd nor a reader: the driver is loaded like
+ * pcscd does and talks through libnfc to a PN532 emulated on a pseudo
+ * terminal, e.g. to compare driver versions in CI against a fixed reference.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "ifd-nfc.h"
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pcsclite.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <winscard.h>
+
+#ifdef __APPLE__
+typedef int32_t LONG;
+typedef uint32_t DWORD;
+typedef uint8_t BYTE;
+#endif
+
+#ifdef HAVE_IFDHANDLER_H
+#include <ifdhandler.h>
+#else
+#include "my_ifdhandler.h"
+#endif
+
+#ifndef IFDNFC_DRIVER
+#define IFDNFC_DRIVER "libifdnfc.so"
+#endif
+
+#define DEFAULT_TAPS 20
+#define DEFAULT_APDU "00A4040000"
+
+enum stage {
+  STAGE_DETECT,             // card in the field until the application sees it
+  STAGE_CONNECT,            // SCardConnect()
+  STAGE_APDU,               // SCardTransmit() of the first APDU
+  STAGE_TOTAL,
+  STAGES,
+};
+
+static const char *stage_names[STAGES] = {
+  "detect", "connect", "apdu", "total",
+};
+
+/*
+ * Where the cards come from. wait_card() returns when a card is there and
+ * tells when it entered the field, or when it was reported if that is all
+ * the backend knows. card_entered(), if any, may tell better once connected.
+ */
+struct backend {
+  LONG (*wait_card)(void *ctx, uint64_t *entered);
+  LONG (*connect)(void *ctx);
+  LONG (*card_entered)(void *ctx, uint64_t *entered);
+  LONG (*transmit)(void *ctx, const BYTE *apdu, DWORD apdu_len,
+                   BYTE *resp, DWORD *resp_len);
+  LONG (*disconnect)(void *ctx);
+  LONG (*wait_removal)(void *ctx);
+};
+
+static uint64_t now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_us(uint64_t us)
+{
+  struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+
+  nanosleep(&ts, NULL);
+}
+
+struct pcsc {
+  SCARDCONTEXT hContext;
+  SCARDHANDLE hCard;
+  const char *reader;
+};
+
+static LONG pcsc_wait(struct pcsc *pcsc, DWORD state)
+{
+  SCARD_READERSTATE rs;
+  LONG rv;
+
+  memset(&rs, 0, sizeof rs);
+  rs.szReader = pcsc->reader;
+  rs.dwCurrentState = SCARD_STATE_UNAWARE;
+  for (;;) {
+    rv = SCardGetStatusChange(pcsc->hContext, INFINITE, &rs, 1);
+    if (rv != SCARD_S_SUCCESS)
+      return rv;
+    if (rs.dwEventState & state)
+      return SCARD_S_SUCCESS;
+    rs.dwCurrentState = rs.dwEventState & ~SCARD_STATE_CHANGED;
+  }
+}
+
+static LONG pcsc_wait_card(void *ctx, uint64_t *entered)
+{
+  LONG rv = pcsc_wait(ctx, SCARD_STATE_PRESENT);
+
+  // Until pcsc_card_entered() knows better
+  *entered = now_us();
+  return rv;
+}
+
+static LONG pcsc_connect(void *ctx)
+{
+  struct pcsc *pcsc = ctx;
+  DWORD dwActiveProtocol;
+
+  return SCardConnect(pcsc->hContext, pcsc->reader, SCARD_SHARE_SHARED,
+                      SCARD_PROTOCOL_T1, &pcsc->hCard, &dwActiveProtocol);
+}
+
+/*
+ * The driver tells when the card entered the field, on the same clock as
+ * ours. With other drivers the detection stage stays 0.
+ */
+static LONG pcsc_card_entered(void *ctx, uint64_t *entered)
+{
+  struct pcsc *pcsc = ctx;
+  uint64_t us;
+  DWORD len = sizeof us;
+
+  if (SCardGetAttrib(pcsc->hCard, IFDNFC_ATTR_CARD_ENTERED, (BYTE *) &us, &len) == SCARD_S_SUCCESS
+      && len == sizeof us && us <= *entered)
+    *entered = us;
+  return SCARD_S_SUCCESS;
+}
+
+static LONG pcsc_transmit(void *ctx, const BYTE *apdu, DWORD apdu_len,
+                          BYTE *resp, DWORD *resp_len)
+{
+  struct pcsc *pcsc = ctx;
+
+  return SCardTransmit(pcsc->hCard, SCARD_PCI_T1, apdu, apdu_len, NULL,
+                       resp, resp_len);
+}
+
+static LONG pcsc_disconnect(void *ctx)
+{
+  struct pcsc *pcsc = ctx;
+
+  return SCardDisconnect(pcsc->hCard, SCARD_LEAVE_CARD);
+}
+
+static LONG pcsc_wait_removal(void *ctx)
+{
+  return pcsc_wait(ctx, SCARD_STATE_EMPTY);
+}
+
+static const struct backend pcsc_backend = {
+  pcsc_wait_card, pcsc_connect, pcsc_card_entered, pcsc_transmit,
+  pcsc_disconnect, pcsc_wait_removal,
+};
+
+/*
+ * Simulated card. The driver is loaded and called like pcscd does, and opens
+ * a PN532 emulated on a pseudo terminal through libnfc's pn532_uart driver.
+ * The emulated chip finds an ISO14443-4 card once it entered the field; the
+ * card takes its nominal time in ms for the activation and for each APDU,
+ * give or take jitter percent, with a fixed seed so that runs can be
+ * compared. Everything else is the driver's own work.
+ */
+#define SIM_LUN         0
+#define SIM_POLL_MS     400     // presence checks of pcscd without polling thread
+#define SIM_WAIT_MS     10000   // the driver should have seen the card by then
+#define SIM_TAP_GAP_MS  1000    // at most, card-free time before a tap
+
+enum sim_time {
+  SIM_ACTIVATION,
+  SIM_APDU,
+  SIM_TIMES,
+};
+
+struct sim {
+  unsigned int ms[SIM_TIMES];
+  unsigned int jitter;
+  const char *driver;
+  void *dl;
+  RESPONSECODE (*create_channel)(DWORD, LPSTR);
+  RESPONSECODE (*close_channel)(DWORD);
+  RESPONSECODE (*get_capabilities)(DWORD, DWORD, PDWORD, PUCHAR);
+  RESPONSECODE (*control)(DWORD, DWORD, PUCHAR, DWORD, PUCHAR, DWORD, LPDWORD);
+  RESPONSECODE (*power)(DWORD, DWORD, PUCHAR, PDWORD);
+  RESPONSECODE (*transmit)(DWORD, SCARD_IO_HEADER, PUCHAR, DWORD, PUCHAR, PDWORD,
+                           PSCARD_IO_HEADER);
+  RESPONSECODE (*presence)(DWORD);
+  RESPONSECODE (*poll)(DWORD, int);   // polling thread of the driver, if any
+  bool channel;
+  char dir[64];             // configuration of the driver, if we made it
+  int pty;                  // master side of the emulated chip
+  int tty;                  // slave side, kept open for the master to work
+  bool running;
+  pthread_t chip;
+  unsigned int seed;        // of the emulated card
+  unsigned int gap_seed;    // of the taps
+  pthread_mutex_t lock;     // guards the fields below
+  bool stop;
+  uint64_t inserted;        // us, the card is in the field from then on
+  bool removed;
+  bool halted;              // HLTA or S(DESELECT) since it entered the field
+  uint8_t params;           // flags of SetParameters
+};
+
+static const uint8_t sim_uid[] = { 0x01, 0x02, 0x03, 0x04 };
+static const uint8_t sim_atqa[] = { 0x00, 0x04 };
+#define SIM_SAK 0x20
+// TL, T0, TA, TB, TC of a card without historical bytes
+static const uint8_t sim_ats[] = { 0x05, 0x78, 0x80, 0x70, 0x02 };
+
+#define PN532_DIAGNOSE               0x00
+#define PN532_GET_FIRMWARE_VERSION   0x02
+#define PN532_GET_GENERAL_STATUS     0x04
+#define PN532_READ_REGISTER          0x06
+#define PN532_SET_PARAMETERS         0x12
+#define PN532_POWER_DOWN             0x16
+#define PN532_IN_DATA_EXCHANGE       0x40
+#define PN532_IN_COMMUNICATE_THRU    0x42
+#define PN532_IN_DESELECT            0x44
+#define PN532_IN_LIST_PASSIVE_TARGET 0x4A
+#define PN532_IN_RELEASE             0x52
+#define PN532_IN_SELECT              0x54
+#define PN532_PARAM_AUTO_RATS        0x10
+#define PN532_STATUS_TIMEOUT         0x01
+
+static void sim_sleep(struct sim *sim, enum sim_time time)
+{
+  long us = sim->ms[time] * 1000L;
+
+  if (sim->jitter)
+    us += us * ((long) (rand_r(&sim->seed) % (2 * sim->jitter + 1)) - (long) sim->jitter) / 100;
+  sleep_us(us);
+}
+
+// Whether the card is in the field and not halted
+static bool sim_card_answers(struct sim *sim)
+{
+  bool answers;
+
+  pthread_mutex_lock(&sim->lock);
+  answers = sim->inserted && sim->inserted <= now_us() && !sim->removed && !sim->halted;
+  pthread_mutex_unlock(&sim->lock);
+
+  return answers;
+}
+
+// WUPA: a card in the field answers, even a halted one
+static bool sim_card_wake(struct sim *sim)
+{
+  bool woken;
+
+  pthread_mutex_lock(&sim->lock);
+  woken = sim->inserted && sim->inserted <= now_us() && !sim->removed;
+  if (woken)
+    sim->halted = false;
+  pthread_mutex_unlock(&sim->lock);
+
+  return woken;
+}
+
+static void sim_card_halt(struct sim *sim)
+{
+  pthread_mutex_lock(&sim->lock);
+  sim->halted = true;
+  pthread_mutex_unlock(&sim->lock);
+}
+
+// InListPassiveTarget: the card answers REQA at 106 kbps type A, unless halted
+static size_t sim_list(struct sim *sim, const uint8_t *in, size_t in_len, uint8_t *out)
+{
+  size_t n = 0;
+  bool rats;
+
+  if (in_len < 2 || in[1] != 0x00 || !sim_card_answers(sim)
+      || (in_len > 2 && (in_len - 2 != sizeof sim_uid || memcmp(in + 2, sim_uid, sizeof sim_uid)))) {
+    out[n++] = 0;
+    return n;
+  }
+  sim_sleep(sim, SIM_ACTIVATION);
+  out[n++] = 1;
+  out[n++] = 1;
+  memcpy(out + n, sim_atqa, sizeof sim_atqa);
+  n += sizeof sim_atqa;
+  out[n++] = SIM_SAK;
+  out[n++] = sizeof sim_uid;
+  memcpy(out + n, sim_uid, sizeof sim_uid);
+  n += sizeof sim_uid;
+  pthread_mutex_lock(&sim->lock);
+  rats = sim->params & PN532_PARAM_AUTO_RATS;
+  pthread_mutex_unlock(&sim->lock);
+  if (rats) {
+    memcpy(out + n, sim_ats, sizeof sim_ats);
+    n += sizeof sim_ats;
+  }
+
+  return n;
+}
+
+/*
+ * InCommunicateThru: frames of the driver's own ISO-DEP layer and of the
+ * wake up of a halted card, WUPA, SELECT, RATS and HLTA
+ */
+static size_t sim_thru(struct sim *sim, const uint8_t *in, size_t in_len, uint8_t *out)
+{
+  size_t n = 0, hdr;
+
+  if (in_len == 1 && in[0] == 0x52 && sim_card_wake(sim)) {
+    // ATQA, LSB first
+    out[n++] = 0x00;
+    out[n++] = sim_atqa[1];
+    out[n++] = sim_atqa[0];
+    return n;
+  }
+  if (!in_len || !sim_card_answers(sim)) {
+    out[n++] = PN532_STATUS_TIMEOUT;
+    return n;
+  }
+  // PCB and CID, if any
+  hdr = (in[0] & 0x08) && in_len > 1 ? 2 : 1;
+  if (in[0] == 0x93 && in_len == 7 && in[1] == 0x70 && !memcmp(in + 2, sim_uid, sizeof sim_uid)) {
+    // SELECT of the first and only cascade level
+    out[n++] = 0x00;
+    out[n++] = SIM_SAK;
+  } else if (in[0] == 0xE0) {
+    out[n++] = 0x00;
+    memcpy(out + n, sim_ats, sizeof sim_ats);
+    n += sizeof sim_ats;
+  } else if (in[0] == 0x50) {
+    // HLTA is not answered
+    sim_card_halt(sim);
+    out[n++] = PN532_STATUS_TIMEOUT;
+  } else if ((in[0] & 0xF7) == 0xC2) {
+    // S(DESELECT)
+    sim_card_halt(sim);
+    out[n++] = 0x00;
+    memcpy(out + n, in, hdr);
+    n += hdr;
+  } else if ((in[0] & 0xE2) == 0x02) {
+    // I-block: R(ACK) while chaining, the status word at the end
+    sim_sleep(sim, SIM_APDU);
+    out[n++] = 0x00;
+    out[n++] = in[0] & 0x10 ? 0xA2 | (in[0] & 0x09) : in[0] & 0x0B;
+    if (hdr == 2)
+      out[n++] = in[1];
+    if (!(in[0] & 0x10)) {
+      out[n++] = 0x90;
+      out[n++] = 0x00;
+    }
+  } else if ((in[0] & 0xE2) == 0xA2) {
+    // R-block, e.g. R(NAK) of a presence check
+    out[n++] = 0x00;
+    out[n++] = 0xA2 | (in[0] & 0x09);
+    if (hdr == 2)
+      out[n++] = in[1];
+  } else {
+    out[n++] = PN532_STATUS_TIMEOUT;
+  }
+
+  return n;
+}
+
+// Response of the emulated PN532 to a command, TFI included
+static size_t sim_command(struct sim *sim, const uint8_t *cmd, size_t len, uint8_t *out)
+{
+  const uint8_t *in = cmd + 2;
+  size_t in_len = len - 2, n = 0;
+
+  out[n++] = 0xD5;
+  out[n++] = cmd[1] + 1;
+  switch (cmd[1]) {
+    case PN532_DIAGNOSE:
+      if (in_len && in[0] == 0x06) {
+        // Card presence detection
+        out[n++] = sim_card_answers(sim) ? 0x00 : PN532_STATUS_TIMEOUT;
+      } else {
+        // Communication line test and others: echo
+        memcpy(out + n, in, in_len);
+        n += in_len;
+      }
+      break;
+    case PN532_GET_FIRMWARE_VERSION:
+      // PN532 v1.6, ISO14443-A/B and ISO18092
+      out[n++] = 0x32;
+      out[n++] = 0x01;
+      out[n++] = 0x06;
+      out[n++] = 0x07;
+      break;
+    case PN532_GET_GENERAL_STATUS:
+      memset(out + n, 0, 4);
+      n += 4;
+      break;
+    case PN532_READ_REGISTER:
+      // 0 at every address
+      memset(out + n, 0, in_len / 2);
+      n += in_len / 2;
+      break;
+    case PN532_SET_PARAMETERS:
+      if (in_len) {
+        pthread_mutex_lock(&sim->lock);
+        sim->params = in[0];
+        pthread_mutex_unlock(&sim->lock);
+      }
+      break;
+    case PN532_POWER_DOWN:
+    case PN532_IN_SELECT:
+      out[n++] = 0x00;
+      break;
+    case PN532_IN_DATA_EXCHANGE:
+      if (!sim_card_answers(sim)) {
+        out[n++] = PN532_STATUS_TIMEOUT;
+        break;
+      }
+      sim_sleep(sim, SIM_APDU);
+      out[n++] = 0x00;
+      out[n++] = 0x90;
+      out[n++] = 0x00;
+      break;
+    case PN532_IN_COMMUNICATE_THRU:
+      n += sim_thru(sim, in, in_len, out + n);
+      break;
+    case PN532_IN_DESELECT:
+    case PN532_IN_RELEASE:
+      sim_card_halt(sim);
+      out[n++] = 0x00;
+      break;
+    case PN532_IN_LIST_PASSIVE_TARGET:
+      n += sim_list(sim, in, in_len, out + n);
+      break;
+    default:
+      // WriteRegister, SAMConfiguration, RFConfiguration, SetSerialBaudRate...
+      break;
+  }
+
+  return n;
+}
+
+static bool sim_write(int fd, const uint8_t *buf, size_t len)
+{
+  ssize_t res;
+
+  while (len) {
+    res = write(fd, buf, len);
+    if (res < 0 && errno != EINTR && errno != EAGAIN)
+      return false;
+    if (res > 0) {
+      buf += res;
+      len -= res;
+    }
+  }
+  return true;
+}
+
+// ACK right away, then the normal information frame of the response
+static void sim_answer(struct sim *sim, const uint8_t *cmd, size_t len)
+{
+  static const uint8_t ack[] = { 0x00, 0x00, 0xFF, 0x00, 0xFF, 0x00 };
+  uint8_t frame[5 + 255 + 2];
+  uint8_t dcs = 0;
+  size_t n, i;
+
+  if (len < 2 || cmd[0] != 0xD4 || !sim_write(sim->pty, ack, sizeof ack))
+    return;
+  n = sim_command(sim, cmd, len, frame + 5);
+  frame[0] = 0x00;
+  frame[1] = 0x00;
+  frame[2] = 0xFF;
+  frame[3] = n;
+  frame[4] = -n;
+  for (i = 0; i < n; i++)
+    dcs -= frame[5 + i];
+  frame[5 + n] = dcs;
+  frame[6 + n] = 0x00;
+  sim_write(sim->pty, frame, n + 7);
+}
+
+/*
+ * Next normal information frame of the host in buf, skipping the wake up
+ * preamble, ACKs and garbage. Returns the length of its TFI and data at
+ * *payload, 0 until it is complete. *used tells how much of buf is done.
+ */
+static size_t sim_frame(const uint8_t *buf, size_t len, size_t *used, const uint8_t **payload)
+{
+  size_t i;
+
+  for (i = 0; i + 1 < len; i++) {
+    if (buf[i] != 0x00 || buf[i + 1] != 0xFF)
+      continue;
+    if (i + 4 > len)
+      break;
+    if ((uint8_t) (buf[i + 2] + buf[i + 3]) != 0 || !buf[i + 2]) {
+      // ACK, NACK or a false start
+      if (buf[i + 2] == 0x00 || buf[i + 2] == 0xFF)
+        i += 3;
+      continue;
+    }
+    if (i + 4 + buf[i + 2] + 1 > len)
+      break;
+    *payload = buf + i + 4;
+    *used = i + 4 + buf[i + 2] + 1;
+    return buf[i + 2];
+  }
+  *used = i;
+  return 0;
+}
+
+static void *sim_chip(void *arg)
+{
+  struct sim *sim = arg;
+  uint8_t buf[2 * 262];
+  const uint8_t *payload;
+  size_t len = 0, used, n;
+  ssize_t res;
+  bool stop;
+
+  for (;;) {
+    struct pollfd pfd = { sim->pty, POLLIN, 0 };
+
+    pthread_mutex_lock(&sim->lock);
+    stop = sim->stop;
+    pthread_mutex_unlock(&sim->lock);
+    if (stop)
+      break;
+    if (poll(&pfd, 1, 100) != 1)
+      continue;
+    res = read(sim->pty, buf + len, sizeof buf - len);
+    if (res <= 0)
+      continue;
+    len += res;
+    while ((n = sim_frame(buf, len, &used, &payload)) > 0) {
+      sim_answer(sim, payload, n);
+      memmove(buf, buf + used, len - used);
+      len -= used;
+    }
+    memmove(buf, buf + used, len - used);
+    len -= used;
+    if (len == sizeof buf)
+      len = 0;
+  }
+
+  return NULL;
+}
+
+static LONG sim_result(RESPONSECODE rv)
+{
+  return rv == IFD_SUCCESS ? SCARD_S_SUCCESS : SCARD_F_COMM_ERROR;
+}
+
+// Wait like pcscd until the driver reports the card present or absent
+static LONG sim_wait(struct sim *sim, bool present)
+{
+  uint64_t deadline = now_us() + SIM_WAIT_MS * 1000ull;
+
+  while ((sim->presence(SIM_LUN) == IFD_SUCCESS) != present) {
+    if (now_us() > deadline)
+      return SCARD_E_TIMEOUT;
+    if (sim->poll)
+      sim->poll(SIM_LUN, SIM_WAIT_MS);
+    else
+      sleep_us(SIM_POLL_MS * 1000);
+  }
+
+  return SCARD_S_SUCCESS;
+}
+
+static LONG sim_wait_card(void *ctx, uint64_t *entered)
+{
+  struct sim *sim = ctx;
+
+  // At a random time, so that the taps do not line up with the polling
+  pthread_mutex_lock(&sim->lock);
+  sim->inserted = now_us() + (rand_r(&sim->gap_seed) % SIM_TAP_GAP_MS) * 1000ull;
+  sim->removed = false;
+  sim->halted = false;
+  *entered = sim->inserted;
+  pthread_mutex_unlock(&sim->lock);
+
+  return sim_wait(sim, true);
+}
+
+static LONG sim_connect(void *ctx)
+{
+  struct sim *sim = ctx;
+  UCHAR atr[MAX_ATR_SIZE];
+  DWORD atr_len = sizeof atr;
+
+  return sim_result(sim->power(SIM_LUN, IFD_POWER_UP, atr, &atr_len));
+}
+
+static LONG sim_transmit(void *ctx, const BYTE *apdu, DWORD apdu_len,
+                         BYTE *resp, DWORD *resp_len)
+{
+  struct sim *sim = ctx;
+  SCARD_IO_HEADER send_pci, recv_pci;
+
+  memset(&send_pci, 0, sizeof send_pci);
+  send_pci.Protocol = 1;
+  return sim_result(sim->transmit(SIM_LUN, send_pci, (PUCHAR) apdu, apdu_len,
+                                  resp, resp_len, &recv_pci));
+}
+
+static LONG sim_disconnect(void *ctx)
+{
+  struct sim *sim = ctx;
+  DWORD atr_len = 0;
+
+  return sim_result(sim->power(SIM_LUN, IFD_POWER_DOWN, NULL, &atr_len));
+}
+
+static LONG sim_wait_removal(void *ctx)
+{
+  struct sim *sim = ctx;
+
+  pthread_mutex_lock(&sim->lock);
+  sim->removed = true;
+  pthread_mutex_unlock(&sim->lock);
+
+  return sim_wait(sim, false);
+}
+
+static const struct backend sim_backend = {
+  sim_wait_card, sim_connect, NULL, sim_transmit, sim_disconnect, sim_wait_removal,
+};
+
+static void sim_close(struct sim *sim)
+{
+  char path[sizeof sim->dir + 16];
+
+  if (sim->channel)
+    sim->close_channel(SIM_LUN);
+  if (sim->running) {
+    pthread_mutex_lock(&sim->lock);
+    sim->stop = true;
+    pthread_mutex_unlock(&sim->lock);
+    pthread_join(sim->chip, NULL);
+  }
+  if (sim->tty >= 0)
+    close(sim->tty);
+  if (sim->pty >= 0)
+    close(sim->pty);
+  if (sim->dl)
+    dlclose(sim->dl);
+  if (sim->dir[0]) {
+    snprintf(path, sizeof path, "%s/ifdnfc.conf", sim->dir);
+    unlink(path);
+    rmdir(sim->dir);
+  }
+  pthread_mutex_destroy(&sim->lock);
+}
+
+static bool sim_symbol(struct sim *sim, void *fn, const char *name)
+{
+  void *sym = dlsym(sim->dl, name);
+
+  if (!sym)
+    fprintf(stderr, "%s has no %s.\n", sim->driver, name);
+  // POSIX guarantees that function pointers survive this
+  memcpy(fn, &sym, sizeof sym);
+  return sym != NULL;
+}
+
+/*
+ * Start the emulated chip, load the driver and activate it on the chip, as
+ * ifdnfc-activate does. Unless IFDNFC_CONF says otherwise the driver gets a
+ * configuration of its own, so that it does not save the activation.
+ */
+static bool sim_open(struct sim *sim)
+{
+  char path[sizeof sim->dir + 16], device_name[] = "ifdnfc-latency";
+  const char *tty;
+  struct termios tio;
+  BYTE tx[1 + 2 + 1024], rx[IFDNFC_STATUS_MAX_LENGTH];
+  DWORD rx_len = 0, len;
+  uint16_t connstring_len;
+  FILE *f;
+
+  pthread_mutex_init(&sim->lock, NULL);
+  if (!getenv("IFDNFC_CONF")) {
+    strcpy(sim->dir, "/tmp/ifdnfc-latency.XXXXXX");
+    if (!mkdtemp(sim->dir)) {
+      sim->dir[0] = '\0';
+      perror("mkdtemp");
+      return false;
+    }
+    snprintf(path, sizeof path, "%s/ifdnfc.conf", sim->dir);
+    f = fopen(path, "w");
+    if (!f || fputs("state_file =\n", f) < 0 || fclose(f)) {
+      perror(path);
+      return false;
+    }
+    setenv("IFDNFC_CONF", path, 1);
+  }
+
+  sim->pty = posix_openpt(O_RDWR | O_NOCTTY);
+  if (sim->pty < 0 || grantpt(sim->pty) || unlockpt(sim->pty) || !(tty = ptsname(sim->pty))) {
+    perror("posix_openpt");
+    return false;
+  }
+  sim->tty = open(tty, O_RDWR | O_NOCTTY);
+  if (sim->tty < 0 || tcgetattr(sim->tty, &tio)) {
+    perror(tty);
+    return false;
+  }
+  cfmakeraw(&tio);
+  tcsetattr(sim->tty, TCSANOW, &tio);
+  if (pthread_create(&sim->chip, NULL, sim_chip, sim)) {
+    fprintf(stderr, "Could not start the emulated chip.\n");
+    return false;
+  }
+  sim->running = true;
+
+  sim->dl = dlopen(sim->driver, RTLD_NOW);
+  if (!sim->dl) {
+    fprintf(stderr, "%s\n", dlerror());
+    return false;
+  }
+  if (!sim_symbol(sim, &sim->create_channel, "IFDHCreateChannelByName")
+      || !sim_symbol(sim, &sim->close_channel, "IFDHCloseChannel")
+      || !sim_symbol(sim, &sim->get_capabilities, "IFDHGetCapabilities")
+      || !sim_symbol(sim, &sim->control, "IFDHControl")
+      || !sim_symbol(sim, &sim->power, "IFDHPowerICC")
+      || !sim_symbol(sim, &sim->transmit, "IFDHTransmitToICC")
+      || !sim_symbol(sim, &sim->presence, "IFDHICCPresence"))
+    return false;
+  if (sim->create_channel(SIM_LUN, device_name) != IFD_SUCCESS) {
+    fprintf(stderr, "Could not create the channel.\n");
+    return false;
+  }
+  sim->channel = true;
+
+  // { IFDNFC_SET_ACTIVE, connstring length (uint16_t), connstring }
+  tx[0] = IFDNFC_SET_ACTIVE;
+  len = snprintf((char *) tx + 1 + sizeof connstring_len, sizeof tx - 1 - sizeof connstring_len,
+                 "pn532_uart:%s", tty);
+  connstring_len = len + 1;
+  memcpy(tx + 1, &connstring_len, sizeof connstring_len);
+  if (sim->control(SIM_LUN, IFDNFC_CTRL_ACTIVE, tx, 1 + sizeof connstring_len + connstring_len,
+                   rx, sizeof rx, &rx_len) != IFD_SUCCESS
+      || rx_len < 1 || rx[0] != IFDNFC_IS_ACTIVE) {
+    fprintf(stderr, "The driver could not open the emulated chip on %s.\n", tty);
+    return false;
+  }
+
+#if defined(HAVE_DECL_TAG_IFD_POLLING_THREAD_WITH_TIMEOUT) && HAVE_DECL_TAG_IFD_POLLING_THREAD_WITH_TIMEOUT
+  len = sizeof sim->poll;
+  if (sim->get_capabilities(SIM_LUN, TAG_IFD_POLLING_THREAD_WITH_TIMEOUT, &len,
+                            (PUCHAR) &sim->poll) != IFD_SUCCESS)
+    sim->poll = NULL;
+#endif
+
+  return true;
+}
+
+static int parse_hex(const char *s, BYTE *buf, size_t size)
+{
+  size_t len = 0;
+  unsigned int b;
+
+  while (*s) {
+    if (*s == ' ' || *s == ':') {
+      s++;
+      continue;
+    }
+    if (len == size || sscanf(s, "%2x", &b) != 1 || !s[1])
+      return -1;
+    buf[len++] = b;
+    s += 2;
+  }
+
+  return len;
+}
+
+static int compare_us(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+  return (x > y) - (x < y);
+}
+
+// Nearest rank of a sorted array
+static double percentile(const uint64_t *us, size_t n, unsigned int p)
+{
+  size_t rank = (p * n + 99) / 100;
+
+  return us[rank ? rank - 1 : 0] / 1000.0;
+}
+
+static void report(uint64_t *samples[STAGES], size_t taps)
+{
+  size_t i;
+
+  printf("%-8s %8s %8s %8s %8s %8s  (ms, %zu taps)\n",
+         "stage", "min", "p50", "p90", "p99", "max", taps);
+  for (i = 0; i < STAGES; i++) {
+    qsort(samples[i], taps, sizeof *samples[i], compare_us);
+    printf("%-8s %8.1f %8.1f %8.1f %8.1f %8.1f\n", stage_names[i],
+           samples[i][0] / 1000.0, percentile(samples[i], taps, 50),
+           percentile(samples[i], taps, 90), percentile(samples[i], taps, 99),
+           samples[i][taps - 1] / 1000.0);
+  }
+}
+
+// First reader whose name starts with prefix
+static char *find_reader(char *mszReaders, DWORD dwReaders, const char *prefix)
+{
+  char *reader;
+  size_t l;
+
+  for (reader = mszReaders; dwReaders > 1 && *reader;
+       l = strlen(reader) + 1, dwReaders -= l, reader += l)
+    if (!strncmp(reader, prefix, strlen(prefix)))
+      return reader;
+
+  return NULL;
+}
+
+static void usage(const char *name)
+{
+  printf("Usage: %s [-r reader] [-n taps] [-a apdu] [-v] [-s activation,apdu[,jitter] [-d driver]]\n"
+         "  -r  reader name or its beginning (default " IFDNFC_READER_NAME ")\n"
+         "  -n  number of taps (default %d)\n"
+         "  -a  APDU in hexadecimal (default " DEFAULT_APDU ")\n"
+         "  -v  print the time of each tap\n"
+         "  -s  simulated card taking these ms to be activated and to answer\n"
+         "      an APDU, jitter in percent\n"
+         "  -d  driver used with the simulated card (default " IFDNFC_DRIVER ")\n",
+         name, DEFAULT_TAPS);
+}
+
+int
+main(int argc, char *argv[])
+{
+  LONG rv;
+  const struct backend *backend = &pcsc_backend;
+  struct pcsc pcsc = { 0, 0, NULL };
+  struct sim sim;
+  void *ctx = &pcsc;
+  const char *reader = IFDNFC_READER_NAME;
+  char *mszReaders = NULL;
+  DWORD dwReaders;
+  BYTE apdu[MAX_BUFFER_SIZE], resp[MAX_BUFFER_SIZE];
+  DWORD resp_len;
+  int apdu_len, opt;
+  bool verbose = false, context = false, simulated = false;
+  unsigned long taps = DEFAULT_TAPS;
+  uint64_t *samples[STAGES] = { NULL };
+  uint64_t t[STAGES];
+  size_t i, tap;
+
+  memset(&sim, 0, sizeof sim);
+  sim.driver = IFDNFC_DRIVER;
+  sim.pty = sim.tty = -1;
+  sim.seed = sim.gap_seed = 1;
+  apdu_len = parse_hex(DEFAULT_APDU, apdu, sizeof apdu);
+  while ((opt = getopt(argc, argv, "r:n:a:s:d:vh")) != -1) {
+    switch (opt) {
+      case 'r':
+        reader = optarg;
+        break;
+      case 'n':
+        taps = strtoul(optarg, NULL, 10);
+        break;
+      case 'a':
+        apdu_len = parse_hex(optarg, apdu, sizeof apdu);
+        break;
+      case 's':
+        if (sscanf(optarg, "%u,%u,%u", &sim.ms[SIM_ACTIVATION], &sim.ms[SIM_APDU],
+                   &sim.jitter) < 2 || sim.jitter > 100) {
+          usage(argv[0]);
+          exit(EXIT_FAILURE);
+        }
+        simulated = true;
+        break;
+      case 'd':
+        sim.driver = optarg;
+        break;
+      case 'v':
+        verbose = true;
+        break;
+      default:
+        usage(argv[0]);
+        exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+  }
+  if (optind != argc || !taps || apdu_len < 4) {
+    usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < STAGES; i++) {
+    samples[i] = malloc(taps * sizeof *samples[i]);
+    if (!samples[i]) {
+      fprintf(stderr, "Out of memory.\n");
+      goto error;
+    }
+  }
+
+  if (simulated) {
+    backend = &sim_backend;
+    ctx = &sim;
+    if (!sim_open(&sim))
+      goto error;
+  } else {
+    rv = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &pcsc.hContext);
+    if (rv != SCARD_S_SUCCESS)
+      goto pcsc_error;
+    context = true;
+    dwReaders = 0;
+    rv = SCardListReaders(pcsc.hContext, NULL, NULL, &dwReaders);
+    if (rv != SCARD_S_SUCCESS)
+      goto pcsc_error;
+    mszReaders = malloc(dwReaders);
+    if (!mszReaders) {
+      fprintf(stderr, "Out of memory.\n");
+      goto error;
+    }
+    rv = SCardListReaders(pcsc.hContext, NULL, mszReaders, &dwReaders);
+    if (rv != SCARD_S_SUCCESS)
+      goto pcsc_error;
+    pcsc.reader = find_reader(mszReaders, dwReaders, reader);
+    if (!pcsc.reader) {
+      printf("Could not find a reader named: %s\n", reader);
+      rv = SCARD_E_NO_READERS_AVAILABLE;
+      goto pcsc_error;
+    }
+    printf("Tap a card on %s %lu times.\n", pcsc.reader, taps);
+  }
+
+  for (tap = 0; tap < taps; tap++) {
+    uint64_t entered, detected, connected, answered;
+
+    rv = backend->wait_card(ctx, &entered);
+    if (rv != SCARD_S_SUCCESS)
+      goto pcsc_error;
+    detected = now_us();
+    rv = backend->connect(ctx);
+    if (rv != SCARD_S_SUCCESS)
+      goto pcsc_error;
+    connected = now_us();
+    if (backend->card_entered)
+      backend->card_entered(ctx, &entered);
+    resp_len = sizeof resp;
+    rv = backend->transmit(ctx, apdu, apdu_len, resp, &resp_len);
+    answered = now_us();
+    if (rv != SCARD_S_SUCCESS)
+      goto pcsc_error;
+
+    t[STAGE_DETECT] = detected - entered;
+    t[STAGE_CONNECT] = connected - detected;
+    t[STAGE_APDU] = answered - connected;
+    t[STAGE_TOTAL] = answered - entered;
+    for (i = 0; i < STAGES; i++)
+      samples[i][tap] = t[i];
+    if (verbose)
+      printf("tap %zu: %.1f ms (detect %.1f, connect %.1f, apdu %.1f), SW %02X%02X\n",
+             tap + 1, t[STAGE_TOTAL] / 1000.0, t[STAGE_DETECT] / 1000.0,
+             t[STAGE_CONNECT] / 1000.0, t[STAGE_APDU] / 1000.0,
+             resp_len >= 2 ? resp[resp_len - 2] : 0, resp_len >= 2 ? resp[resp_len - 1] : 0);
+
+    rv = backend->disconnect(ctx);
+    if (rv != SCARD_S_SUCCESS)
+      goto pcsc_error;
+    rv = backend->wait_removal(ctx);
+    if (rv != SCARD_S_SUCCESS)
+      goto pcsc_error;
+  }
+
+  report(samples, taps);
+
+  if (backend == &sim_backend)
+    sim_close(&sim);
+  if (context)
+    SCardReleaseContext(pcsc.hContext);
+  free(mszReaders);
+  for (i = 0; i < STAGES; i++)
+    free(samples[i]);
+
+  exit(EXIT_SUCCESS);
+
+pcsc_error:
+  puts(pcsc_stringify_error(rv));
+error:
+  if (backend == &sim_backend)
+    sim_close(&sim);
+  if (context)
+    SCardReleaseContext(pcsc.hContext);
+  free(mszReaders);
+  for (i = 0; i < STAGES; i++)
+    free(samples[i]);
+
+  exit(EXIT_FAILURE);
+}
@@ -0,0 +1,263 @@
+/*
+ * Copyright (C) 2010 Frank Morgner
+ *
+ * This file is part of ifdnfc.
+ *
+ * ifdnfc is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * ifdnfc is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * ifdnfc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "isodep.h"
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+
+// Protocol control bytes (ISO/IEC 14443-4, 7.1.1)
+#define ISODEP_PCB_I         0x02
+#define ISODEP_PCB_R_ACK     0xA2
+#define ISODEP_PCB_R_NAK     0xB2
+#define ISODEP_PCB_S_DESELECT 0xC2
+#define ISODEP_PCB_S_WTX     0xF2
+#define ISODEP_PCB_CHAINING  0x10
+#define ISODEP_PCB_NAK       0x10
+#define ISODEP_PCB_BLOCK     0x01
+
+#define ISODEP_RATS          0xE0
+// Activation frame waiting time and FWT of S(DESELECT): 65536/fc, rounded up
+#define ISODEP_ACTIVATION_MS 5
+#define ISODEP_FWI_DEFAULT   4
+#define ISODEP_FWI_MAX       14
+#define ISODEP_WTXM_MAX      59
+
+// Frame sizes by FSDI/FSCI, larger ones do not fit into ISODEP_MAX_FRAME
+static const size_t isodep_frame_sizes[] = {
+  16, 24, 32, 40, 48, 64, 96, 128, 256,
+};
+
+#define ISODEP_FRAME_SIZES (sizeof isodep_frame_sizes / sizeof *isodep_frame_sizes)
+
+static size_t frame_size(unsigned int fsi)
+{
+  return fsi < ISODEP_FRAME_SIZES ? isodep_frame_sizes[fsi] : ISODEP_MAX_FRAME;
+}
+
+static unsigned int frame_size_index(size_t size)
+{
+  unsigned int fsi = 0;
+
+  while (fsi + 1 < ISODEP_FRAME_SIZES && isodep_frame_sizes[fsi + 1] <= size)
+    fsi++;
+  return fsi;
+}
+
+// FWT = 256 * 16 / fc * 2^FWI, about 302 us * 2^FWI
+static unsigned int fwt_ms(unsigned int fwi)
+{
+  return ((302u << fwi) + 999) / 1000;
+}
+
+bool isodep_rats(struct isodep *isodep, size_t fsd, unsigned int retries,
+                 uint8_t *ats, size_t *ats_len, isodep_transceive_fn transceive,
+                 void *ctx)
+{
+  unsigned int fsdi = frame_size_index(fsd), fsci = 2, fwi = ISODEP_FWI_DEFAULT, sfgi = 0;
+  const uint8_t rats[] = { ISODEP_RATS, fsdi << 4 };
+  uint8_t rx[ISODEP_MAX_FRAME];
+  unsigned int i;
+  size_t idx;
+  int res = -1;
+
+  for (i = 0; i <= retries; i++) {
+    res = transceive(ctx, rats, sizeof rats, rx, sizeof rx, ISODEP_ACTIVATION_MS);
+    // TL is the length of the ATS
+    if (res > 0 && rx[0] == res)
+      break;
+    res = -1;
+  }
+  if (res < 0 || (size_t) res - 1 > *ats_len)
+    return false;
+
+  if (res > 1) {
+    fsci = rx[1] & 0x0F;
+    idx = 2;
+    if (rx[1] & 0x10)       // TA
+      idx++;
+    if (rx[1] & 0x20 && idx < (size_t) res) {
+      // TB: FWI and SFGI, 15 is RFU
+      if (rx[idx] >> 4 != 15)
+        fwi = rx[idx] >> 4;
+      if ((rx[idx] & 0x0F) != 15)
+        sfgi = rx[idx] & 0x0F;
+    }
+  }
+  if (fwi > ISODEP_FWI_MAX)
+    fwi = ISODEP_FWI_MAX;
+
+  isodep->fsc = frame_size(fsci);
+  isodep->fsd = frame_size(fsdi);
+  isodep->fwt = fwt_ms(fwi);
+  isodep->block = 0;
+  isodep->retries = retries;
+  memcpy(ats, rx + 1, res - 1);
+  *ats_len = res - 1;
+  Log4(PCSC_LOG_DEBUG, "ISO-DEP: FSC %zu, FSD %zu, FWT %u ms.", isodep->fsc, isodep->fsd, isodep->fwt);
+
+  // Startup frame guard time before the first block
+  if (sfgi) {
+    unsigned long us = 302ul << sfgi;
+    const struct timespec sfgt = { us / 1000000, (us % 1000000) * 1000 };
+    nanosleep(&sfgt, NULL);
+  }
+
+  return true;
+}
+
+// Next part of the APDU as I-block
+static size_t i_block(struct isodep *isodep, const uint8_t *apdu, size_t apdu_len,
+                      size_t *sent, uint8_t *frame)
+{
+  size_t len = apdu_len - *sent;
+
+  frame[0] = ISODEP_PCB_I | isodep->block;
+  // PCB and CRC
+  if (len > isodep->fsc - 3) {
+    len = isodep->fsc - 3;
+    frame[0] |= ISODEP_PCB_CHAINING;
+    isodep->stats.chained++;
+  }
+  memcpy(frame + 1, apdu + *sent, len);
+  *sent += len;
+
+  return len + 1;
+}
+
+/*
+ * Block handling of the PCD (ISO/IEC 14443-4, 7.5.4): invalid blocks and
+ * timeouts are answered by an R(NAK), or an R(ACK) while the card is
+ * chaining; an R(ACK) for an older block gets the last I-block again.
+ */
+int isodep_transceive(struct isodep *isodep, const uint8_t *apdu, size_t apdu_len,
+                      uint8_t *resp, size_t resp_size,
+                      isodep_transceive_fn transceive, void *ctx)
+{
+  uint8_t last[ISODEP_MAX_FRAME], rx[ISODEP_MAX_FRAME], ctrl[2];
+  size_t sent = 0, resp_len = 0, last_len, tx_len;
+  unsigned int timeout = isodep->fwt, errors = 0, wtxm;
+  bool receiving = false;
+  const uint8_t *tx;
+  int res;
+
+  last_len = i_block(isodep, apdu, apdu_len, &sent, last);
+  tx = last;
+  tx_len = last_len;
+  for (;;) {
+    isodep->stats.blocks++;
+    res = transceive(ctx, tx, tx_len, rx, sizeof rx, timeout);
+    timeout = isodep->fwt;
+
+    if (res > 0 && (rx[0] & 0xE6) == ISODEP_PCB_I && !(rx[0] & 0x0C)) {
+      if (sent == apdu_len && (rx[0] & ISODEP_PCB_BLOCK) == isodep->block) {
+        isodep->block ^= ISODEP_PCB_BLOCK;
+        errors = 0;
+        if ((size_t) res - 1 > resp_size - resp_len) {
+          isodep->stats.errors++;
+          return ISODEP_EOVERFLOW;
+        }
+        memcpy(resp + resp_len, rx + 1, res - 1);
+        resp_len += res - 1;
+        if (!(rx[0] & ISODEP_PCB_CHAINING))
+          return resp_len;
+        isodep->stats.chained++;
+        receiving = true;
+        ctrl[0] = ISODEP_PCB_R_ACK | isodep->block;
+        tx = ctrl;
+        tx_len = 1;
+        continue;
+      }
+    } else if (res == 1 && (rx[0] & 0xF6) == ISODEP_PCB_R_ACK && !receiving) {
+      if ((rx[0] & ISODEP_PCB_BLOCK) == isodep->block) {
+        if (sent < apdu_len) {
+          // Next part of a chained APDU
+          isodep->block ^= ISODEP_PCB_BLOCK;
+          errors = 0;
+          last_len = i_block(isodep, apdu, apdu_len, &sent, last);
+          tx = last;
+          tx_len = last_len;
+          continue;
+        }
+      } else {
+        // The card did not get the last I-block
+        if (++errors > isodep->retries)
+          break;
+        isodep->stats.retransmissions++;
+        tx = last;
+        tx_len = last_len;
+        continue;
+      }
+    } else if (res == 2 && (rx[0] & 0xFE) == ISODEP_PCB_S_WTX) {
+      wtxm = rx[1] & 0x3F;
+      if (wtxm && wtxm <= ISODEP_WTXM_MAX) {
+        isodep->stats.wtx++;
+        ctrl[0] = ISODEP_PCB_S_WTX;
+        ctrl[1] = wtxm;
+        tx = ctrl;
+        tx_len = 2;
+        timeout = isodep->fwt * wtxm;
+        if (timeout > fwt_ms(ISODEP_FWI_MAX))
+          timeout = fwt_ms(ISODEP_FWI_MAX);
+        continue;
+      }
+    }
+
+    // Timeout, transmission error or invalid block
+    if (++errors > isodep->retries)
+      break;
+    isodep->stats.retransmissions++;
+    ctrl[0] = (receiving ? ISODEP_PCB_R_ACK : ISODEP_PCB_R_NAK) | isodep->block;
+    tx = ctrl;
+    tx_len = 1;
+  }
+
+  Log2(PCSC_LOG_INFO, "ISO-DEP exchange failed after %u errors.", errors);
+  isodep->stats.errors++;
+  return res < 0 ? res : ISODEP_EPROTOCOL;
+}
+
+bool isodep_present(struct isodep *isodep, isodep_transceive_fn transceive, void *ctx)
+{
+  const uint8_t nak = ISODEP_PCB_R_NAK | isodep->block;
+  uint8_t rx[ISODEP_MAX_FRAME];
+
+  isodep->stats.blocks++;
+  return transceive(ctx, &nak, 1, rx, sizeof rx, isodep->fwt) == 1
+         && (rx[0] & 0xF6) == ISODEP_PCB_R_ACK;
+}
+
+bool isodep_deselect(struct isodep *isodep, isodep_transceive_fn transceive, void *ctx)
+{
+  const uint8_t deselect = ISODEP_PCB_S_DESELECT;
+  uint8_t rx[ISODEP_MAX_FRAME];
+  unsigned int i;
+
+  for (i = 0; i <= isodep->retries; i++) {
+    isodep->stats.blocks++;
+    if (transceive(ctx, &deselect, 1, rx, sizeof rx, ISODEP_ACTIVATION_MS) == 1
+        && rx[0] == ISODEP_PCB_S_DESELECT)
+      return true;
+  }
+  return false;
+}
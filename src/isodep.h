@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2010 Frank Morgner
+ *
+ * This file is part of ifdnfc.
+ *
+ * ifdnfc is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * ifdnfc is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * ifdnfc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _ISODEP_H_
+#define _ISODEP_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Largest frame of this implementation, FSD and FSC included
+#define ISODEP_MAX_FRAME 256
+
+// Errors besides the ones of the transport
+#define ISODEP_EPROTOCOL (-1000)  // invalid blocks until the retries ran out
+#define ISODEP_EOVERFLOW (-1001)  // response larger than the buffer
+
+/**
+ * @brief Counters of the block layer, kept across cards
+ */
+struct isodep_stats {
+  uint32_t blocks;          // blocks sent
+  uint32_t chained;         // I-blocks sent or received with more to follow
+  uint32_t wtx;             // waiting time extensions granted
+  uint32_t retransmissions; // blocks sent again after an error
+  uint32_t errors;          // exchanges given up
+};
+
+/**
+ * @brief ISO14443-4 session with an activated card, without CID and NAD
+ */
+struct isodep {
+  size_t fsc;               // largest frame the card receives, CRC included
+  size_t fsd;               // largest frame we receive, CRC included
+  unsigned int fwt;         // frame waiting time in ms
+  uint8_t block;            // current block number
+  unsigned int retries;     // retransmissions of a block before giving up
+  struct isodep_stats stats;
+};
+
+/**
+ * @brief Exchange a raw frame with the card, CRC handled by the reader
+ *
+ * @param [in] timeout  ms the card may take to answer
+ *
+ * @return number of bytes received or a negative value on error
+ */
+typedef int (*isodep_transceive_fn)(void *ctx, const uint8_t *tx, size_t tx_len,
+                                    uint8_t *rx, size_t rx_len, unsigned int timeout);
+
+/**
+ * @brief Activate a selected ISO14443-A card (RATS) and start a session
+ *
+ * The counters of \a isodep are kept.
+ *
+ * @param [in,out] isodep
+ * @param [in]     fsd      largest frame to receive, rounded down to a valid FSD
+ * @param [in]     retries  retransmissions of a block before giving up
+ * @param [out]    ats      ATS without its length byte
+ * @param [in,out] ats_len  size of \a ats, then length of the ATS
+ * @param [in]     transceive
+ * @param [in]     ctx      passed to \a transceive
+ *
+ * @return true if the card answered with a valid ATS
+ */
+bool isodep_rats(struct isodep *isodep, size_t fsd, unsigned int retries,
+                 uint8_t *ats, size_t *ats_len, isodep_transceive_fn transceive,
+                 void *ctx);
+
+/**
+ * @brief Send an APDU and receive the response, chaining in both directions
+ *
+ * @return length of the response, a negative value of \a transceive or
+ * ISODEP_E* on error
+ */
+int isodep_transceive(struct isodep *isodep, const uint8_t *apdu, size_t apdu_len,
+                      uint8_t *resp, size_t resp_size,
+                      isodep_transceive_fn transceive, void *ctx);
+
+/**
+ * @brief Presence check: the card answers an R(NAK) with an R(ACK)
+ */
+bool isodep_present(struct isodep *isodep, isodep_transceive_fn transceive, void *ctx);
+
+/**
+ * @brief End the session, the card goes to HALT (S(DESELECT))
+ */
+bool isodep_deselect(struct isodep *isodep, isodep_transceive_fn transceive, void *ctx);
+
+#endif
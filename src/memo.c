@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2010 Frank Morgner
+ *
+ * This file is part of ifdnfc.
+ *
+ * ifdnfc is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * ifdnfc is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * ifdnfc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "memo.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct ifdnfc_memo_entry {
+  struct ifdnfc_memo_entry *next;
+  size_t key_len;
+  size_t resp_len;
+  uint8_t data[];           // key, then response
+};
+
+static size_t entry_size(const struct ifdnfc_memo_entry *entry)
+{
+  return entry->key_len + entry->resp_len;
+}
+
+// Link to the entry with the key, NULL if there is none
+static struct ifdnfc_memo_entry **find(struct ifdnfc_memo *memo,
+                                       const uint8_t *key, size_t key_len)
+{
+  struct ifdnfc_memo_entry **link;
+
+  for (link = &memo->entries; *link; link = &(*link)->next)
+    if ((*link)->key_len == key_len && !memcmp((*link)->data, key, key_len))
+      return link;
+  return NULL;
+}
+
+static void unlink_entry(struct ifdnfc_memo *memo, struct ifdnfc_memo_entry **link)
+{
+  struct ifdnfc_memo_entry *entry = *link;
+
+  *link = entry->next;
+  memo->size -= entry_size(entry);
+  free(entry);
+}
+
+void ifdnfc_memo_init(struct ifdnfc_memo *memo, size_t capacity)
+{
+  ifdnfc_memo_clear(memo);
+  memo->capacity = capacity;
+}
+
+void ifdnfc_memo_clear(struct ifdnfc_memo *memo)
+{
+  while (memo->entries)
+    unlink_entry(memo, &memo->entries);
+}
+
+bool ifdnfc_memo_lookup(struct ifdnfc_memo *memo, const uint8_t *key, size_t key_len,
+                        uint8_t *resp, size_t *resp_len)
+{
+  struct ifdnfc_memo_entry **link, *entry;
+
+  link = find(memo, key, key_len);
+  if (!link || (*link)->resp_len > *resp_len)
+    return false;
+
+  entry = *link;
+  *link = entry->next;
+  entry->next = memo->entries;
+  memo->entries = entry;
+
+  memcpy(resp, entry->data + entry->key_len, entry->resp_len);
+  *resp_len = entry->resp_len;
+
+  return true;
+}
+
+void ifdnfc_memo_store(struct ifdnfc_memo *memo, const uint8_t *key, size_t key_len,
+                       const uint8_t *resp, size_t resp_len)
+{
+  struct ifdnfc_memo_entry **link, *entry;
+
+  if (key_len + resp_len > memo->capacity)
+    return;
+  link = find(memo, key, key_len);
+  if (link)
+    unlink_entry(memo, link);
+  while (memo->size + key_len + resp_len > memo->capacity) {
+    for (link = &memo->entries; (*link)->next; link = &(*link)->next)
+      ;
+    unlink_entry(memo, link);
+  }
+
+  entry = malloc(sizeof *entry + key_len + resp_len);
+  if (!entry)
+    return;
+  entry->key_len = key_len;
+  entry->resp_len = resp_len;
+  memcpy(entry->data, key, key_len);
+  memcpy(entry->data + key_len, resp, resp_len);
+  entry->next = memo->entries;
+  memo->entries = entry;
+  memo->size += entry_size(entry);
+}
+
+void ifdnfc_memo_forget(struct ifdnfc_memo *memo, const uint8_t *prefix,
+                        size_t prefix_len)
+{
+  struct ifdnfc_memo_entry **link = &memo->entries;
+
+  while (*link) {
+    if ((*link)->key_len >= prefix_len && !memcmp((*link)->data, prefix, prefix_len))
+      unlink_entry(memo, link);
+    else
+      link = &(*link)->next;
+  }
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2010 Frank Morgner
+ *
+ * This file is part of ifdnfc.
+ *
+ * ifdnfc is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * ifdnfc is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * ifdnfc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _MEMO_H_
+#define _MEMO_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Responses of a device remembered by key, least recently used first
+ * to go once \a capacity is reached
+ */
+struct ifdnfc_memo {
+  size_t capacity;          // bytes of keys and responses, 0 disables
+  size_t size;
+  struct ifdnfc_memo_entry *entries;  // most recently used first
+};
+
+/**
+ * @brief Drop all entries and set the capacity
+ *
+ * \a memo must be zeroed or initialized before.
+ */
+void ifdnfc_memo_init(struct ifdnfc_memo *memo, size_t capacity);
+
+/**
+ * @brief Drop all entries, e.g. when the device goes away
+ */
+void ifdnfc_memo_clear(struct ifdnfc_memo *memo);
+
+/**
+ * @brief Find the response stored for a key
+ *
+ * @param [in,out] memo
+ * @param [in]     key
+ * @param [in]     key_len
+ * @param [out]    resp
+ * @param [in,out] resp_len  size of \a resp, then length of the response
+ *
+ * @return false if there is no response or it does not fit into \a resp
+ */
+bool ifdnfc_memo_lookup(struct ifdnfc_memo *memo, const uint8_t *key, size_t key_len,
+                        uint8_t *resp, size_t *resp_len);
+
+/**
+ * @brief Remember the response for a key, evicting older entries as needed
+ */
+void ifdnfc_memo_store(struct ifdnfc_memo *memo, const uint8_t *key, size_t key_len,
+                       const uint8_t *resp, size_t resp_len);
+
+/**
+ * @brief Drop the entries whose key starts with \a prefix
+ */
+void ifdnfc_memo_forget(struct ifdnfc_memo *memo, const uint8_t *prefix,
+                        size_t prefix_len);
+
+#endif
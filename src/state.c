@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2010 Frank Morgner
+ *
+ * This file is part of ifdnfc.
+ *
+ * ifdnfc is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * ifdnfc is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * ifdnfc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "state.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+
+/*
+ * One activation per line: DEVICENAME, "rf" or "se" and the connstring, e.g.
+ * "/dev/pcsc/1 rf pn532_uart:/dev/ttyUSB0:115200"
+ */
+
+bool ifdnfc_state_load(struct ifdnfc_state *state, const char *path)
+{
+  char buf[sizeof(state->entries[0].device_name) + 4 + sizeof(nfc_connstring)];
+  char device_name[sizeof(state->entries[0].device_name)];
+  char mode[3];
+  nfc_connstring connstring;
+  unsigned int lineno = 0;
+  bool ok = true;
+  FILE *f;
+
+  state->entries_len = 0;
+  f = fopen(path, "r");
+  if (!f) {
+    Log2(PCSC_LOG_DEBUG, "No activation state in %s.", path);
+    return true;
+  }
+
+  while (fgets(buf, sizeof buf, f)) {
+    lineno++;
+    if (buf[0] == '#' || buf[0] == '\n')
+      continue;
+    if (sscanf(buf, "%255s %2s %1023[^\n]", device_name, mode, connstring) != 3
+        || (strcmp(mode, "rf") && strcmp(mode, "se"))
+        || !ifdnfc_state_set(state, device_name, !strcmp(mode, "se"), connstring)) {
+      Log3(PCSC_LOG_ERROR, "%s:%u: invalid activation.", path, lineno);
+      ok = false;
+    }
+  }
+  fclose(f);
+
+  return ok;
+}
+
+bool ifdnfc_state_save(const struct ifdnfc_state *state, const char *path)
+{
+  char tmp[512];
+  size_t i;
+  FILE *f;
+  int fd;
+
+  if (snprintf(tmp, sizeof tmp, "%s.XXXXXX", path) >= (int) sizeof tmp)
+    return false;
+  // Not fopen(): it would follow a symlink planted under the name
+  fd = mkstemp(tmp);
+  if (fd < 0) {
+    Log2(PCSC_LOG_ERROR, "Could not write %s.", path);
+    return false;
+  }
+  f = fdopen(fd, "w");
+  if (!f) {
+    Log2(PCSC_LOG_ERROR, "Could not write %s.", path);
+    close(fd);
+    remove(tmp);
+    return false;
+  }
+  fprintf(f, "# Devices activated with ifdnfc-activate, restored when pcscd starts\n");
+  for (i = 0; i < state->entries_len; i++)
+    fprintf(f, "%s %s %s\n", state->entries[i].device_name,
+            state->entries[i].secure_element ? "se" : "rf", state->entries[i].connstring);
+  if (fclose(f) != 0 || rename(tmp, path) != 0) {
+    Log2(PCSC_LOG_ERROR, "Could not write %s.", path);
+    remove(tmp);
+    return false;
+  }
+
+  return true;
+}
+
+const struct ifdnfc_state_entry *ifdnfc_state_find(const struct ifdnfc_state *state,
+    const char *device_name)
+{
+  size_t i;
+
+  for (i = 0; i < state->entries_len; i++)
+    if (!strcmp(state->entries[i].device_name, device_name))
+      return &state->entries[i];
+  return NULL;
+}
+
+bool ifdnfc_state_set(struct ifdnfc_state *state, const char *device_name,
+                      bool secure_element, const char *connstring)
+{
+  struct ifdnfc_state_entry *entry;
+
+  if (strlen(device_name) >= sizeof entry->device_name
+      || strlen(connstring) >= sizeof entry->connstring
+      || strchr(device_name, ' ') || strchr(connstring, '\n'))
+    return false;
+
+  entry = (struct ifdnfc_state_entry *) ifdnfc_state_find(state, device_name);
+  if (!entry) {
+    if (state->entries_len == IFDNFC_STATE_MAX_ENTRIES)
+      return false;
+    entry = &state->entries[state->entries_len++];
+    strcpy(entry->device_name, device_name);
+  }
+  entry->secure_element = secure_element;
+  strcpy(entry->connstring, connstring);
+
+  return true;
+}
+
+void ifdnfc_state_remove(struct ifdnfc_state *state, const char *device_name)
+{
+  size_t i;
+
+  for (i = 0; i < state->entries_len; i++)
+    if (!strcmp(state->entries[i].device_name, device_name)) {
+      memmove(&state->entries[i], &state->entries[i + 1],
+              (state->entries_len - i - 1) * sizeof *state->entries);
+      state->entries_len--;
+      return;
+    }
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2010 Frank Morgner
+ *
+ * This file is part of ifdnfc.
+ *
+ * ifdnfc is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * ifdnfc is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * ifdnfc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _STATE_H_
+#define _STATE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <nfc/nfc.h>
+
+#define IFDNFC_STATE_MAX_ENTRIES 32
+
+/**
+ * @brief Device activated through IFDNFC_CTRL_ACTIVE on a reader of pcscd
+ */
+struct ifdnfc_state_entry {
+  char device_name[256];              // DEVICENAME given by pcscd
+  bool secure_element;                // activated with IFDNFC_SET_ACTIVE_SE
+  nfc_connstring connstring;
+};
+
+struct ifdnfc_state {
+  struct ifdnfc_state_entry entries[IFDNFC_STATE_MAX_ENTRIES];
+  size_t entries_len;
+};
+
+/**
+ * @brief Read the activations saved by ifdnfc_state_save()
+ *
+ * A missing file leaves \a state empty.
+ *
+ * @return false if the file exists but could not be parsed completely
+ */
+bool ifdnfc_state_load(struct ifdnfc_state *state, const char *path);
+
+/**
+ * @brief Replace the file atomically with the activations of \a state
+ */
+bool ifdnfc_state_save(const struct ifdnfc_state *state, const char *path);
+
+/**
+ * @return the activation of the reader or \c NULL
+ */
+const struct ifdnfc_state_entry *ifdnfc_state_find(const struct ifdnfc_state *state,
+    const char *device_name);
+
+/**
+ * @brief Record the activation of a reader, replacing the previous one
+ *
+ * @return false if \a state is full or a string does not fit
+ */
+bool ifdnfc_state_set(struct ifdnfc_state *state, const char *device_name,
+                      bool secure_element, const char *connstring);
+
+void ifdnfc_state_remove(struct ifdnfc_state *state, const char *device_name);
+
+#endif
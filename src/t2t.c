@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2010 Frank Morgner
+ *
+ * This file is part of ifdnfc.
+ *
+ * ifdnfc is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * ifdnfc is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * ifdnfc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "t2t.h"
+#include <string.h>
+
+#include "log.h"
+
+#define T2T_READ      0x30
+#define T2T_GET_VERSION 0x60
+#define T2T_FAST_READ 0x3A
+
+// User memory of the NXP tags by the storage size byte of GET_VERSION
+static const struct {
+  uint8_t storage_size;
+  unsigned int user_end;
+} t2t_versions[] = {
+  { 0x0B, 16 },             // MIFARE Ultralight EV1 MF0UL11, NTAG210
+  { 0x0E, 36 },             // MIFARE Ultralight EV1 MF0UL21, NTAG212
+  { 0x0F, 40 },             // NTAG213
+  { 0x11, 130 },            // NTAG215
+  { 0x13, 226 },            // NTAG216
+};
+
+static bool is_cached(const struct t2t_tag *tag, unsigned int page)
+{
+  return tag->cached[page / 8] & (1 << (page % 8));
+}
+
+static void set_cached(struct t2t_tag *tag, unsigned int page)
+{
+  tag->cached[page / 8] |= 1 << (page % 8);
+}
+
+void t2t_reset(struct t2t_tag *tag)
+{
+  tag->identified = false;
+  tag->fast_read = false;
+  tag->user_end = 0;
+  t2t_invalidate(tag);
+}
+
+void t2t_invalidate(struct t2t_tag *tag)
+{
+  memset(tag->cached, 0, sizeof tag->cached);
+}
+
+// User memory size from the capability container, for tags without GET_VERSION
+static bool read_cc(struct t2t_tag *tag, t2t_transceive_fn transceive, void *ctx)
+{
+  uint8_t tx[2] = { T2T_READ, 3 };
+  uint8_t rx[16];
+
+  if (transceive(ctx, tx, sizeof tx, rx, sizeof rx) != sizeof rx)
+    return false;
+
+  if (rx[0] == 0xE1 && rx[2]) {
+    // data area size in units of 8 bytes
+    tag->user_end = 4 + rx[2] * 2;
+  } else {
+    // no NDEF, assume a MIFARE Ultralight
+    tag->user_end = 16;
+  }
+  if (tag->user_end > T2T_MAX_PAGES)
+    tag->user_end = T2T_MAX_PAGES;
+
+  return true;
+}
+
+static bool identify(struct t2t_tag *tag, t2t_transceive_fn transceive,
+                     t2t_reselect_fn reselect, void *ctx)
+{
+  uint8_t tx[1] = { T2T_GET_VERSION };
+  uint8_t version[8];
+  size_t i;
+
+  if (transceive(ctx, tx, sizeof tx, version, sizeof version) == sizeof version
+      && version[0] == 0x04) {
+    // NXP tags with GET_VERSION all support FAST_READ
+    tag->fast_read = true;
+    for (i = 0; i < sizeof t2t_versions / sizeof *t2t_versions; i++) {
+      if (t2t_versions[i].storage_size == version[6]) {
+        tag->user_end = t2t_versions[i].user_end;
+        break;
+      }
+    }
+    if (!tag->user_end && !read_cc(tag, transceive, ctx))
+      return false;
+  } else {
+    // The tag went back to idle on the unknown command
+    if (!reselect(ctx) || !read_cc(tag, transceive, ctx))
+      return false;
+  }
+
+  Log3(PCSC_LOG_DEBUG, "Type 2 tag with %u pages of user memory%s.",
+       tag->user_end - 4, tag->fast_read ? " and FAST_READ" : "");
+  tag->identified = true;
+
+  return true;
+}
+
+// Fetch the pages first to end - 1 into the cache
+static bool fetch(struct t2t_tag *tag, unsigned int first, unsigned int end,
+                  t2t_transceive_fn transceive, void *ctx)
+{
+  uint8_t tx[3];
+  uint8_t rx[T2T_FAST_READ_PAGES * T2T_PAGE_SIZE];
+  unsigned int page, n;
+  int res;
+
+  while (first < end) {
+    if (tag->fast_read) {
+      n = end - first;
+      if (n > T2T_FAST_READ_PAGES)
+        n = T2T_FAST_READ_PAGES;
+      tx[0] = T2T_FAST_READ;
+      tx[1] = first;
+      tx[2] = first + n - 1;
+      res = transceive(ctx, tx, 3, rx, n * T2T_PAGE_SIZE);
+    } else {
+      // READ always returns 4 pages, rolling over at the end of the memory
+      n = 4;
+      tx[0] = T2T_READ;
+      tx[1] = first;
+      res = transceive(ctx, tx, 2, rx, n * T2T_PAGE_SIZE);
+    }
+    if (res != (int) (n * T2T_PAGE_SIZE)) {
+      Log2(PCSC_LOG_ERROR, "Could not read page %u of Type 2 tag.", first);
+      return false;
+    }
+
+    for (page = 0; page < n && first + page < tag->user_end; page++) {
+      memcpy(tag->pages + (first + page) * T2T_PAGE_SIZE, rx + page * T2T_PAGE_SIZE, T2T_PAGE_SIZE);
+      set_cached(tag, first + page);
+    }
+    first += n;
+  }
+
+  return true;
+}
+
+int t2t_read(struct t2t_tag *tag, unsigned int page, uint8_t *buf, size_t len,
+             t2t_transceive_fn transceive, t2t_reselect_fn reselect, void *ctx)
+{
+  unsigned int end, first, last;
+
+  if (!tag->identified && !identify(tag, transceive, reselect, ctx))
+    return -1;
+
+  if (page >= tag->user_end)
+    return 0;
+  end = page + (len + T2T_PAGE_SIZE - 1) / T2T_PAGE_SIZE;
+  if (end > tag->user_end)
+    end = tag->user_end;
+  if (len > (end - page) * T2T_PAGE_SIZE)
+    len = (end - page) * T2T_PAGE_SIZE;
+
+  // one command for each run of missing pages
+  for (first = page; first < end; first = last) {
+    if (is_cached(tag, first)) {
+      last = first + 1;
+      continue;
+    }
+    for (last = first; last < end && !is_cached(tag, last); last++)
+      ;
+    if (!fetch(tag, first, last, transceive, ctx))
+      return -1;
+  }
+
+  memcpy(buf, tag->pages + page * T2T_PAGE_SIZE, len);
+
+  return len;
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2010 Frank Morgner
+ *
+ * This file is part of ifdnfc.
+ *
+ * ifdnfc is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * ifdnfc is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * ifdnfc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _T2T_H_
+#define _T2T_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define T2T_PAGE_SIZE 4
+#define T2T_MAX_PAGES 256
+// pages per FAST_READ, keeps the response within one reader frame
+#define T2T_FAST_READ_PAGES 60
+
+/**
+ * @brief What is known about a selected NFC Forum Type 2 tag
+ */
+struct t2t_tag {
+  bool identified;
+  bool fast_read;           // FAST_READ (0x3A) is supported
+  unsigned int user_end;    // first page after the user memory
+  uint8_t pages[T2T_MAX_PAGES * T2T_PAGE_SIZE];
+  uint8_t cached[T2T_MAX_PAGES / 8];
+};
+
+/**
+ * @brief Exchange a raw frame with the tag, CRC handled by the reader
+ *
+ * @return number of bytes received or a negative value on error
+ */
+typedef int (*t2t_transceive_fn)(void *ctx, const uint8_t *tx, size_t tx_len,
+                                 uint8_t *rx, size_t rx_len);
+
+/**
+ * @brief Select the tag again after it went back to idle on a NAK
+ */
+typedef bool (*t2t_reselect_fn)(void *ctx);
+
+/**
+ * @brief Forget everything about the tag, e.g. when a new one is selected
+ */
+void t2t_reset(struct t2t_tag *tag);
+
+/**
+ * @brief Drop the cached pages, e.g. when the tag may have been written
+ */
+void t2t_invalidate(struct t2t_tag *tag);
+
+/**
+ * @brief Read from the user memory of the tag
+ *
+ * Missing pages are fetched with as few commands as possible and cached.
+ * Reading stops at the end of the user memory.
+ *
+ * @param [in,out] tag
+ * @param [in]     page  first page to read
+ * @param [out]    buf
+ * @param [in]     len   number of bytes to read
+ * @param [in]     transceive
+ * @param [in]     reselect
+ * @param [in]     ctx   passed to \a transceive and \a reselect
+ *
+ * @return number of bytes read, 0 if \a page is outside of the user memory,
+ * -1 on error
+ */
+int t2t_read(struct t2t_tag *tag, unsigned int page, uint8_t *buf, size_t len,
+             t2t_transceive_fn transceive, t2t_reselect_fn reselect, void *ctx);
+
+#endif
@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2010 Frank Morgner
+ *
+ * This file is part of ifdnfc.
+ *
+ * ifdnfc is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * ifdnfc is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * ifdnfc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "trace.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+bool ifdnfc_trace_enabled = false;
+static char trace_path[256];
+static uint64_t trace_threshold;
+
+static uint64_t now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void ifdnfc_trace_setup(const char *path, unsigned int threshold_ms)
+{
+  if (!path || !*path || strlen(path) >= sizeof trace_path) {
+    ifdnfc_trace_enabled = false;
+    return;
+  }
+  strcpy(trace_path, path);
+  trace_threshold = (uint64_t) threshold_ms * 1000;
+  ifdnfc_trace_enabled = true;
+  Log3(PCSC_LOG_INFO, "Tracing activations slower than %u ms to %s.", threshold_ms, trace_path);
+}
+
+void ifdnfc_trace_start(struct ifdnfc_trace *trace, int tid)
+{
+  if (!ifdnfc_trace_enabled)
+    return;
+  trace->recording = true;
+  trace->tid = tid;
+  trace->spans_len = 0;
+  trace->depth = 0;
+}
+
+size_t ifdnfc_trace_begin(struct ifdnfc_trace *trace, const char *name)
+{
+  struct ifdnfc_trace_span *span;
+
+  if (!ifdnfc_trace_enabled || !trace->recording
+      || trace->spans_len == IFDNFC_TRACE_MAX_SPANS
+      || trace->depth == IFDNFC_TRACE_MAX_DEPTH)
+    return IFDNFC_TRACE_NONE;
+
+  span = &trace->spans[trace->spans_len];
+  span->name = name;
+  span->depth = trace->depth;
+  span->end = 0;
+  span->start = now_us();
+  trace->stack[trace->depth++] = trace->spans_len;
+
+  return trace->spans_len++;
+}
+
+void ifdnfc_trace_end(struct ifdnfc_trace *trace, size_t span)
+{
+  uint64_t now;
+
+  if (span == IFDNFC_TRACE_NONE || !trace->recording)
+    return;
+
+  now = now_us();
+  while (trace->depth > 0) {
+    size_t top = trace->stack[--trace->depth];
+    trace->spans[top].end = now;
+    if (top == span)
+      break;
+  }
+}
+
+static void trace_write(const struct ifdnfc_trace *trace)
+{
+  char tmp[sizeof trace_path + 7];
+  size_t i;
+  FILE *f;
+  int fd;
+
+  // pcscd runs as root: never follow a file planted in a shared directory
+  snprintf(tmp, sizeof tmp, "%s.XXXXXX", trace_path);
+  fd = mkstemp(tmp);
+  if (fd < 0) {
+    Log2(PCSC_LOG_ERROR, "Could not write trace to %s.", trace_path);
+    return;
+  }
+  fchmod(fd, 0644);
+  f = fdopen(fd, "w");
+  if (!f) {
+    Log2(PCSC_LOG_ERROR, "Could not write trace to %s.", trace_path);
+    close(fd);
+    unlink(tmp);
+    return;
+  }
+
+  fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+  for (i = 0; i < trace->spans_len; i++) {
+    const struct ifdnfc_trace_span *span = &trace->spans[i];
+    fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"ifdnfc\",\"ph\":\"X\","
+            "\"ts\":%" PRIu64 ",\"dur\":%" PRIu64 ",\"pid\":%ld,\"tid\":%d}",
+            i ? "," : "", span->name, span->start,
+            (span->end ? span->end : span->start) - span->start,
+            (long) getpid(), trace->tid);
+  }
+  fprintf(f, "\n]}\n");
+
+  if (fclose(f) != 0 || rename(tmp, trace_path) != 0) {
+    Log2(PCSC_LOG_ERROR, "Could not write trace to %s.", trace_path);
+    unlink(tmp);
+  }
+}
+
+void ifdnfc_trace_finish(struct ifdnfc_trace *trace)
+{
+  uint64_t end = 0;
+  size_t i;
+
+  if (!trace->recording)
+    return;
+  trace->recording = false;
+  if (trace->spans_len == 0)
+    return;
+
+  for (i = 0; i < trace->spans_len; i++)
+    if (trace->spans[i].end > end)
+      end = trace->spans[i].end;
+  if (end - trace->spans[0].start >= trace_threshold)
+    trace_write(trace);
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2010 Frank Morgner
+ *
+ * This file is part of ifdnfc.
+ *
+ * ifdnfc is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * ifdnfc is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * ifdnfc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define IFDNFC_TRACE_MAX_SPANS 128
+#define IFDNFC_TRACE_MAX_DEPTH 8
+#define IFDNFC_TRACE_NONE      ((size_t) -1)
+
+struct ifdnfc_trace_span {
+  const char *name;
+  uint64_t start;   // us
+  uint64_t end;     // us, 0 while open
+  unsigned int depth;
+};
+
+/**
+ * @brief Timeline of one card activation
+ *
+ * A timeline starts with ifdnfc_trace_start() when a card may show up and
+ * ends with ifdnfc_trace_finish() after the first APDU. Spans are only
+ * recorded in between and nest in the order they are opened.
+ */
+struct ifdnfc_trace {
+  bool recording;
+  int tid;
+  struct ifdnfc_trace_span spans[IFDNFC_TRACE_MAX_SPANS];
+  size_t spans_len;
+  size_t stack[IFDNFC_TRACE_MAX_DEPTH];
+  size_t depth;
+};
+
+extern bool ifdnfc_trace_enabled;
+
+/**
+ * @brief Enable tracing
+ *
+ * @param [in] path          where to write the Chrome trace-event JSON
+ * @param [in] threshold_ms  only timelines taking at least this long are written
+ */
+void ifdnfc_trace_setup(const char *path, unsigned int threshold_ms);
+
+void ifdnfc_trace_start(struct ifdnfc_trace *trace, int tid);
+
+/**
+ * @brief Open a span
+ *
+ * @return handle for ifdnfc_trace_end()
+ */
+size_t ifdnfc_trace_begin(struct ifdnfc_trace *trace, const char *name);
+
+/**
+ * @brief Close \a span and all spans opened after it
+ */
+void ifdnfc_trace_end(struct ifdnfc_trace *trace, size_t span);
+
+/**
+ * @brief Close the timeline and write it if it was slow
+ */
+void ifdnfc_trace_finish(struct ifdnfc_trace *trace);
+
+#endif
@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2010 Frank Morgner
+ *
+ * This file is part of ifdnfc.
+ *
+ * ifdnfc is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * ifdnfc is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * ifdnfc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "worker.h"
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+static void *worker_main(void *arg)
+{
+  struct ifdnfc_worker *worker = arg;
+  struct ifdnfc_work *work;
+
+  pthread_mutex_lock(&worker->lock);
+  for (;;) {
+    while (!worker->len && !worker->stop)
+      pthread_cond_wait(&worker->queued, &worker->lock);
+    if (!worker->len)
+      break;
+
+    work = worker->queue[worker->head];
+    worker->head = (worker->head + 1) % IFDNFC_WORKER_QUEUE_DEPTH;
+    worker->len--;
+    worker->current = work;
+    pthread_mutex_unlock(&worker->lock);
+
+    work->run(work);
+
+    pthread_mutex_lock(&worker->lock);
+    worker->current = NULL;
+    work->done = true;
+    if (work->abandoned) {
+      pthread_mutex_unlock(&worker->lock);
+      work->release(work);
+      pthread_mutex_lock(&worker->lock);
+    }
+    pthread_cond_broadcast(&worker->finished);
+  }
+  pthread_mutex_unlock(&worker->lock);
+
+  return NULL;
+}
+
+bool ifdnfc_worker_start(struct ifdnfc_worker *worker)
+{
+  pthread_condattr_t attr;
+
+  memset(worker, 0, sizeof *worker);
+  pthread_mutex_init(&worker->lock, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&worker->queued, NULL);
+  pthread_cond_init(&worker->finished, &attr);
+  pthread_condattr_destroy(&attr);
+
+  if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+    pthread_cond_destroy(&worker->finished);
+    pthread_cond_destroy(&worker->queued);
+    pthread_mutex_destroy(&worker->lock);
+    return false;
+  }
+  worker->running = true;
+
+  return true;
+}
+
+void ifdnfc_worker_stop(struct ifdnfc_worker *worker)
+{
+  if (!worker->running)
+    return;
+
+  pthread_mutex_lock(&worker->lock);
+  worker->stop = true;
+  pthread_cond_signal(&worker->queued);
+  pthread_mutex_unlock(&worker->lock);
+
+  pthread_join(worker->thread, NULL);
+  worker->running = false;
+  pthread_cond_destroy(&worker->finished);
+  pthread_cond_destroy(&worker->queued);
+  pthread_mutex_destroy(&worker->lock);
+}
+
+static bool worker_dequeue(struct ifdnfc_worker *worker, struct ifdnfc_work *work)
+{
+  size_t i, j;
+
+  for (i = 0; i < worker->len; i++) {
+    if (worker->queue[(worker->head + i) % IFDNFC_WORKER_QUEUE_DEPTH] != work)
+      continue;
+    for (j = i; j + 1 < worker->len; j++)
+      worker->queue[(worker->head + j) % IFDNFC_WORKER_QUEUE_DEPTH] =
+        worker->queue[(worker->head + j + 1) % IFDNFC_WORKER_QUEUE_DEPTH];
+    worker->len--;
+    return true;
+  }
+
+  return false;
+}
+
+enum ifdnfc_work_status ifdnfc_worker_submit(struct ifdnfc_worker *worker,
+    struct ifdnfc_work *work, unsigned int timeout_ms)
+{
+  enum ifdnfc_work_status status = IFDNFC_WORK_DONE;
+  struct timespec deadline;
+
+  if (!worker->running)
+    return IFDNFC_WORK_REJECTED;
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  work->done = false;
+  work->abandoned = false;
+
+  pthread_mutex_lock(&worker->lock);
+  while (worker->len == IFDNFC_WORKER_QUEUE_DEPTH) {
+    if (worker->stop || pthread_cond_timedwait(&worker->finished, &worker->lock, &deadline) == ETIMEDOUT) {
+      pthread_mutex_unlock(&worker->lock);
+      return IFDNFC_WORK_REJECTED;
+    }
+  }
+  if (worker->stop) {
+    pthread_mutex_unlock(&worker->lock);
+    return IFDNFC_WORK_REJECTED;
+  }
+  worker->queue[(worker->head + worker->len) % IFDNFC_WORKER_QUEUE_DEPTH] = work;
+  worker->len++;
+  pthread_cond_signal(&worker->queued);
+
+  while (!work->done) {
+    if (pthread_cond_timedwait(&worker->finished, &worker->lock, &deadline) == ETIMEDOUT
+        && !work->done) {
+      if (worker_dequeue(worker, work)) {
+        status = IFDNFC_WORK_TIMEOUT;
+      } else {
+        work->abandoned = true;
+        status = IFDNFC_WORK_ABANDONED;
+      }
+      break;
+    }
+  }
+  pthread_mutex_unlock(&worker->lock);
+
+  return status;
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2010 Frank Morgner
+ *
+ * This file is part of ifdnfc.
+ *
+ * ifdnfc is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * ifdnfc is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * ifdnfc.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _WORKER_H_
+#define _WORKER_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define IFDNFC_WORKER_QUEUE_DEPTH 8
+
+struct ifdnfc_work;
+typedef void (*ifdnfc_work_fn)(struct ifdnfc_work *work);
+
+/**
+ * @brief Unit of work, to be embedded in the request it executes
+ */
+struct ifdnfc_work {
+  ifdnfc_work_fn run;
+  ifdnfc_work_fn release;   // frees the request if its submitter gave up
+  bool done;
+  bool abandoned;
+};
+
+enum ifdnfc_work_status {
+  IFDNFC_WORK_DONE,         // executed, owned by the submitter
+  IFDNFC_WORK_REJECTED,     // queue full or worker stopped, owned by the submitter
+  IFDNFC_WORK_TIMEOUT,      // never started, owned by the submitter
+  IFDNFC_WORK_ABANDONED,    // still running, released by the worker
+};
+
+/**
+ * @brief Thread executing the work of one device in submission order
+ */
+struct ifdnfc_worker {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t queued;
+  pthread_cond_t finished;
+  struct ifdnfc_work *queue[IFDNFC_WORKER_QUEUE_DEPTH];
+  size_t head;
+  size_t len;
+  struct ifdnfc_work *current;
+  bool running;
+  bool stop;
+};
+
+bool ifdnfc_worker_start(struct ifdnfc_worker *worker);
+
+/**
+ * @brief Execute the queued work and join the thread
+ */
+void ifdnfc_worker_stop(struct ifdnfc_worker *worker);
+
+/**
+ * @brief Queue \a work and wait until it was executed
+ *
+ * @param [in] worker
+ * @param [in] work
+ * @param [in] timeout_ms  deadline for queueing and execution
+ *
+ * @return whether \a work was executed, see \ref ifdnfc_work_status for
+ * who owns \a work afterwards
+ */
+enum ifdnfc_work_status ifdnfc_worker_submit(struct ifdnfc_worker *worker,
+    struct ifdnfc_work *work, unsigned int timeout_ms);
+
+#endif